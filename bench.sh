@@ -0,0 +1,10 @@
+echo "#################"
+echo "    COMPILING    "
+echo "#################"
+
+g++ -Wall -fopenmp -std=c++23 -O3 -Isrc benchmarks/benchmarks.cpp $(ls src/*.cpp | grep -v src/main.cpp) -o benchmark
+
+echo "#################"
+echo "     RUNNING     "
+echo "#################"
+./benchmark "$@"
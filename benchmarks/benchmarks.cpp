@@ -0,0 +1,711 @@
+#include "matrix.hpp"
+#include "model.hpp"
+#include "conv.hpp"
+#include "attention.hpp"
+#include "embedding.hpp"
+#include "activations.hpp"
+#include "loss.hpp"
+#include "optimizers.hpp"
+#include "trainer.hpp"
+#include "data_loader.hpp"
+#include "dataset.hpp"
+#include "evaluate.hpp"
+
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <random>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <algorithm>
+#include <omp.h>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+
+Matrix random_matrix(size_t rows, size_t cols, float min = 0, float max = 1) {
+    std::mt19937 gen(1234);
+    std::uniform_real_distribution<float> dist(min, max);
+    Matrix output(rows, cols, 0);
+    for (size_t row = 0; row < rows; row++) {
+        for (size_t col = 0; col < cols; col++) {
+            output[row, col] = dist(gen);
+        }
+    }
+    return output;
+}
+
+Matrix random_one_hot(size_t rows, size_t num_classes) {
+    std::mt19937 gen(4321);
+    std::uniform_int_distribution<size_t> dist(0, num_classes - 1);
+    Matrix labels(rows, 1, 0);
+    for (size_t row = 0; row < rows; row++) {
+        labels[row, 0] = dist(gen);
+    }
+    return Matrix::one_hot_encoding(labels, num_classes);
+}
+
+/**
+ * @brief Run the function repeatedly and return the mean wall time of one run in milliseconds
+ */
+double time_ms(std::function<void()> fn, size_t repeats) {
+    fn(); // warm up
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; i++) {
+        fn();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - begin).count() / repeats;
+}
+
+size_t parameter_count(Model& model) {
+    size_t count = 0;
+    for (auto& parameter : model.parameters()) {
+        count += parameter->data.rows() * parameter->data.cols();
+    }
+    return count;
+}
+
+/**
+ * @brief Forward + backward time of a small conv net against the dense baseline from main.cpp
+ */
+void bench_conv() {
+    const size_t batch_size = 128;
+    Matrix x = random_matrix(batch_size, 28 * 28);
+    Matrix y = random_one_hot(batch_size, 10);
+    LeakyReLU leaky;
+    Linear lin;
+    CategoricalCrossEntropy loss;
+
+    FullyConnectedLayer dense1(28 * 28, 256, leaky);
+    FullyConnectedLayer dense2(256, 32, leaky);
+    FullyConnectedLayer dense3(32, 10, lin);
+    Sequential dense({dense1, dense2, dense3});
+
+    for (TensorLayout layout : {TensorLayout::NCHW, TensorLayout::NHWC}) {
+        ImageShape image{1, 28, 28, layout};
+        Conv2DLayer conv1(image, 8, 3, 1, 1, leaky);
+        MaxPool2D pool1(conv1.output_shape(), 2, 2);
+        Conv2DLayer conv2(pool1.output_shape(), 16, 3, 1, 1, leaky);
+        MaxPool2D pool2(conv2.output_shape(), 2, 2);
+        Flatten flatten(pool2.output_shape());
+        FullyConnectedLayer head(pool2.output_shape().size(), 10, lin);
+        Sequential conv({conv1, pool1, conv2, pool2, flatten, head});
+
+        double ms = time_ms([&]() {
+            Matrix output = conv.forward(x);
+            conv.backward(loss.compute_error_derivative(y, output));
+        }, 5);
+        std::cout << "conv " << (layout == TensorLayout::NCHW ? "NCHW" : "NHWC")
+                  << ": " << ms << " ms/batch, " << parameter_count(conv) << " parameters" << std::endl;
+    }
+
+    double ms = time_ms([&]() {
+        Matrix output = dense.forward(x);
+        dense.backward(loss.compute_error_derivative(y, output));
+    }, 5);
+    std::cout << "dense baseline: " << ms << " ms/batch, " << parameter_count(dense) << " parameters" << std::endl;
+}
+
+/**
+ * @brief Forward + backward time of the blocked attention layer for growing sequence lengths
+ */
+void bench_attention() {
+    const size_t batch_size = 8, dim = 64, heads = 4;
+    for (size_t length : {64, 128, 256, 512}) {
+        MultiHeadAttention mha(length, dim, heads);
+        Matrix x = random_matrix(batch_size, length * dim, -1, 1);
+        Matrix gradient = random_matrix(batch_size, length * dim, -1, 1);
+        double ms = time_ms([&]() {
+            mha.forward(x);
+            mha.backward(gradient);
+        }, 2);
+        std::cout << "attention L=" << length << ": " << ms << " ms/batch" << std::endl;
+    }
+}
+
+/**
+ * @brief Training throughput of the main.cpp sized MLP with the plain and the data-parallel trainer
+ */
+void bench_data_parallel() {
+    const size_t batch_size = 128;
+    Matrix x = random_matrix(batch_size, 28 * 28);
+    Matrix y = random_one_hot(batch_size, 10);
+    LeakyReLU leaky;
+    Linear lin;
+    CategoricalCrossEntropy loss;
+    FullyConnectedLayer layer1(28 * 28, 256, leaky);
+    FullyConnectedLayer layer2(256, 32, leaky);
+    FullyConnectedLayer layer3(32, 10, lin);
+    Sequential model({layer1, layer2, layer3});
+    SGD optimizer(model.parameters(), 0.01);
+
+    Trainer trainer(model, optimizer, loss);
+    double ms = time_ms([&]() { trainer.train_step(x, y); }, 5);
+    std::cout << "intra-op only: " << batch_size / ms * 1000 << " samples/s" << std::endl;
+    for (size_t workers = 2; workers <= static_cast<size_t>(omp_get_max_threads()); workers *= 2) {
+        DataParallelTrainer parallel_trainer(model, optimizer, loss, workers);
+        ms = time_ms([&]() { parallel_trainer.train_step(x, y); }, 5);
+        std::cout << workers << " data-parallel workers: " << batch_size / ms * 1000 << " samples/s" << std::endl;
+    }
+}
+
+/**
+ * @brief Throughput and convergence of Hogwild! against the synchronous trainer on a sparse linear model
+ */
+void bench_hogwild() {
+    const size_t batch_size = 32, features = 1024, batches = 64;
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<size_t> feature(0, features - 1);
+    Matrix true_weights = random_matrix(features, 1, -1, 1);
+    std::vector<Matrix> inputs, targets;
+    for (size_t batch = 0; batch < batches; batch++) {
+        // Every sample has 8 active features
+        Matrix x(batch_size, features, 0);
+        for (size_t row = 0; row < batch_size; row++) {
+            for (size_t k = 0; k < 8; k++) {
+                x[row, feature(gen)] = 1;
+            }
+        }
+        inputs.push_back(x);
+        targets.push_back(Matrix::matMul(x, true_weights));
+    }
+    Linear lin;
+    MeanSquaredError loss;
+
+    FullyConnectedLayer sync_layer(features, 1, lin);
+    Sequential sync_model({sync_layer});
+    std::shared_ptr<Model> hogwild_model = sync_model.clone();
+    SGD optimizer(sync_model.parameters(), 0.01);
+    Trainer trainer(sync_model, optimizer, loss);
+    HogwildTrainer hogwild(*hogwild_model, loss, omp_get_max_threads(), 0.01);
+
+    for (int epoch = 0; epoch < 5; epoch++) {
+        auto begin = std::chrono::steady_clock::now();
+        float sync_loss = 0;
+        for (size_t batch = 0; batch < batches; batch++) {
+            sync_loss += trainer.train_step(inputs[batch], targets[batch]) / batches;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        EpochStats stats = hogwild.train_epoch(inputs, targets);
+        std::cout << "epoch " << epoch << ": sync loss " << sync_loss << " (" << batches * batch_size / seconds << " samples/s)"
+                  << ", hogwild loss " << stats.loss << " (" << stats.samples_per_second() << " samples/s)" << std::endl;
+    }
+}
+
+/**
+ * @brief Throughput, stage utilization and bubble fraction of a wide 4 layer MLP split into 4 pipeline stages
+ */
+void bench_pipeline() {
+    const size_t batch_size = 256;
+    Matrix x = random_matrix(batch_size, 512);
+    Matrix y = random_one_hot(batch_size, 10);
+    LeakyReLU leaky;
+    Linear lin;
+    CategoricalCrossEntropy loss;
+    FullyConnectedLayer layer1(512, 512, leaky);
+    FullyConnectedLayer layer2(512, 512, leaky);
+    FullyConnectedLayer layer3(512, 512, leaky);
+    FullyConnectedLayer layer4(512, 10, lin);
+    Sequential model({layer1, layer2, layer3, layer4});
+    SGD optimizer(model.parameters(), 0.01);
+
+    Trainer trainer(model, optimizer, loss);
+    double ms = time_ms([&]() { trainer.train_step(x, y); }, 3);
+    std::cout << "sequential: " << batch_size / ms * 1000 << " samples/s" << std::endl;
+    for (PipelineSchedule schedule : {PipelineSchedule::GPipe, PipelineSchedule::OneFOneB}) {
+        for (size_t micro_batches : {4, 8}) {
+            PipelineTrainer pipeline(model, optimizer, loss, {1, 1, 1, 1}, micro_batches, schedule);
+            ms = time_ms([&]() { pipeline.train_step(x, y); }, 3);
+            const PipelineStats& stats = pipeline.stats();
+            std::cout << (schedule == PipelineSchedule::GPipe ? "GPipe" : "1F1B") << " with " << micro_batches << " micro-batches: "
+                      << batch_size / ms * 1000 << " samples/s, utilization";
+            for (size_t stage = 0; stage < stats.stage_busy_seconds.size(); stage++) {
+                std::cout << " " << stats.utilization(stage);
+            }
+            std::cout << ", bubble fraction " << stats.bubble_fraction() << std::endl;
+        }
+    }
+}
+
+/**
+ * @brief Time of one optimizer step against one forward and backward pass of the main.cpp sized MLP
+ */
+void bench_optimizers() {
+    const size_t batch_size = 128;
+    Matrix x = random_matrix(batch_size, 28 * 28);
+    Matrix y = random_one_hot(batch_size, 10);
+    LeakyReLU leaky;
+    Linear lin;
+    CategoricalCrossEntropy loss;
+    FullyConnectedLayer layer1(28 * 28, 256, leaky);
+    FullyConnectedLayer layer2(256, 32, leaky);
+    FullyConnectedLayer layer3(32, 10, lin);
+    Sequential model({layer1, layer2, layer3});
+
+    double pass_ms = time_ms([&]() {
+        Matrix output = model.forward(x);
+        model.backward(loss.compute_error_derivative(y, output));
+    }, 5);
+    std::cout << "forward + backward: " << pass_ms << " ms" << std::endl;
+    auto parameters = model.parameters();
+    std::map<std::string, std::function<std::shared_ptr<Optimizer>()>> optimizers = {
+        {"SGD", [&]() { return std::make_shared<SGD>(parameters, 0.01); }},
+        {"SGDWithMomentum", [&]() { return std::make_shared<SGDWithMomentum>(parameters, 0.01, 0.9); }},
+        {"AdaGrad", [&]() { return std::make_shared<AdaGrad>(parameters, 0.01, 1e-8); }},
+        {"RMSprop", [&]() { return std::make_shared<RMSprop>(parameters, 0.01, 0.9, 1e-8); }},
+        {"Adam", [&]() { return std::make_shared<Adam>(parameters, 0.001, 0.9, 0.999, 1e-8); }},
+        {"AdamW", [&]() { return std::make_shared<AdamW>(parameters, 0.001, 0.9, 0.999, 1e-8, 0.01); }},
+        {"QuantizedAdam", [&]() { return std::make_shared<QuantizedAdam>(parameters, 0.001, 0.9, 0.999, 1e-8); }},
+    };
+    for (auto& [name, make_optimizer] : optimizers) {
+        // Every optimizer binds the parameters to its own arena, so the gradients are computed after creating it
+        std::shared_ptr<Optimizer> optimizer = make_optimizer();
+        Matrix output = model.forward(x);
+        model.backward(loss.compute_error_derivative(y, output));
+        double step_ms = time_ms([&]() { optimizer->step(); }, 20);
+        std::cout << name << " step: " << step_ms << " ms (" << 100 * step_ms / (pass_ms + step_ms) << "% of a training step), "
+                  << optimizer->state_bytes() / 1024 << " KiB of state" << std::endl;
+    }
+}
+
+/**
+ * @brief Training step time of the main.cpp MLP with Adam when the updates run after or during the backward pass
+ */
+void bench_eager() {
+    const size_t batch_size = 128;
+    Matrix x = random_matrix(batch_size, 28 * 28);
+    Matrix y = random_one_hot(batch_size, 10);
+    LeakyReLU leaky;
+    Linear lin;
+    CategoricalCrossEntropy loss;
+    FullyConnectedLayer layer1(28 * 28, 256, leaky);
+    FullyConnectedLayer layer2(256, 32, leaky);
+    FullyConnectedLayer layer3(32, 10, lin);
+    Sequential model({layer1, layer2, layer3});
+
+    {
+        Adam optimizer(model.parameters(), 0.001, 0.9, 0.999, 1e-8);
+        Trainer trainer(model, optimizer, loss);
+        std::cout << "step after backward: " << time_ms([&]() { trainer.train_step(x, y); }, 20) << " ms" << std::endl;
+    }
+    for (bool helper_thread : {false, true}) {
+        Adam optimizer(model.parameters(), 0.001, 0.9, 0.999, 1e-8);
+        EagerTrainer trainer(model, optimizer, loss, helper_thread);
+        std::cout << "eager per-layer steps" << (helper_thread ? " on a helper thread: " : ": ")
+                  << time_ms([&]() { trainer.train_step(x, y); }, 20) << " ms" << std::endl;
+    }
+}
+
+/**
+ * @brief Adam step time of the main.cpp MLP without a moving average of the weights, with the fused one, and with one
+ * kept by separate matrix operations after the step
+ */
+void bench_ema() {
+    const size_t batch_size = 128;
+    Matrix x = random_matrix(batch_size, 28 * 28);
+    Matrix y = random_one_hot(batch_size, 10);
+    LeakyReLU leaky;
+    Linear lin;
+    CategoricalCrossEntropy loss;
+    FullyConnectedLayer layer1(28 * 28, 256, leaky);
+    FullyConnectedLayer layer2(256, 32, leaky);
+    FullyConnectedLayer layer3(32, 10, lin);
+    Sequential model({layer1, layer2, layer3});
+    auto parameters = model.parameters();
+
+    for (bool fused : {false, true}) {
+        Adam optimizer(parameters, 0.001, 0.9, 0.999, 1e-8);
+        if (fused) {
+            optimizer.enable_ema(0.999);
+        }
+        Matrix output = model.forward(x);
+        model.backward(loss.compute_error_derivative(y, output));
+        std::cout << (fused ? "fused EMA: " : "no EMA: ") << time_ms([&]() { optimizer.step(); }, 20) << " ms per step" << std::endl;
+    }
+
+    Adam optimizer(parameters, 0.001, 0.9, 0.999, 1e-8);
+    Matrix output = model.forward(x);
+    model.backward(loss.compute_error_derivative(y, output));
+    std::vector<Matrix> ema;
+    for (auto& parameter : parameters) {
+        ema.push_back(parameter->data);
+    }
+    double ms = time_ms([&]() {
+        optimizer.step();
+        for (size_t i = 0; i < parameters.size(); i++) {
+            ema[i] = Matrix::add(Matrix::mul(ema[i], 0.999), Matrix::mul(parameters[i]->data, 0.001));
+        }
+    }, 20);
+    std::cout << "EMA with matrix operations: " << ms << " ms per step" << std::endl;
+}
+
+/**
+ * @brief Step time of Adam and the lazy SparseAdam on a large embedding table of which a batch touches about 0.5% of the rows
+ */
+void bench_sparse_embedding() {
+    const size_t num_embeddings = 200000, embedding_dim = 32, batch_size = 128, sequence_length = 8;
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<size_t> dist(0, num_embeddings - 1);
+    Matrix indices(batch_size, sequence_length, 0);
+    for (size_t row = 0; row < batch_size; row++) {
+        for (size_t col = 0; col < sequence_length; col++) {
+            indices[row, col] = dist(gen);
+        }
+    }
+    Matrix gradient = random_matrix(batch_size, sequence_length * embedding_dim, -1, 1);
+    EmbeddingLayer embedding(num_embeddings, embedding_dim, sequence_length);
+    auto parameters = embedding.parameters();
+    std::map<std::string, std::function<std::shared_ptr<Optimizer>()>> optimizers = {
+        {"Adam", [&]() { return std::make_shared<Adam>(parameters, 0.001, 0.9, 0.999, 1e-8); }},
+        {"SparseAdam", [&]() { return std::make_shared<SparseAdam>(parameters, 0.001, 0.9, 0.999, 1e-8); }},
+    };
+    for (auto& [name, make_optimizer] : optimizers) {
+        std::shared_ptr<Optimizer> optimizer = make_optimizer();
+        double ms = time_ms([&]() {
+            optimizer->zero_grad();
+            embedding.forward(indices);
+            embedding.backward(gradient);
+            optimizer->step();
+        }, 20);
+        std::cout << name << ": " << ms << " ms per training step of the table" << std::endl;
+    }
+}
+
+/**
+ * @brief Load time of a Fashion-MNIST sized CSV of pixel values with the DataLoader and with getline and stof,
+ * and of the same values as a binary tensor file, an IDX file and an npy file
+ */
+void bench_csv() {
+    const size_t rows = 20000, cols = 28 * 28;
+    std::string path = (std::filesystem::temp_directory_path() / "bench_csv.csv").string();
+    {
+        std::mt19937 gen(5);
+        std::uniform_int_distribution<int> pixel(0, 255);
+        std::ofstream file(path);
+        for (size_t row = 0; row < rows; row++) {
+            for (size_t col = 0; col < cols; col++) {
+                file << pixel(gen) << (col + 1 < cols ? "," : "\n");
+            }
+        }
+    }
+
+    DataLoader loader;
+    double ms = time_ms([&]() { loader.load_from_csv(path); }, 3);
+    std::cout << "DataLoader: " << ms << " ms, " << loader.last_stats().gigabytes_per_second() << " GB/s" << std::endl;
+
+    ms = time_ms([&]() {
+        std::ifstream file(path);
+        std::string line, cell;
+        std::vector<float> data;
+        while (std::getline(file, line)) {
+            std::stringstream line_stream(line);
+            while (std::getline(line_stream, cell, ',')) {
+                data.push_back(std::stof(cell));
+            }
+        }
+    }, 3);
+    std::cout << "getline + stof: " << ms << " ms, " << std::filesystem::file_size(path) / ms / 1e6 << " GB/s" << std::endl;
+
+    std::string binary_path = (std::filesystem::temp_directory_path() / "bench_csv.bin").string();
+    loader.write_binary(loader.load_from_csv(path), binary_path);
+    ms = time_ms([&]() { loader.load_binary(binary_path); }, 3);
+    std::cout << "binary mapping with checksum: " << ms << " ms" << std::endl;
+    ms = time_ms([&]() { loader.load_binary(binary_path, false); }, 3);
+    std::cout << "binary mapping without checksum: " << ms << " ms" << std::endl;
+
+    std::string idx_path = (std::filesystem::temp_directory_path() / "bench_csv.idx").string();
+    loader.write_idx(loader.load_from_csv(path), idx_path, IdxType::UnsignedByte);
+    ms = time_ms([&]() { loader.load_idx(idx_path); }, 3);
+    std::cout << "IDX of unsigned bytes (" << std::filesystem::file_size(idx_path) / 1e6 << " MB): " << ms << " ms" << std::endl;
+    size_t compact_bytes = 0;
+    ms = time_ms([&]() { compact_bytes = loader.load_compact(idx_path).bytes(); }, 3);
+    std::cout << "IDX of unsigned bytes into compact storage (" << compact_bytes / 1e6 << " MB): " << ms << " ms" << std::endl;
+    std::string npy_path = (std::filesystem::temp_directory_path() / "bench_csv.npy").string();
+    loader.write_npy(loader.load_from_csv(path), npy_path);
+    ms = time_ms([&]() { loader.load_npy(npy_path); }, 3);
+    std::cout << "npy of float32: " << ms << " ms" << std::endl;
+    for (auto& file : {path, binary_path, idx_path, npy_path}) {
+        std::filesystem::remove(file);
+    }
+}
+
+
+/**
+ * @brief Epoch time of training a small MLP on batches streamed from a CSV file of Fashion-MNIST sized rows,
+ * reading every batch before its training step and prefetching batches on a background thread.
+ * The hidden layer is small so that reading and training take a similar time.
+ */
+void bench_streaming() {
+    const size_t rows = 5000, cols = 28 * 28, hidden = 8, batch_size = 128;
+    std::string x_path = (std::filesystem::temp_directory_path() / "bench_streaming_x.csv").string();
+    std::string y_path = (std::filesystem::temp_directory_path() / "bench_streaming_y.csv").string();
+    {
+        std::mt19937 gen(5);
+        std::uniform_int_distribution<int> pixel(0, 255);
+        std::ofstream x_file(x_path), y_file(y_path);
+        for (size_t row = 0; row < rows; row++) {
+            for (size_t col = 0; col < cols; col++) {
+                x_file << pixel(gen) << (col + 1 < cols ? "," : "\n");
+            }
+            y_file << row % 10 << "\n";
+        }
+    }
+
+    LeakyReLU leaky;
+    Linear lin;
+    FullyConnectedLayer layer1(cols, hidden, leaky);
+    FullyConnectedLayer layer2(hidden, 10, lin);
+    Sequential model({layer1, layer2});
+    CategoricalCrossEntropy loss;
+    Adam optimizer(model.parameters(), 0.001, 0.9, 0.999, 1e-8);
+    Trainer trainer(model, optimizer, loss);
+    auto prepare = [](Matrix& x, Matrix& y) {
+        x = Matrix::div(x, 255.0);
+        y = Matrix::one_hot_encoding(y, 10);
+    };
+
+    CsvDataset inputs(x_path), targets(y_path);
+    double ms = time_ms([&]() {
+        inputs.reset();
+        targets.reset();
+        while (true) {
+            Matrix x = inputs.read(batch_size), y = targets.read(batch_size);
+            if (x.rows() == 0) {
+                break;
+            }
+            prepare(x, y);
+            trainer.train_step(x, y);
+        }
+    }, 2);
+    std::cout << "read, then train: " << ms << " ms per epoch" << std::endl;
+
+    for (size_t prefetch : {2, 3}) {
+        DataIterator iterator(inputs, targets, batch_size, prefetch, prepare);
+        ms = time_ms([&]() {
+            Matrix x, y;
+            while (iterator.next(x, y)) {
+                trainer.train_step(x, y);
+            }
+        }, 2);
+        IteratorStats stats = iterator.stats();
+        std::cout << "prefetch " << prefetch << ": " << ms << " ms per epoch, " << stats.rows_per_second() << " rows/s, "
+                  << stats.produce_seconds * 1000 << " ms reading, " << stats.stall_seconds * 1000 << " ms stalled ("
+                  << stats.stall_fraction() * 100 << "%)" << std::endl;
+    }
+    std::filesystem::remove(x_path);
+    std::filesystem::remove(y_path);
+}
+
+/**
+ * @brief Time to produce one epoch of reshuffled batches of Fashion-MNIST sized rows by shuffling and batching
+ * the whole matrices and by gathering every batch into the reused buffers of a BatchSampler,
+ * and of gathering pixel values stored as narrow types and normalized in the gather
+ */
+void bench_sampler() {
+    const size_t rows = 20000, cols = 28 * 28, batch_size = 128;
+    Matrix x = random_matrix(rows, cols);
+    Matrix y = Matrix::one_hot_encoding(Matrix(rows, 1, 0), 10);
+    double ms = time_ms([&]() {
+        std::vector<size_t> row_indices(rows);
+        std::iota(row_indices.begin(), row_indices.end(), 0);
+        std::shuffle(row_indices.begin(), row_indices.end(), std::mt19937(1));
+        std::vector<Matrix> x_batches = Matrix::batch(Matrix::shuffle(x, row_indices), batch_size);
+        std::vector<Matrix> y_batches = Matrix::batch(Matrix::shuffle(y, row_indices), batch_size);
+    }, 5);
+    std::cout << "shuffle + batch: " << ms << " ms per epoch" << std::endl;
+
+    BatchSampler sampler(x, y, batch_size, false, 1);
+    ms = time_ms([&]() {
+        while (sampler.next()) {}
+    }, 5);
+    std::cout << "BatchSampler: " << ms << " ms per epoch" << std::endl;
+    sampler.stratify(Matrix(rows, 1, 0));
+    ms = time_ms([&]() {
+        while (sampler.next()) {}
+    }, 5);
+    std::cout << "stratified BatchSampler: " << ms << " ms per epoch" << std::endl;
+
+    // Pixel values stored as floats normalized up front, and stored narrow and normalized while gathering
+    Matrix pixels(rows, cols, 0);
+    std::mt19937 gen(3);
+    std::uniform_int_distribution<int> pixel(0, 255);
+    for (size_t i = 0; i < rows * cols; i++) {
+        pixels.raw()[i] = pixel(gen);
+    }
+    std::vector<std::pair<std::string, StorageType>> types = {
+        {"uint8", StorageType::UInt8}, {"int16", StorageType::Int16}, {"float16", StorageType::Float16}, {"float32", StorageType::Float32}
+    };
+    BatchSampler normalized_sampler(Matrix::div(pixels, 255.0), y, batch_size, false, 1);
+    ms = time_ms([&]() {
+        while (normalized_sampler.next()) {}
+    }, 5);
+    std::cout << "BatchSampler over normalized floats (" << rows * cols * sizeof(float) / 1e6 << " MB): " << ms << " ms per epoch" << std::endl;
+    for (auto& [name, type] : types) {
+        CompactMatrix compact(pixels, type);
+        compact.normalize(1 / 255.0f);
+        size_t bytes = compact.bytes();
+        BatchSampler compact_sampler(std::move(compact), y, batch_size, false, 1);
+        ms = time_ms([&]() {
+            while (compact_sampler.next()) {}
+        }, 5);
+        std::cout << "BatchSampler over " << name << " normalized while gathering (" << bytes / 1e6 << " MB): " << ms << " ms per epoch" << std::endl;
+    }
+}
+/**
+ * @brief Load the Fashion-MNIST training split of main.cpp, or Gaussian class clusters of the same shape if it is missing
+ * @return std::tuple<Matrix, Matrix, Matrix, Matrix> train inputs, one-hot train targets, validation inputs and labels
+ */
+std::tuple<Matrix, Matrix, Matrix, Matrix> fashion_mnist_or_synthetic() {
+    Matrix x, labels;
+    if (std::filesystem::exists("data/fashion_mnist_train_vectors.csv")) {
+        DataLoader loader;
+        x = Matrix::div(loader.load_from_csv("data/fashion_mnist_train_vectors.csv"), 255.0);
+        labels = loader.load_from_csv("data/fashion_mnist_train_labels.csv");
+    } else {
+        std::cout << "data/fashion_mnist_*.csv not found, using synthetic data" << std::endl;
+        const size_t samples = 5120;
+        Matrix means = random_matrix(10, 28 * 28);
+        std::mt19937 gen(99);
+        std::normal_distribution<float> noise(0, 0.5);
+        x = Matrix(samples, 28 * 28, 0);
+        labels = Matrix(samples, 1, 0);
+        for (size_t row = 0; row < samples; row++) {
+            size_t label = row % 10;
+            labels[row, 0] = label;
+            for (size_t col = 0; col < 28 * 28; col++) {
+                x[row, col] = means[label, col] + noise(gen);
+            }
+        }
+    }
+    Matrix train_x, val_x, train_labels, val_labels;
+    std::tie(train_x, val_x) = Matrix::split(x, 0.1);
+    std::tie(train_labels, val_labels) = Matrix::split(labels, 0.1);
+    return {train_x, Matrix::one_hot_encoding(train_labels, 10), val_x, val_labels};
+}
+
+/**
+ * @brief Steps per second and time to 80% validation accuracy of the main.cpp MLP with Adam and the overshoot optimizers
+ */
+void bench_overshoot() {
+    auto [train_x, train_y, val_x, val_y] = fashion_mnist_or_synthetic();
+    std::vector<Matrix> x_batches = Matrix::batch(train_x, 128);
+    std::vector<Matrix> y_batches = Matrix::batch(train_y, 128);
+    const float target_accuracy = 0.8;
+    const int epochs = 5;
+
+    auto run = [&](std::string name, std::function<std::shared_ptr<Optimizer>(Model&)> make_optimizer) {
+        LeakyReLU leaky;
+        Linear lin;
+        CategoricalCrossEntropy loss;
+        FullyConnectedLayer layer1(28 * 28, 256, leaky);
+        FullyConnectedLayer layer2(256, 32, leaky);
+        FullyConnectedLayer layer3(32, 10, lin);
+        Sequential model({layer1, layer2, layer3});
+        std::shared_ptr<Optimizer> optimizer = make_optimizer(model);
+        auto overshoot = std::dynamic_pointer_cast<Overshoot>(optimizer);
+        Trainer trainer(model, *optimizer, loss);
+
+        double training_seconds = 0;
+        size_t steps = 0;
+        for (int epoch = 0; epoch < epochs; epoch++) {
+            auto begin = std::chrono::steady_clock::now();
+            for (size_t batch = 0; batch < x_batches.size(); batch++) {
+                trainer.train_step(x_batches[batch], y_batches[batch]);
+            }
+            training_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            steps += x_batches.size();
+
+            // The overshoot optimizers are evaluated at their base weights
+            if (overshoot) {
+                overshoot->swap_base_weights();
+            }
+            float val_accuracy = accuracy(val_y, Matrix::rowwise_argmax(model.forward(val_x, false)));
+            if (overshoot) {
+                overshoot->swap_base_weights();
+            }
+            if (val_accuracy >= target_accuracy) {
+                std::cout << name << ": " << steps / training_seconds << " steps/s, " << val_accuracy << " validation accuracy after "
+                          << epoch + 1 << " epochs and " << training_seconds << " s" << std::endl;
+                return;
+            }
+        }
+        std::cout << name << ": " << steps / training_seconds << " steps/s, " << target_accuracy << " validation accuracy not reached in "
+                  << epochs << " epochs" << std::endl;
+    };
+
+    run("Adam", [](Model& model) { return std::make_shared<Adam>(model.parameters(), 0.0005, 0.99, 0.999, 1e-8); });
+    run("AdamwithOvershoot", [](Model& model) { return std::make_shared<AdamwithOvershoot>(model.parameters(), 0.0005, 0.99, 0.999, 1e-8); });
+    run("SGDwithOvershoot", [](Model& model) { return std::make_shared<SGDwithOvershoot>(model.parameters(), 0.01, 0.9); });
+}
+
+/**
+ * @brief Validation accuracy after a fixed number of epochs of Adam with small batches against LAMB and LARS with 16x larger batches
+ */
+void bench_large_batch() {
+    auto [train_x, train_y, val_x, val_y] = fashion_mnist_or_synthetic();
+    const int epochs = 3;
+
+    auto run = [&](std::string name, size_t batch_size, std::function<std::shared_ptr<Optimizer>(Model&)> make_optimizer) {
+        std::vector<Matrix> x_batches = Matrix::batch(train_x, batch_size);
+        std::vector<Matrix> y_batches = Matrix::batch(train_y, batch_size);
+        LeakyReLU leaky;
+        Linear lin;
+        CategoricalCrossEntropy loss;
+        FullyConnectedLayer layer1(28 * 28, 256, leaky);
+        FullyConnectedLayer layer2(256, 32, leaky);
+        FullyConnectedLayer layer3(32, 10, lin);
+        Sequential model({layer1, layer2, layer3});
+        std::shared_ptr<Optimizer> optimizer = make_optimizer(model);
+        // Warm up over the first epoch
+        LinearWarmupScheduler scheduler(*optimizer, x_batches.size());
+        Trainer trainer(model, *optimizer, loss);
+
+        auto begin = std::chrono::steady_clock::now();
+        for (int epoch = 0; epoch < epochs; epoch++) {
+            for (size_t batch = 0; batch < x_batches.size(); batch++) {
+                trainer.train_step(x_batches[batch], y_batches[batch]);
+                scheduler.step();
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        float val_accuracy = accuracy(val_y, Matrix::rowwise_argmax(model.forward(val_x, false)));
+        std::cout << name << " with batch size " << batch_size << ": " << val_accuracy << " validation accuracy after " << epochs
+                  << " epochs, " << epochs * x_batches.size() * batch_size / seconds << " samples/s" << std::endl;
+    };
+
+    run("Adam", 128, [](Model& model) { return std::make_shared<Adam>(model.parameters(), 0.0005, 0.9, 0.999, 1e-8); });
+    run("Adam", 2048, [](Model& model) { return std::make_shared<Adam>(model.parameters(), 0.0005, 0.9, 0.999, 1e-8); });
+    run("LAMB", 2048, [](Model& model) { return std::make_shared<LAMB>(model.parameters(), 0.01); });
+    run("LARS", 2048, [](Model& model) { return std::make_shared<LARS>(model.parameters(), 2.0); });
+}
+
+int main(int argc, char** argv) {
+    std::map<std::string, std::function<void()>> benchmarks = {
+        {"conv", bench_conv},
+        {"attention", bench_attention},
+        {"data_parallel", bench_data_parallel},
+        {"hogwild", bench_hogwild},
+        {"pipeline", bench_pipeline},
+        {"optimizers", bench_optimizers},
+        {"eager", bench_eager},
+        {"ema", bench_ema},
+        {"csv", bench_csv},
+        {"streaming", bench_streaming},
+        {"sampler", bench_sampler},
+        {"sparse_embedding", bench_sparse_embedding},
+        {"overshoot", bench_overshoot},
+        {"large_batch", bench_large_batch},
+    };
+
+    std::cout << "OpenMP threads: " << omp_get_max_threads() << std::endl;
+    for (auto& [name, benchmark] : benchmarks) {
+        if (argc > 1 && std::string(argv[1]) != name) {
+            continue;
+        }
+        std::cout << "=== " << name << " ===" << std::endl;
+        benchmark();
+    }
+}
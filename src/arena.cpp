@@ -0,0 +1,128 @@
+#include "arena.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+/**************************************
+            Parameter arena
+ **************************************/
+
+ParameterArena::ParameterArena(std::vector<std::shared_ptr<Parameter>> parameters, size_t state_slots)
+: parameters_(parameters), slots(state_slots), lifetime(std::make_shared<const bool>(true)) {
+    const size_t floats_per_line = alignment / sizeof(float);
+    for (auto& parameter : parameters_) {
+        // A second arena would leave the first one updating a copy of the values that no layer reads anymore
+        if (!parameter->arena.expired()) {
+            throw std::runtime_error("Parameter is already bound to the arena of another optimizer, destroy that optimizer first.");
+        }
+        has_row_sparse = has_row_sparse || parameter->row_sparse;
+        offsets.push_back(region_size);
+        size_t size = parameter->data.rows() * parameter->data.cols();
+        region_size += (size + floats_per_line - 1) / floats_per_line * floats_per_line;
+    }
+
+    size_t bytes = std::max<size_t>(region_size * (2 + slots) * sizeof(float), alignment);
+    float* memory = static_cast<float*>(std::aligned_alloc(alignment, bytes));
+    if (memory == nullptr) {
+        throw std::runtime_error("Failed to allocate a parameter arena of " + std::to_string(bytes) + " bytes.");
+    }
+    std::memset(memory, 0, bytes);
+    storage = std::shared_ptr<float>(memory, std::free);
+
+    for (size_t i = 0; i < parameters_.size(); i++) {
+        parameters_[i]->data.bind(data() + offsets[i], storage);
+        parameters_[i]->grad.bind(grad() + offsets[i], storage);
+        parameters_[i]->arena = lifetime;
+    }
+}
+
+size_t ParameterArena::size() const {
+    return region_size;
+}
+
+size_t ParameterArena::state_slots() const {
+    return slots;
+}
+
+const std::vector<std::shared_ptr<Parameter>>& ParameterArena::parameters() const {
+    return parameters_;
+}
+
+size_t ParameterArena::offset(size_t parameter) const {
+    if (parameter == offsets.size()) {
+        return region_size;
+    }
+    return offsets.at(parameter);
+}
+
+float* ParameterArena::data() {
+    return storage.get();
+}
+
+float* ParameterArena::grad() {
+    return storage.get() + region_size;
+}
+
+float* ParameterArena::state(size_t slot) {
+    if (slot >= slots) {
+        throw std::out_of_range("Parameter arena has no state slot " + std::to_string(slot));
+    }
+    return storage.get() + (2 + slot) * region_size;
+}
+
+Matrix ParameterArena::state_view(size_t slot, size_t parameter) {
+    Matrix view(parameters_.at(parameter)->data.shape, 0);
+    view.bind(state(slot) + offsets[parameter], storage);
+    return view;
+}
+
+size_t ParameterArena::add_state_slot() {
+    size_t bytes = std::max<size_t>(region_size * (3 + slots) * sizeof(float), alignment);
+    float* memory = static_cast<float*>(std::aligned_alloc(alignment, bytes));
+    if (memory == nullptr) {
+        throw std::runtime_error("Failed to allocate a parameter arena of " + std::to_string(bytes) + " bytes.");
+    }
+    std::memcpy(memory, storage.get(), region_size * (2 + slots) * sizeof(float));
+    std::memset(memory + region_size * (2 + slots), 0, region_size * sizeof(float));
+    std::shared_ptr<float> previous = storage;
+    storage = std::shared_ptr<float>(memory, std::free);
+    for (size_t i = 0; i < parameters_.size(); i++) {
+        parameters_[i]->data.rebind(data() + offsets[i], storage);
+        parameters_[i]->grad.rebind(grad() + offsets[i], storage);
+    }
+    return slots++;
+}
+
+void ParameterArena::point_data_at_state(size_t slot) {
+    float* region = state(slot);
+    for (size_t i = 0; i < parameters_.size(); i++) {
+        parameters_[i]->data.rebind(region + offsets[i], storage);
+    }
+}
+
+void ParameterArena::point_data_at_values() {
+    for (size_t i = 0; i < parameters_.size(); i++) {
+        parameters_[i]->data.rebind(data() + offsets[i], storage);
+    }
+}
+
+void ParameterArena::zero_grad() {
+    if (!has_row_sparse) {
+        std::memset(grad(), 0, region_size * sizeof(float));
+        return;
+    }
+    for (size_t i = 0; i < parameters_.size(); i++) {
+        Parameter& parameter = *parameters_[i];
+        if (!parameter.row_sparse) {
+            std::memset(grad() + offsets[i], 0, (offset(i + 1) - offsets[i]) * sizeof(float));
+            continue;
+        }
+        // Only the touched rows can hold non-zero gradients
+        size_t cols = parameter.grad.cols();
+        for (size_t row : parameter.touched_rows) {
+            std::memset(grad() + offsets[i] + row * cols, 0, cols * sizeof(float));
+        }
+        parameter.touched_rows.clear();
+    }
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include "matrix.hpp"
+#include "model.hpp"
+
+#include <memory>
+#include <vector>
+
+
+/**
+ * @brief One contiguous, 64-byte aligned allocation holding the values, gradients and optimizer states of parameters
+ *
+ * The arena is made of regions of size() floats: the values, the gradients and state_slots() optimizer states.
+ * Every parameter occupies the same offset in every region and starts on a 64-byte boundary, the padding is
+ * kept at zero. The data and grad matrices of the parameters are bound to the arena, so layers keep using
+ * them as before while zeroing gradients, optimizer sweeps and all-reduce work on whole regions.
+ * A parameter can only be bound to one live arena at a time, the constructor throws for a parameter that
+ * is still bound to another arena.
+ */
+class ParameterArena {
+    public:
+        static constexpr size_t alignment = 64;
+
+        ParameterArena(std::vector<std::shared_ptr<Parameter>> parameters, size_t state_slots=0);
+
+        /**
+         * @brief Return the number of floats in one region, including the padding
+         *
+         * @return size_t 
+         */
+        size_t size() const;
+        size_t state_slots() const;
+        const std::vector<std::shared_ptr<Parameter>>& parameters() const;
+
+        /**
+         * @brief Return the offset of the parameter with the given index in every region
+         * The index parameters().size() returns size(), so the parameters [first, last) span [offset(first), offset(last))
+         *
+         * @param parameter 
+         * @return size_t 
+         */
+        size_t offset(size_t parameter) const;
+
+        float* data();
+        float* grad();
+        float* state(size_t slot);
+
+        /**
+         * @brief Return a matrix of the shape of the parameter bound to its part of the state slot
+         *
+         * @param slot 
+         * @param parameter 
+         * @return Matrix 
+         */
+        Matrix state_view(size_t slot, size_t parameter);
+
+        /**
+         * @brief Append a zeroed state slot and return its index
+         * The arena is reallocated and the parameters are bound to the new storage, earlier pointers and state views are invalidated
+         *
+         * @return size_t 
+         */
+        size_t add_state_slot();
+
+        /**
+         * @brief Point the data matrices of the parameters at the state slot instead of the values region, nothing is copied
+         *
+         * @param slot 
+         */
+        void point_data_at_state(size_t slot);
+
+        /**
+         * @brief Point the data matrices of the parameters back at the values region
+         */
+        void point_data_at_values();
+
+        /**
+         * @brief Set all gradients to zero with a single memset
+         * Of row-sparse parameters only the touched rows are cleared, together with the list of touched rows
+         */
+        void zero_grad();
+    private:
+        std::vector<std::shared_ptr<Parameter>> parameters_;
+        std::vector<size_t> offsets;
+        size_t region_size = 0;
+        size_t slots;
+        bool has_row_sparse = false;
+        std::shared_ptr<float> storage;
+        // The parameters hold weak references to it, so they know when the arena is gone
+        std::shared_ptr<const bool> lifetime;
+};
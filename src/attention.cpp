@@ -0,0 +1,234 @@
+#include "attention.hpp"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+Matrix initialize_weights(size_t rows, size_t cols, float min, float max);
+
+/************************************************
+ *            Multi-Head Attention              *
+ ************************************************/
+
+MultiHeadAttention::MultiHeadAttention(size_t sequence_length, size_t model_dim, size_t num_heads, bool causal, size_t block_size)
+: sequence_length(sequence_length), model_dim(model_dim), num_heads(num_heads), causal(causal), block_size(block_size) {
+    if (num_heads == 0 || model_dim % num_heads != 0) {
+        throw std::runtime_error("MultiHeadAttention model dimension must be divisible by the number of heads.");
+    }
+    if (block_size == 0) {
+        throw std::runtime_error("MultiHeadAttention block size must be positive.");
+    }
+    head_dim = model_dim / num_heads;
+    // Xavier uniform initialization
+    float bound = std::sqrt(6.0f / (2 * model_dim));
+    qkv_weights = std::make_shared<Parameter>(Parameter(initialize_weights(model_dim, 3 * model_dim, -bound, bound)));
+    qkv_biases = std::make_shared<Parameter>(Parameter(Matrix(1, 3 * model_dim, 0)));
+    out_weights = std::make_shared<Parameter>(Parameter(initialize_weights(model_dim, model_dim, -bound, bound)));
+    out_biases = std::make_shared<Parameter>(Parameter(Matrix(1, model_dim, 0)));
+}
+
+Matrix MultiHeadAttention::forward(Matrix input, bool training) {
+    if (input.cols() != sequence_length * model_dim) {
+        throw std::runtime_error("MultiHeadAttention received input with " + std::to_string(input.cols()) +
+                                 " columns, expected " + std::to_string(sequence_length * model_dim));
+    }
+    size_t batch_size = input.rows();
+    // One token per row for the projections
+    this->inputs = input.reshape(batch_size * sequence_length, model_dim);
+    this->qkv = Matrix::colwise_add(Matrix::matMul(inputs, qkv_weights->data), qkv_biases->data);
+    this->attention = Matrix(batch_size * sequence_length, model_dim, 0);
+    this->logsumexp = std::vector<float>(batch_size * num_heads * sequence_length);
+
+    #pragma omp parallel for collapse(2) schedule(dynamic)
+    for (size_t n = 0; n < batch_size; n++) {
+        for (size_t h = 0; h < num_heads; h++) {
+            attention_forward(n, h);
+        }
+    }
+
+    Matrix output = Matrix::colwise_add(Matrix::matMul(attention, out_weights->data), out_biases->data);
+    return output.reshape(batch_size, sequence_length * model_dim);
+}
+
+Matrix MultiHeadAttention::backward(Matrix loss_gradient) {
+    size_t batch_size = loss_gradient.rows();
+    loss_gradient = loss_gradient.reshape(batch_size * sequence_length, model_dim);
+
+    Matrix::add_inplace(out_weights->grad, Matrix::matMul(attention.transpose(), loss_gradient));
+    Matrix::add_inplace(out_biases->grad, Matrix::colwise_sum(loss_gradient));
+    Matrix attention_gradient = Matrix::matMul(loss_gradient, out_weights->data.transpose());
+
+    Matrix qkv_gradient(batch_size * sequence_length, 3 * model_dim, 0);
+    #pragma omp parallel for collapse(2) schedule(dynamic)
+    for (size_t n = 0; n < batch_size; n++) {
+        for (size_t h = 0; h < num_heads; h++) {
+            attention_backward(n, h, attention_gradient, qkv_gradient);
+        }
+    }
+
+    Matrix::add_inplace(qkv_weights->grad, Matrix::matMul(inputs.transpose(), qkv_gradient));
+    Matrix::add_inplace(qkv_biases->grad, Matrix::colwise_sum(qkv_gradient));
+    Matrix input_gradient = Matrix::matMul(qkv_gradient, qkv_weights->data.transpose());
+    return input_gradient.reshape(batch_size, sequence_length * model_dim);
+}
+
+std::vector<std::shared_ptr<Parameter>> MultiHeadAttention::parameters() {
+    return {qkv_weights, qkv_biases, out_weights, out_biases};
+}
+
+std::shared_ptr<Model> MultiHeadAttention::clone() {
+    auto copy = std::make_shared<MultiHeadAttention>(*this);
+    copy->qkv_weights = std::make_shared<Parameter>(*qkv_weights);
+    copy->qkv_biases = std::make_shared<Parameter>(*qkv_biases);
+    copy->out_weights = std::make_shared<Parameter>(*out_weights);
+    copy->out_biases = std::make_shared<Parameter>(*out_biases);
+    return copy;
+}
+
+/**
+ * @brief Attention of a single head of a single sequence
+ *
+ * For every block of queries the keys are visited block by block while a running maximum,
+ * running sum and unnormalized output are kept per query. When a new block raises the maximum,
+ * the previous sum and output are rescaled by exp(old_max - new_max).
+ */
+void MultiHeadAttention::attention_forward(size_t n, size_t h) {
+    const size_t stride = 3 * model_dim;
+    const float* q = qkv.raw() + n * sequence_length * stride + h * head_dim;
+    const float* k = q + model_dim;
+    const float* v = q + 2 * model_dim;
+    float* o = attention.raw() + n * sequence_length * model_dim + h * head_dim;
+    float* lse = logsumexp.data() + (n * num_heads + h) * sequence_length;
+    const float scale = 1.0f / std::sqrt(static_cast<float>(head_dim));
+    const float neg_inf = -std::numeric_limits<float>::infinity();
+
+    std::vector<float> scores(block_size);
+    std::vector<float> accumulator(block_size * head_dim);
+    std::vector<float> row_max(block_size);
+    std::vector<float> row_sum(block_size);
+
+    for (size_t query_start = 0; query_start < sequence_length; query_start += block_size) {
+        size_t query_end = std::min(sequence_length, query_start + block_size);
+        std::fill(accumulator.begin(), accumulator.end(), 0.0f);
+        std::fill(row_max.begin(), row_max.end(), neg_inf);
+        std::fill(row_sum.begin(), row_sum.end(), 0.0f);
+
+        size_t key_limit = causal ? query_end : sequence_length;
+        for (size_t key_start = 0; key_start < key_limit; key_start += block_size) {
+            size_t key_end = std::min(key_limit, key_start + block_size);
+            for (size_t t = query_start; t < query_end; t++) {
+                size_t i = t - query_start;
+                const float* q_t = q + t * stride;
+                float* acc = accumulator.data() + i * head_dim;
+
+                float block_max = neg_inf;
+                for (size_t j = key_start; j < key_end; j++) {
+                    float score = neg_inf;
+                    if (!causal || j <= t) {
+                        const float* k_j = k + j * stride;
+                        score = 0;
+                        for (size_t d = 0; d < head_dim; d++) {
+                            score += q_t[d] * k_j[d];
+                        }
+                        score *= scale;
+                    }
+                    scores[j - key_start] = score;
+                    block_max = std::max(block_max, score);
+                }
+                if (block_max == neg_inf) {
+                    continue;
+                }
+
+                float new_max = std::max(row_max[i], block_max);
+                float correction = std::exp(row_max[i] - new_max);
+                row_sum[i] *= correction;
+                for (size_t d = 0; d < head_dim; d++) {
+                    acc[d] *= correction;
+                }
+                for (size_t j = key_start; j < key_end; j++) {
+                    float p = std::exp(scores[j - key_start] - new_max);
+                    row_sum[i] += p;
+                    const float* v_j = v + j * stride;
+                    for (size_t d = 0; d < head_dim; d++) {
+                        acc[d] += p * v_j[d];
+                    }
+                }
+                row_max[i] = new_max;
+            }
+        }
+
+        for (size_t t = query_start; t < query_end; t++) {
+            size_t i = t - query_start;
+            float inv_sum = 1.0f / row_sum[i];
+            for (size_t d = 0; d < head_dim; d++) {
+                o[t * model_dim + d] = accumulator[i * head_dim + d] * inv_sum;
+            }
+            lse[t] = row_max[i] + std::log(row_sum[i]);
+        }
+    }
+}
+
+/**
+ * @brief Backward pass of a single head of a single sequence
+ *
+ * The attention probabilities are recomputed from the stored log-sum-exp one key block at a time,
+ * iterating over the query blocks inside so the keys, values and their gradients stay in cache.
+ */
+void MultiHeadAttention::attention_backward(size_t n, size_t h, Matrix& attention_gradient, Matrix& qkv_gradient) {
+    const size_t stride = 3 * model_dim;
+    const float* q = qkv.raw() + n * sequence_length * stride + h * head_dim;
+    const float* k = q + model_dim;
+    const float* v = q + 2 * model_dim;
+    const float* o = attention.raw() + n * sequence_length * model_dim + h * head_dim;
+    const float* d_o = attention_gradient.raw() + n * sequence_length * model_dim + h * head_dim;
+    const float* lse = logsumexp.data() + (n * num_heads + h) * sequence_length;
+    float* d_q = qkv_gradient.raw() + n * sequence_length * stride + h * head_dim;
+    float* d_k = d_q + model_dim;
+    float* d_v = d_q + 2 * model_dim;
+    const float scale = 1.0f / std::sqrt(static_cast<float>(head_dim));
+
+    // delta_t = sum_j P_tj * dP_tj = dO_t . O_t
+    std::vector<float> delta(sequence_length);
+    for (size_t t = 0; t < sequence_length; t++) {
+        float sum = 0;
+        for (size_t d = 0; d < head_dim; d++) {
+            sum += d_o[t * model_dim + d] * o[t * model_dim + d];
+        }
+        delta[t] = sum;
+    }
+
+    for (size_t key_start = 0; key_start < sequence_length; key_start += block_size) {
+        size_t key_end = std::min(sequence_length, key_start + block_size);
+        // With a causal mask the queries before the key block cannot attend to it
+        size_t first_query = causal ? key_start : 0;
+        for (size_t query_start = first_query; query_start < sequence_length; query_start += block_size) {
+            size_t query_end = std::min(sequence_length, query_start + block_size);
+            for (size_t t = query_start; t < query_end; t++) {
+                const float* q_t = q + t * stride;
+                const float* d_o_t = d_o + t * model_dim;
+                float* d_q_t = d_q + t * stride;
+                for (size_t j = key_start; j < key_end; j++) {
+                    if (causal && j > t) {
+                        break;
+                    }
+                    const float* k_j = k + j * stride;
+                    const float* v_j = v + j * stride;
+                    float score = 0, d_p = 0;
+                    for (size_t d = 0; d < head_dim; d++) {
+                        score += q_t[d] * k_j[d];
+                        d_p += d_o_t[d] * v_j[d];
+                    }
+                    float p = std::exp(score * scale - lse[t]);
+                    float d_s = p * (d_p - delta[t]) * scale;
+                    float* d_k_j = d_k + j * stride;
+                    float* d_v_j = d_v + j * stride;
+                    for (size_t d = 0; d < head_dim; d++) {
+                        d_v_j[d] += p * d_o_t[d];
+                        d_q_t[d] += d_s * k_j[d];
+                        d_k_j[d] += d_s * q_t[d];
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include "matrix.hpp"
+#include "model.hpp"
+
+#include <memory>
+
+
+/**
+ * @brief A class to represent a multi-head self-attention layer
+ *
+ * Every row of the input holds one sequence of sequence_length tokens with model_dim features each.
+ * Attention is computed in blocks of block_size queries and keys with an online softmax, so the
+ * full sequence_length x sequence_length score matrix is never materialized. Only the row-wise
+ * log-sum-exp of the scores is kept for the backward pass, which recomputes the scores block by block.
+ */
+class MultiHeadAttention : public Model {
+    public:
+        MultiHeadAttention(size_t sequence_length, size_t model_dim, size_t num_heads, bool causal=false, size_t block_size=64);
+        Matrix forward(Matrix input, bool training=true) override;
+        Matrix backward(Matrix output_gradient) override;
+        std::vector<std::shared_ptr<Parameter>> parameters() override;
+        std::shared_ptr<Model> clone() override;
+    private:
+        size_t sequence_length;
+        size_t model_dim;
+        size_t num_heads;
+        size_t head_dim;
+        bool causal;
+        size_t block_size;
+        // Q, K and V are produced by a single (model_dim x 3 * model_dim) projection
+        std::shared_ptr<Parameter> qkv_weights;
+        std::shared_ptr<Parameter> qkv_biases;
+        std::shared_ptr<Parameter> out_weights;
+        std::shared_ptr<Parameter> out_biases;
+        Matrix inputs;
+        Matrix qkv;
+        Matrix attention;
+        std::vector<float> logsumexp;
+
+        void attention_forward(size_t batch, size_t head);
+        void attention_backward(size_t batch, size_t head, Matrix& attention_gradient, Matrix& qkv_gradient);
+};
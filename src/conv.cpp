@@ -0,0 +1,548 @@
+#include "conv.hpp"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+Matrix initialize_weights(size_t rows, size_t cols, float min, float max);
+Matrix gemm_to_image(Matrix& gemm_output, size_t batch_size, ImageShape shape);
+Matrix image_to_gemm(Matrix& image, size_t batch_size, ImageShape shape);
+
+/************************************************
+ *                  Conv2D                      *
+ ************************************************/
+
+Conv2DLayer::Conv2DLayer(ImageShape input_shape, size_t out_channels, size_t kernel_size, size_t stride, size_t padding, std::reference_wrapper<ActivationFunction> activation_fn, ConvAlgorithm algorithm)
+: input_shape(input_shape), out_channels(out_channels), kernel_size(kernel_size), stride(stride), padding(padding),
+  activation_fn(std::move(activation_fn)), algorithm(algorithm) {
+    if (kernel_size == 0 || stride == 0) {
+        throw std::runtime_error("Conv2DLayer kernel size and stride must be positive.");
+    }
+    if (algorithm == ConvAlgorithm::Winograd && (kernel_size != 3 || stride != 1)) {
+        throw std::runtime_error("Winograd convolution requires a 3x3 kernel with stride 1.");
+    }
+    if (input_shape.height + 2 * padding < kernel_size || input_shape.width + 2 * padding < kernel_size) {
+        throw std::runtime_error("Conv2DLayer kernel is larger than the padded input.");
+    }
+    // He uniform initialization, the fan in of a conv layer is much larger than its fan out
+    float fan_in = input_shape.channels * kernel_size * kernel_size;
+    float bound = std::sqrt(6.0f / fan_in);
+    weights = std::make_shared<Parameter>(Parameter(initialize_weights(input_shape.channels * kernel_size * kernel_size, out_channels, -bound, bound)));
+    biases = std::make_shared<Parameter>(Parameter(initialize_weights(1, out_channels, -0.1, 0.1)));
+}
+
+ImageShape Conv2DLayer::output_shape() const {
+    return {
+        out_channels,
+        (input_shape.height + 2 * padding - kernel_size) / stride + 1,
+        (input_shape.width + 2 * padding - kernel_size) / stride + 1,
+        input_shape.layout
+    };
+}
+
+bool Conv2DLayer::uses_winograd() const {
+    if (algorithm == ConvAlgorithm::Auto) {
+        return kernel_size == 3 && stride == 1;
+    }
+    return algorithm == ConvAlgorithm::Winograd;
+}
+
+Matrix Conv2DLayer::forward(Matrix input, bool training) {
+    if (input.cols() != input_shape.size()) {
+        throw std::runtime_error("Conv2DLayer received input with " + std::to_string(input.cols()) +
+                                 " columns, expected " + std::to_string(input_shape.size()));
+    }
+    if (input.is_transposed()) {
+        input = input.contiguous();
+    }
+    size_t batch_size = input.rows();
+    Matrix results;
+    if (uses_winograd()) {
+        // The patches are only needed by backward, which rebuilds them from the inputs
+        this->inputs = input;
+        this->patches = Matrix();
+        results = winograd(input);
+    } else {
+        this->patches = im2col(input);
+        results = Matrix::matMul(patches, weights->data);
+    }
+    results = Matrix::colwise_add(results, biases->data);
+    this->inner_potential = results.copy();
+    results = Matrix::apply(results, [&](float x) {return activation_fn.get().apply(x);});
+    return gemm_to_image(results, batch_size, output_shape());
+}
+
+Matrix Conv2DLayer::backward(Matrix loss_gradient) {
+    size_t batch_size = loss_gradient.rows();
+    if (loss_gradient.is_transposed()) {
+        loss_gradient = loss_gradient.contiguous();
+    }
+    loss_gradient = image_to_gemm(loss_gradient, batch_size, output_shape());
+    loss_gradient = Matrix::mul(loss_gradient, Matrix::apply(inner_potential, [&](float x) {return activation_fn.get().derivative(x);}));
+    if (patches.rows() == 0) {
+        patches = im2col(inputs);
+        inputs = Matrix();
+    }
+    Matrix::add_inplace(weights->grad, Matrix::matMul(patches.transpose(), loss_gradient));
+    Matrix::add_inplace(biases->grad, Matrix::colwise_sum(loss_gradient));
+    Matrix patch_gradient = Matrix::matMul(loss_gradient, weights->data.transpose());
+    return col2im(patch_gradient, batch_size);
+}
+
+std::vector<std::shared_ptr<Parameter>> Conv2DLayer::parameters() {
+    return {weights, biases};
+}
+
+std::shared_ptr<Model> Conv2DLayer::clone() {
+    auto copy = std::make_shared<Conv2DLayer>(*this);
+    copy->weights = std::make_shared<Parameter>(*weights);
+    copy->biases = std::make_shared<Parameter>(*biases);
+    return copy;
+}
+
+Matrix Conv2DLayer::im2col(Matrix& input) {
+    ImageShape out = output_shape();
+    size_t batch_size = input.rows();
+    size_t pixels = out.height * out.width;
+    size_t patch_size = input_shape.channels * kernel_size * kernel_size;
+
+    Matrix result(batch_size * pixels, patch_size, 0);
+    const float* src = input.raw();
+    float* dst = result.raw();
+    #pragma omp parallel for collapse(2)
+    for (size_t n = 0; n < batch_size; n++) {
+        for (size_t oh = 0; oh < out.height; oh++) {
+            const float* image = src + n * input_shape.size();
+            for (size_t ow = 0; ow < out.width; ow++) {
+                float* patch = dst + (n * pixels + oh * out.width + ow) * patch_size;
+                for (size_t c = 0; c < input_shape.channels; c++) {
+                    for (size_t kh = 0; kh < kernel_size; kh++) {
+                        // Padding is handled by leaving the zero initialized entries untouched
+                        long ih = static_cast<long>(oh * stride + kh) - static_cast<long>(padding);
+                        if (ih < 0 || ih >= static_cast<long>(input_shape.height)) {
+                            continue;
+                        }
+                        for (size_t kw = 0; kw < kernel_size; kw++) {
+                            long iw = static_cast<long>(ow * stride + kw) - static_cast<long>(padding);
+                            if (iw < 0 || iw >= static_cast<long>(input_shape.width)) {
+                                continue;
+                            }
+                            patch[(c * kernel_size + kh) * kernel_size + kw] = image[input_shape.offset(c, ih, iw)];
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return result;
+}
+
+Matrix Conv2DLayer::col2im(Matrix& patch_gradient, size_t batch_size) {
+    ImageShape out = output_shape();
+    size_t pixels = out.height * out.width;
+    size_t patch_size = input_shape.channels * kernel_size * kernel_size;
+
+    Matrix result(batch_size, input_shape.size(), 0);
+    const float* src = patch_gradient.raw();
+    float* dst = result.raw();
+    // Overlapping patches of one image accumulate into the same pixels, so images are the unit of work
+    #pragma omp parallel for
+    for (size_t n = 0; n < batch_size; n++) {
+        float* image = dst + n * input_shape.size();
+        for (size_t oh = 0; oh < out.height; oh++) {
+            for (size_t ow = 0; ow < out.width; ow++) {
+                const float* patch = src + (n * pixels + oh * out.width + ow) * patch_size;
+                for (size_t c = 0; c < input_shape.channels; c++) {
+                    for (size_t kh = 0; kh < kernel_size; kh++) {
+                        long ih = static_cast<long>(oh * stride + kh) - static_cast<long>(padding);
+                        if (ih < 0 || ih >= static_cast<long>(input_shape.height)) {
+                            continue;
+                        }
+                        for (size_t kw = 0; kw < kernel_size; kw++) {
+                            long iw = static_cast<long>(ow * stride + kw) - static_cast<long>(padding);
+                            if (iw < 0 || iw >= static_cast<long>(input_shape.width)) {
+                                continue;
+                            }
+                            image[input_shape.offset(c, ih, iw)] += patch[(c * kernel_size + kh) * kernel_size + kw];
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Winograd F(2x2,3x3) convolution producing the same (batch * pixels) x out_channels layout as im2col
+ *
+ * Each 4x4 input tile d and 3x3 filter g are transformed into V = B^T d B and U = G g G^T.
+ * The 16 elementwise products over channels become 16 independent (tiles x in) * (in x out) GEMMs,
+ * and every 2x2 output tile is recovered as Y = A^T M A.
+ */
+Matrix Conv2DLayer::winograd(Matrix& input) {
+    ImageShape out = output_shape();
+    size_t batch_size = input.rows();
+    size_t channels = input_shape.channels;
+    size_t tiles_h = (out.height + 1) / 2;
+    size_t tiles_w = (out.width + 1) / 2;
+    size_t tiles = batch_size * tiles_h * tiles_w;
+
+    // Filter transform U = G g G^T, stored as 16 channels x out_channels matrices
+    std::vector<float> U(16 * channels * out_channels);
+    const float* w = weights->data.raw();
+    #pragma omp parallel for collapse(2)
+    for (size_t c = 0; c < channels; c++) {
+        for (size_t oc = 0; oc < out_channels; oc++) {
+            float g[3][3], Gg[4][3];
+            for (size_t kh = 0; kh < 3; kh++) {
+                for (size_t kw = 0; kw < 3; kw++) {
+                    g[kh][kw] = w[((c * 3 + kh) * 3 + kw) * out_channels + oc];
+                }
+            }
+            for (size_t j = 0; j < 3; j++) {
+                Gg[0][j] = g[0][j];
+                Gg[1][j] = 0.5f * (g[0][j] + g[1][j] + g[2][j]);
+                Gg[2][j] = 0.5f * (g[0][j] - g[1][j] + g[2][j]);
+                Gg[3][j] = g[2][j];
+            }
+            for (size_t i = 0; i < 4; i++) {
+                float u[4] = {
+                    Gg[i][0],
+                    0.5f * (Gg[i][0] + Gg[i][1] + Gg[i][2]),
+                    0.5f * (Gg[i][0] - Gg[i][1] + Gg[i][2]),
+                    Gg[i][2]
+                };
+                for (size_t j = 0; j < 4; j++) {
+                    U[((i * 4 + j) * channels + c) * out_channels + oc] = u[j];
+                }
+            }
+        }
+    }
+
+    // Input transform V = B^T d B, stored as 16 tiles x channels matrices
+    std::vector<float> V(16 * tiles * channels);
+    const float* src = input.raw();
+    #pragma omp parallel for collapse(2)
+    for (size_t n = 0; n < batch_size; n++) {
+        for (size_t th = 0; th < tiles_h; th++) {
+            const float* image = src + n * input_shape.size();
+            for (size_t tw = 0; tw < tiles_w; tw++) {
+                size_t tile = (n * tiles_h + th) * tiles_w + tw;
+                for (size_t c = 0; c < channels; c++) {
+                    float d[4][4], Btd[4][4];
+                    for (size_t i = 0; i < 4; i++) {
+                        long ih = static_cast<long>(2 * th + i) - static_cast<long>(padding);
+                        for (size_t j = 0; j < 4; j++) {
+                            long iw = static_cast<long>(2 * tw + j) - static_cast<long>(padding);
+                            bool inside = ih >= 0 && iw >= 0 && ih < static_cast<long>(input_shape.height) && iw < static_cast<long>(input_shape.width);
+                            d[i][j] = inside ? image[input_shape.offset(c, ih, iw)] : 0;
+                        }
+                    }
+                    for (size_t j = 0; j < 4; j++) {
+                        Btd[0][j] = d[0][j] - d[2][j];
+                        Btd[1][j] = d[1][j] + d[2][j];
+                        Btd[2][j] = d[2][j] - d[1][j];
+                        Btd[3][j] = d[1][j] - d[3][j];
+                    }
+                    for (size_t i = 0; i < 4; i++) {
+                        float v[4] = {
+                            Btd[i][0] - Btd[i][2],
+                            Btd[i][1] + Btd[i][2],
+                            Btd[i][2] - Btd[i][1],
+                            Btd[i][1] - Btd[i][3]
+                        };
+                        for (size_t j = 0; j < 4; j++) {
+                            V[((i * 4 + j) * tiles + tile) * channels + c] = v[j];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // 16 batched GEMMs M[xi] = V[xi] * U[xi], parallel over the transform element and blocks of tiles
+    const size_t block = 64;
+    size_t blocks = (tiles + block - 1) / block;
+    std::vector<float> M(16 * tiles * out_channels, 0);
+    #pragma omp parallel for collapse(2) schedule(dynamic)
+    for (size_t xi = 0; xi < 16; xi++) {
+        for (size_t b = 0; b < blocks; b++) {
+            const float* v = V.data() + xi * tiles * channels;
+            const float* u = U.data() + xi * channels * out_channels;
+            float* m = M.data() + xi * tiles * out_channels;
+            for (size_t t = b * block; t < std::min(tiles, (b + 1) * block); t++) {
+                for (size_t c = 0; c < channels; c++) {
+                    float value = v[t * channels + c];
+                    for (size_t oc = 0; oc < out_channels; oc++) {
+                        m[t * out_channels + oc] += value * u[c * out_channels + oc];
+                    }
+                }
+            }
+        }
+    }
+
+    // Output transform Y = A^T M A, written into the im2col GEMM layout
+    size_t pixels = out.height * out.width;
+    Matrix result(batch_size * pixels, out_channels, 0);
+    float* dst = result.raw();
+    #pragma omp parallel for
+    for (size_t tile = 0; tile < tiles; tile++) {
+        size_t n = tile / (tiles_h * tiles_w);
+        size_t th = (tile / tiles_w) % tiles_h;
+        size_t tw = tile % tiles_w;
+        for (size_t oc = 0; oc < out_channels; oc++) {
+            float m[4][4], AtM[2][4];
+            for (size_t xi = 0; xi < 16; xi++) {
+                m[xi / 4][xi % 4] = M[(xi * tiles + tile) * out_channels + oc];
+            }
+            for (size_t j = 0; j < 4; j++) {
+                AtM[0][j] = m[0][j] + m[1][j] + m[2][j];
+                AtM[1][j] = m[1][j] - m[2][j] - m[3][j];
+            }
+            for (size_t i = 0; i < 2; i++) {
+                float y[2] = {
+                    AtM[i][0] + AtM[i][1] + AtM[i][2],
+                    AtM[i][1] - AtM[i][2] - AtM[i][3]
+                };
+                for (size_t j = 0; j < 2; j++) {
+                    size_t oh = 2 * th + i, ow = 2 * tw + j;
+                    // Tiles on the bottom and right edge may overhang odd output sizes
+                    if (oh < out.height && ow < out.width) {
+                        dst[(n * pixels + oh * out.width + ow) * out_channels + oc] = y[j];
+                    }
+                }
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Convert the (batch * pixels) x channels GEMM output into one image per row
+ */
+Matrix gemm_to_image(Matrix& gemm_output, size_t batch_size, ImageShape shape) {
+    size_t pixels = shape.height * shape.width;
+    if (shape.layout == TensorLayout::NHWC) {
+        // Rows of the GEMM output are already the pixels of NHWC images
+        return gemm_output.reshape(batch_size, shape.size());
+    }
+    Matrix result(batch_size, shape.size(), 0);
+    const float* src = gemm_output.raw();
+    float* dst = result.raw();
+    #pragma omp parallel for
+    for (size_t n = 0; n < batch_size; n++) {
+        for (size_t p = 0; p < pixels; p++) {
+            for (size_t c = 0; c < shape.channels; c++) {
+                dst[n * shape.size() + c * pixels + p] = src[(n * pixels + p) * shape.channels + c];
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Convert one image per row into the (batch * pixels) x channels GEMM layout
+ */
+Matrix image_to_gemm(Matrix& image, size_t batch_size, ImageShape shape) {
+    size_t pixels = shape.height * shape.width;
+    if (shape.layout == TensorLayout::NHWC) {
+        return image.reshape(batch_size * pixels, shape.channels);
+    }
+    Matrix result(batch_size * pixels, shape.channels, 0);
+    const float* src = image.raw();
+    float* dst = result.raw();
+    #pragma omp parallel for
+    for (size_t n = 0; n < batch_size; n++) {
+        for (size_t p = 0; p < pixels; p++) {
+            for (size_t c = 0; c < shape.channels; c++) {
+                dst[(n * pixels + p) * shape.channels + c] = src[n * shape.size() + c * pixels + p];
+            }
+        }
+    }
+    return result;
+}
+
+/************************************************
+ *                   Pooling                    *
+ ************************************************/
+
+Pool2D::Pool2D(ImageShape input_shape, size_t pool_size, size_t stride) : input_shape(input_shape), pool_size(pool_size), stride(stride) {
+    if (pool_size == 0 || stride == 0) {
+        throw std::runtime_error("Pooling size and stride must be positive.");
+    }
+    if (input_shape.height < pool_size || input_shape.width < pool_size) {
+        throw std::runtime_error("Pooling window is larger than the input.");
+    }
+}
+
+ImageShape Pool2D::output_shape() const {
+    return {
+        input_shape.channels,
+        (input_shape.height - pool_size) / stride + 1,
+        (input_shape.width - pool_size) / stride + 1,
+        input_shape.layout
+    };
+}
+
+std::vector<std::shared_ptr<Parameter>> Pool2D::parameters() {
+    return {};
+}
+
+MaxPool2D::MaxPool2D(ImageShape input_shape, size_t pool_size, size_t stride) : Pool2D(input_shape, pool_size, stride) {}
+
+Matrix MaxPool2D::forward(Matrix input, bool training) {
+    if (input.cols() != input_shape.size()) {
+        throw std::runtime_error("MaxPool2D received input with incompatible dimensions.");
+    }
+    if (input.is_transposed()) {
+        input = input.contiguous();
+    }
+    ImageShape out = output_shape();
+    size_t batch_size = input.rows();
+    Matrix result(batch_size, out.size(), 0);
+    argmax = std::vector<size_t>(batch_size * out.size());
+
+    const float* src = input.raw();
+    float* dst = result.raw();
+    #pragma omp parallel for collapse(2)
+    for (size_t n = 0; n < batch_size; n++) {
+        for (size_t c = 0; c < out.channels; c++) {
+            for (size_t oh = 0; oh < out.height; oh++) {
+                for (size_t ow = 0; ow < out.width; ow++) {
+                    float max_val = -std::numeric_limits<float>::infinity();
+                    size_t max_idx = 0;
+                    for (size_t kh = 0; kh < pool_size; kh++) {
+                        for (size_t kw = 0; kw < pool_size; kw++) {
+                            size_t idx = input_shape.offset(c, oh * stride + kh, ow * stride + kw);
+                            if (src[n * input_shape.size() + idx] > max_val) {
+                                max_val = src[n * input_shape.size() + idx];
+                                max_idx = idx;
+                            }
+                        }
+                    }
+                    size_t out_idx = n * out.size() + out.offset(c, oh, ow);
+                    dst[out_idx] = max_val;
+                    argmax[out_idx] = max_idx;
+                }
+            }
+        }
+    }
+    return result;
+}
+
+Matrix MaxPool2D::backward(Matrix loss_gradient) {
+    if (loss_gradient.is_transposed()) {
+        loss_gradient = loss_gradient.contiguous();
+    }
+    ImageShape out = output_shape();
+    size_t batch_size = loss_gradient.rows();
+    Matrix result(batch_size, input_shape.size(), 0);
+
+    const float* src = loss_gradient.raw();
+    float* dst = result.raw();
+    #pragma omp parallel for
+    for (size_t n = 0; n < batch_size; n++) {
+        for (size_t i = 0; i < out.size(); i++) {
+            dst[n * input_shape.size() + argmax[n * out.size() + i]] += src[n * out.size() + i];
+        }
+    }
+    return result;
+}
+
+std::shared_ptr<Model> MaxPool2D::clone() {
+    return std::make_shared<MaxPool2D>(*this);
+}
+
+AvgPool2D::AvgPool2D(ImageShape input_shape, size_t pool_size, size_t stride) : Pool2D(input_shape, pool_size, stride) {}
+
+Matrix AvgPool2D::forward(Matrix input, bool training) {
+    if (input.cols() != input_shape.size()) {
+        throw std::runtime_error("AvgPool2D received input with incompatible dimensions.");
+    }
+    if (input.is_transposed()) {
+        input = input.contiguous();
+    }
+    ImageShape out = output_shape();
+    size_t batch_size = input.rows();
+    float scale = 1.0f / (pool_size * pool_size);
+    Matrix result(batch_size, out.size(), 0);
+
+    const float* src = input.raw();
+    float* dst = result.raw();
+    #pragma omp parallel for collapse(2)
+    for (size_t n = 0; n < batch_size; n++) {
+        for (size_t c = 0; c < out.channels; c++) {
+            for (size_t oh = 0; oh < out.height; oh++) {
+                for (size_t ow = 0; ow < out.width; ow++) {
+                    float sum = 0;
+                    for (size_t kh = 0; kh < pool_size; kh++) {
+                        for (size_t kw = 0; kw < pool_size; kw++) {
+                            sum += src[n * input_shape.size() + input_shape.offset(c, oh * stride + kh, ow * stride + kw)];
+                        }
+                    }
+                    dst[n * out.size() + out.offset(c, oh, ow)] = sum * scale;
+                }
+            }
+        }
+    }
+    return result;
+}
+
+Matrix AvgPool2D::backward(Matrix loss_gradient) {
+    if (loss_gradient.is_transposed()) {
+        loss_gradient = loss_gradient.contiguous();
+    }
+    ImageShape out = output_shape();
+    size_t batch_size = loss_gradient.rows();
+    float scale = 1.0f / (pool_size * pool_size);
+    Matrix result(batch_size, input_shape.size(), 0);
+
+    const float* src = loss_gradient.raw();
+    float* dst = result.raw();
+    #pragma omp parallel for
+    for (size_t n = 0; n < batch_size; n++) {
+        for (size_t c = 0; c < out.channels; c++) {
+            for (size_t oh = 0; oh < out.height; oh++) {
+                for (size_t ow = 0; ow < out.width; ow++) {
+                    float grad = src[n * out.size() + out.offset(c, oh, ow)] * scale;
+                    for (size_t kh = 0; kh < pool_size; kh++) {
+                        for (size_t kw = 0; kw < pool_size; kw++) {
+                            dst[n * input_shape.size() + input_shape.offset(c, oh * stride + kh, ow * stride + kw)] += grad;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return result;
+}
+
+std::shared_ptr<Model> AvgPool2D::clone() {
+    return std::make_shared<AvgPool2D>(*this);
+}
+
+/************************************************
+ *                   Flatten                    *
+ ************************************************/
+
+Flatten::Flatten(ImageShape input_shape) : input_shape(input_shape) {}
+
+Matrix Flatten::forward(Matrix input, bool training) {
+    if (input.cols() != input_shape.size()) {
+        throw std::runtime_error("Flatten received input with incompatible dimensions.");
+    }
+    return input;
+}
+
+Matrix Flatten::backward(Matrix loss_gradient) {
+    return loss_gradient;
+}
+
+std::vector<std::shared_ptr<Parameter>> Flatten::parameters() {
+    return {};
+}
+
+std::shared_ptr<Model> Flatten::clone() {
+    return std::make_shared<Flatten>(*this);
+}
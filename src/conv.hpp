@@ -0,0 +1,162 @@
+#pragma once
+#include "matrix.hpp"
+#include "model.hpp"
+#include "activations.hpp"
+
+#include <memory>
+
+
+/**
+ * @brief Memory layout of an image stored in a single matrix row
+ * NCHW stores each channel as a contiguous plane, NHWC interleaves the channels of every pixel
+ */
+enum class TensorLayout {
+    NCHW,
+    NHWC
+};
+
+/**
+ * @brief Describes the spatial shape of the images flowing through a layer
+ * Every row of the matrix holds one image of channels x height x width values
+ */
+struct ImageShape {
+    size_t channels;
+    size_t height;
+    size_t width;
+    TensorLayout layout = TensorLayout::NCHW;
+
+    size_t size() const { return channels * height * width; }
+
+    /**
+     * @brief Return the offset of the given element inside a single image row
+     */
+    size_t offset(size_t channel, size_t row, size_t col) const {
+        if (layout == TensorLayout::NCHW) {
+            return (channel * height + row) * width + col;
+        }
+        return (row * width + col) * channels + channel;
+    }
+};
+
+/**
+ * @brief Algorithm used by the forward pass of a convolution
+ * Auto picks Winograd for stride 1 3x3 kernels and im2col otherwise
+ */
+enum class ConvAlgorithm {
+    Auto,
+    Im2Col,
+    Winograd
+};
+
+/**
+ * @brief A class to represent a 2D convolutional layer of a neural network model
+ *
+ * The convolution is lowered to a single GEMM over the whole batch using im2col:
+ * every output pixel becomes a row of the patch matrix, which is multiplied by the
+ * (in_channels * kernel_size^2) x out_channels weight matrix.
+ * Stride 1 3x3 convolutions use Winograd F(2x2,3x3) in the forward pass instead,
+ * which needs 16 multiplies per 2x2 output tile rather than 36.
+ */
+class Conv2DLayer : public Model {
+    public:
+        Conv2DLayer(ImageShape input_shape, size_t out_channels, size_t kernel_size, size_t stride, size_t padding, std::reference_wrapper<ActivationFunction> activation_fn, ConvAlgorithm algorithm = ConvAlgorithm::Auto);
+        Matrix forward(Matrix input, bool training=true) override;
+        Matrix backward(Matrix output_gradient) override;
+        std::vector<std::shared_ptr<Parameter>> parameters() override;
+        std::shared_ptr<Model> clone() override;
+
+        /**
+         * @brief Return the shape of the images produced by the layer
+         *
+         * @return ImageShape
+         */
+        ImageShape output_shape() const;
+
+        /**
+         * @brief Return whether the forward pass uses the Winograd algorithm
+         *
+         * @return bool
+         */
+        bool uses_winograd() const;
+    private:
+        ImageShape input_shape;
+        size_t out_channels;
+        size_t kernel_size;
+        size_t stride;
+        size_t padding;
+        std::shared_ptr<Parameter> weights;
+        std::shared_ptr<Parameter> biases;
+        Matrix inputs;
+        Matrix patches;
+        Matrix inner_potential;
+        std::reference_wrapper<ActivationFunction> activation_fn;
+        ConvAlgorithm algorithm;
+
+        Matrix im2col(Matrix& input);
+        Matrix winograd(Matrix& input);
+        Matrix col2im(Matrix& patch_gradient, size_t batch_size);
+};
+
+/**
+ * @brief Common base of the 2D pooling layers
+ *
+ */
+class Pool2D : public Model {
+    public:
+        Pool2D(ImageShape input_shape, size_t pool_size, size_t stride);
+        std::vector<std::shared_ptr<Parameter>> parameters() override;
+
+        /**
+         * @brief Return the shape of the images produced by the layer
+         *
+         * @return ImageShape
+         */
+        ImageShape output_shape() const;
+    protected:
+        ImageShape input_shape;
+        size_t pool_size;
+        size_t stride;
+};
+
+/**
+ * @brief A class to represent a 2D max pooling layer
+ *
+ */
+class MaxPool2D : public Pool2D {
+    public:
+        MaxPool2D(ImageShape input_shape, size_t pool_size, size_t stride);
+        Matrix forward(Matrix input, bool training=true) override;
+        Matrix backward(Matrix output_gradient) override;
+        std::shared_ptr<Model> clone() override;
+    private:
+        std::vector<size_t> argmax;
+};
+
+/**
+ * @brief A class to represent a 2D average pooling layer
+ *
+ */
+class AvgPool2D : public Pool2D {
+    public:
+        AvgPool2D(ImageShape input_shape, size_t pool_size, size_t stride);
+        Matrix forward(Matrix input, bool training=true) override;
+        Matrix backward(Matrix output_gradient) override;
+        std::shared_ptr<Model> clone() override;
+};
+
+/**
+ * @brief A class to represent a flattening layer between image layers and fully connected layers
+ *
+ * Images are already stored as one flattened row per sample, so the layer only checks the
+ * row size and passes the data through unchanged.
+ */
+class Flatten : public Model {
+    public:
+        Flatten(ImageShape input_shape);
+        Matrix forward(Matrix input, bool training=true) override;
+        Matrix backward(Matrix output_gradient) override;
+        std::vector<std::shared_ptr<Parameter>> parameters() override;
+        std::shared_ptr<Model> clone() override;
+    private:
+        ImageShape input_shape;
+};
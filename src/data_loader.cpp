@@ -1,37 +1,279 @@
 #include "data_loader.hpp"
+#include "dataset.hpp"
 #include <fstream>
-#include <sstream>
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <filesystem>
+#include <iostream>
+#include <bit>
+#include <type_traits>
+#include <omp.h>
 
-std::ifstream open_file(const std::string filepath);
-std::vector<float> parse_row(const std::string& line, size_t current_row);
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+bool is_blank(const char* begin, const char* end);
+size_t count_columns(const char* begin, const char* end);
+size_t count_rows(const char* begin, const char* end);
+const char* parse_value(const char* begin, const char* end, float& value);
+const char* parse_row(const char* begin, const char* end, float* destination, size_t cols, size_t current_row);
+uint64_t payload_checksum(const char* data, size_t size);
+void convert_payload(const char* source, char kind, size_t bytes, size_t count, bool swap_bytes, float* destination, const std::string& filepath);
+struct ArrayLayout;
+ArrayLayout parse_idx_header(const char* data, size_t size, const std::string& filepath);
+ArrayLayout parse_npy_header(const char* data, size_t size, const std::string& filepath);
+Matrix convert_array(const char* data, const ArrayLayout& layout, const std::string& filepath);
+Matrix parse_npy(const char* data, size_t size, std::shared_ptr<const char> mapping, const std::string& filepath);
+std::string npy_bytes(Matrix A);
+uint32_t crc32(const char* data, size_t size);
 
-Matrix DataLoader::load_from_csv(std::string filepath) {
-    std::ifstream file = open_file(filepath);
+/**
+ * @brief Read an integer stored in the given byte order from possibly unaligned memory
+ */
+template <typename T>
+T read_integer(const char* source, std::endian order) {
+    T value;
+    std::memcpy(&value, source, sizeof(T));
+    if (order != std::endian::native) {
+        value = std::byteswap(value);
+    }
+    return value;
+}
 
-    std::string line;
-    std::vector<float> data;
-    
-    getline(file, line);
-    size_t rows = 0;
-    std::vector<float> row_data = parse_row(line, rows);
-    size_t cols = row_data.size();
-    do {
-        row_data = parse_row(line, rows);
-        if (cols != row_data.size()) {
-            throw std::runtime_error("Error while loading data from CSV: Expected " + std::to_string(cols) + 
-                                        "columns but encountered " + std::to_string(row_data.size()) + "at row " + 
-                                        std::to_string(rows));
+/**
+ * @brief Append an integer in little-endian byte order
+ */
+template <typename T>
+void append_little_endian(std::string& destination, T value) {
+    if (std::endian::native != std::endian::little) {
+        value = std::byteswap(value);
+    }
+    destination.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+/**
+ * @brief Convert count elements of type T from possibly unaligned memory to floats, Bits is the unsigned integer of the same size
+ */
+template <typename T, typename Bits>
+void convert_elements(const char* source, size_t count, bool swap_bytes, float* destination) {
+    static_assert(sizeof(T) == sizeof(Bits));
+    #pragma omp parallel for
+    for (size_t i = 0; i < count; i++) {
+        Bits bits;
+        std::memcpy(&bits, source + i * sizeof(T), sizeof(T));
+        if (swap_bytes) {
+            bits = std::byteswap(bits);
+        }
+        destination[i] = static_cast<float>(std::bit_cast<T>(bits));
+    }
+}
+
+/**
+ * @brief Shape and element type of an IDX or npy array and where its payload starts
+ * The kind is the NumPy kind (b, u, i or f), a Fortran order array stores the columns one after another.
+ */
+struct ArrayLayout {
+    size_t rows;
+    size_t cols;
+    char kind;
+    size_t bytes;
+    bool swap_bytes;
+    bool fortran_order;
+    size_t payload;
+};
+
+/**
+ * @brief Read the elements of type Source (Bits is the unsigned integer of the same size) into a row-major vector of T
+ */
+template <typename T, typename Source, typename Bits>
+std::vector<T> narrow_elements(const char* source, const ArrayLayout& layout) {
+    static_assert(sizeof(Source) == sizeof(Bits));
+    const size_t count = layout.rows * layout.cols;
+    std::vector<T> values(count);
+    #pragma omp parallel for
+    for (size_t i = 0; i < count; i++) {
+        Bits bits;
+        std::memcpy(&bits, source + i * sizeof(Source), sizeof(Source));
+        if (layout.swap_bytes) {
+            bits = std::byteswap(bits);
         }
-        for (size_t col = 0; col < cols; ++col) {
-            data.push_back(row_data[col]);
+        size_t destination = layout.fortran_order ? (i % layout.rows) * layout.cols + i / layout.rows : i;
+        values[destination] = static_cast<T>(std::bit_cast<Source>(bits));
+    }
+    return values;
+}
+
+/**
+ * @brief The 64-byte header of a binary tensor file
+ */
+struct BinaryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t dtype;
+    uint32_t reserved;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t payload_bytes;
+    uint64_t checksum;
+    char padding[8];
+};
+static_assert(sizeof(BinaryHeader) == 64, "The payload must start at a 64-byte boundary");
+
+const char binary_magic[8] = {'N', 'P', 'T', 'E', 'N', 'S', 'O', 'R'};
+const uint32_t binary_version = 1;
+const uint32_t binary_byte_order = 0x01020304;
+const uint32_t binary_float32 = 1;
+
+DataLoader::DataLoader(bool cache_binary) : cache_binary(cache_binary) {}
+
+
+Matrix DataLoader::load_from_csv(std::string filepath) {
+    std::string binary_path = std::filesystem::path(filepath).replace_extension(".bin").string();
+    if (cache_binary && std::filesystem::exists(binary_path) && std::filesystem::exists(filepath) &&
+        std::filesystem::last_write_time(binary_path) >= std::filesystem::last_write_time(filepath)) {
+        try {
+            auto start = std::chrono::steady_clock::now();
+            Matrix mapped = load_binary(binary_path);
+            // Copy out of the mapping, so the result is an ordinary matrix whether the cache was used or not
+            Matrix matrix(mapped);
+            stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return matrix;
+        } catch (const std::runtime_error& error) {
+            std::cerr << "Ignoring the binary cache " << binary_path << ": " << error.what() << std::endl;
         }
-        rows++;
-    } while (getline(file, line));          
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    size_t size = 0;
+    std::shared_ptr<const char> mapping = map_file(filepath, size);
+    const char* text = mapping.get();
+    const char* text_end = text + size;
+
+    // The chunks start right after a newline, so every row belongs to exactly one chunk
+    size_t num_chunks = std::max<size_t>(1, std::min<size_t>(omp_get_max_threads(), size / 65536));
+    std::vector<const char*> chunks = {text};
+    for (size_t chunk = 1; chunk < num_chunks; chunk++) {
+        const char* begin = std::max(chunks.back(), text + chunk * size / num_chunks);
+        const char* newline = static_cast<const char*>(std::memchr(begin, '\n', text_end - begin));
+        chunks.push_back(newline == nullptr ? text_end : newline + 1);
+    }
+    chunks.push_back(text_end);
+
+    std::vector<size_t> first_row(num_chunks + 1, 0);
+    #pragma omp parallel for schedule(static, 1)
+    for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+        first_row[chunk + 1] = count_rows(chunks[chunk], chunks[chunk + 1]);
+    }
+    for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+        first_row[chunk + 1] += first_row[chunk];
+    }
+    size_t rows = first_row[num_chunks];
+    if (rows == 0) {
+        throw std::runtime_error("Error while loading data from CSV: " + filepath + " contains no rows");
+    }
+    size_t cols = count_columns(text, text_end);
 
     Matrix matrix(rows, cols, 0);
-    matrix.set(data);
+    float* data = matrix.raw();
+    std::vector<std::string> errors(num_chunks);
+    #pragma omp parallel for schedule(static, 1)
+    for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+        // Exceptions must not leave the parallel region, the first error is rethrown afterwards
+        try {
+            const char* position = chunks[chunk];
+            for (size_t row = first_row[chunk]; row < first_row[chunk + 1]; row++) {
+                position = parse_row(position, chunks[chunk + 1], data + row * cols, cols, row);
+            }
+        } catch (const std::runtime_error& error) {
+            errors[chunk] = error.what();
+        }
+    }
+    for (const std::string& error : errors) {
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+    }
+
+    stats.bytes = size;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (cache_binary) {
+        // The cache only saves time, a failure to write it is not an error
+        try {
+            write_binary(matrix, binary_path);
+        } catch (const std::runtime_error& error) {
+            std::cerr << "Failed to write the binary cache " << binary_path << ": " << error.what() << std::endl;
+        }
+    }
+    return matrix;
+}
+
+void DataLoader::write_binary(Matrix A, std::string filepath) {
+    Matrix values = A.contiguous();
+    const char* payload = reinterpret_cast<const char*>(values.raw());
+    BinaryHeader header = {};
+    std::copy(binary_magic, binary_magic + 8, header.magic);
+    header.version = binary_version;
+    header.byte_order = binary_byte_order;
+    header.dtype = binary_float32;
+    header.rows = values.rows();
+    header.cols = values.cols();
+    header.payload_bytes = values.rows() * values.cols() * sizeof(float);
+    header.checksum = payload_checksum(payload, header.payload_bytes);
+
+    std::string temporary_path = filepath + ".tmp";
+    {
+        std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            throw std::runtime_error("Failed to open file: " + temporary_path);
+        }
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(payload, header.payload_bytes);
+        if (!file) {
+            throw std::runtime_error("Failed to write file: " + temporary_path);
+        }
+    }
+    std::filesystem::rename(temporary_path, filepath);
+}
+
+Matrix DataLoader::load_binary(std::string filepath, bool verify_checksum) {
+    auto start = std::chrono::steady_clock::now();
+    size_t size = 0;
+    std::shared_ptr<const char> mapping = map_file(filepath, size, true);
+    if (size < sizeof(BinaryHeader)) {
+        throw std::runtime_error("Binary tensor file is too short: " + filepath);
+    }
+    BinaryHeader header;
+    std::memcpy(&header, mapping.get(), sizeof(header));
+    if (!std::equal(binary_magic, binary_magic + 8, header.magic)) {
+        throw std::runtime_error("Not a binary tensor file: " + filepath);
+    }
+    if (header.byte_order != binary_byte_order) {
+        throw std::runtime_error("Binary tensor file was written with a different byte order: " + filepath);
+    }
+    if (header.version != binary_version || header.dtype != binary_float32) {
+        throw std::runtime_error("Unsupported version or dtype of binary tensor file: " + filepath);
+    }
+    if (header.payload_bytes != header.rows * header.cols * sizeof(float) || size < sizeof(BinaryHeader) + header.payload_bytes) {
+        throw std::runtime_error("Binary tensor file is truncated: " + filepath);
+    }
+    const char* payload = mapping.get() + sizeof(BinaryHeader);
+    if (verify_checksum && payload_checksum(payload, header.payload_bytes) != header.checksum) {
+        throw std::runtime_error("Checksum mismatch in binary tensor file: " + filepath);
+    }
 
+    // The mapping is copy-on-write, so the payload may be handed out as writable storage
+    float* storage = reinterpret_cast<float*>(const_cast<char*>(payload));
+    Matrix matrix = Matrix::view_of(header.rows, header.cols, storage, std::shared_ptr<float>(mapping, storage));
+    stats.bytes = size;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
     return matrix;
 }
 
@@ -54,28 +296,597 @@ void DataLoader::write_to_csv(Matrix A, std::string filepath) {
     file.close();
 }
 
-std::ifstream open_file(const std::string filepath) {
-    std::ifstream file(filepath);
-    if (!file.is_open()) {
+const LoadStats& DataLoader::last_stats() const {
+    return stats;
+}
+
+double LoadStats::gigabytes_per_second() const {
+    return seconds > 0 ? bytes / seconds / 1e9 : 0;
+}
+
+/**************************************
+                 IDX
+ **************************************/
+
+Matrix DataLoader::load_idx(std::string filepath) {
+    auto start = std::chrono::steady_clock::now();
+    size_t size = 0;
+    std::shared_ptr<const char> mapping = map_file(filepath, size);
+    Matrix matrix = convert_array(mapping.get(), parse_idx_header(mapping.get(), size, filepath), filepath);
+    stats.bytes = size;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return matrix;
+}
+
+void DataLoader::write_idx(Matrix A, std::string filepath, IdxType type) {
+    A = A.contiguous();
+    const size_t count = A.rows() * A.cols();
+    const float* values = A.raw();
+    std::string bytes = {0, 0, static_cast<char>(type), static_cast<char>(A.cols() == 1 ? 1 : 2)};
+    for (size_t dimension : {A.rows(), A.cols()}) {
+        if (dimension > UINT32_MAX) {
+            throw std::runtime_error("Matrix is too large for an IDX file: " + filepath);
+        }
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            bytes += static_cast<char>(dimension >> shift);
+        }
+        if (A.cols() == 1) {
+            break;
+        }
+    }
+    size_t header = bytes.size();
+    if (type == IdxType::UnsignedByte) {
+        bytes.resize(header + count);
+        for (size_t i = 0; i < count; i++) {
+            if (values[i] < 0 || values[i] > 255 || values[i] != std::floor(values[i])) {
+                throw std::runtime_error("Value " + std::to_string(values[i]) + " cannot be stored as an unsigned byte in " + filepath);
+            }
+            bytes[header + i] = static_cast<char>(static_cast<uint8_t>(values[i]));
+        }
+    } else {
+        bytes.resize(header + count * sizeof(float));
+        for (size_t i = 0; i < count; i++) {
+            uint32_t bits = std::bit_cast<uint32_t>(values[i]);
+            if (std::endian::native != std::endian::big) {
+                bits = std::byteswap(bits);
+            }
+            std::memcpy(bytes.data() + header + i * sizeof(float), &bits, sizeof(float));
+        }
+    }
+    std::ofstream file(filepath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open() || !file.write(bytes.data(), bytes.size())) {
+        throw std::runtime_error("Failed to write file: " + filepath);
+    }
+}
+
+/**************************************
+               NPY / NPZ
+ **************************************/
+
+Matrix DataLoader::load_npy(std::string filepath) {
+    auto start = std::chrono::steady_clock::now();
+    size_t size = 0;
+    std::shared_ptr<const char> mapping = map_file(filepath, size, true);
+    Matrix matrix = parse_npy(mapping.get(), size, mapping, filepath);
+    stats.bytes = size;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return matrix;
+}
+
+CompactMatrix DataLoader::load_compact(std::string filepath) {
+    auto start = std::chrono::steady_clock::now();
+    size_t size = 0;
+    std::shared_ptr<const char> mapping = map_file(filepath, size, true);
+    const char* data = mapping.get();
+    bool npy = size >= 6 && std::memcmp(data, "\x93NUMPY", 6) == 0;
+    ArrayLayout layout = npy ? parse_npy_header(data, size, filepath) : parse_idx_header(data, size, filepath);
+    const char* values = data + layout.payload;
+
+    CompactMatrix matrix;
+    if ((layout.kind == 'u' || layout.kind == 'b') && layout.bytes == 1) {
+        matrix = CompactMatrix(layout.rows, layout.cols, narrow_elements<uint8_t, uint8_t, uint8_t>(values, layout));
+    } else if (layout.kind == 'i' && layout.bytes == 1) {
+        matrix = CompactMatrix(layout.rows, layout.cols, narrow_elements<int16_t, int8_t, uint8_t>(values, layout));
+    } else if (layout.kind == 'i' && layout.bytes == 2) {
+        matrix = CompactMatrix(layout.rows, layout.cols, narrow_elements<int16_t, int16_t, uint16_t>(values, layout));
+    } else {
+        // Wider types are kept as floats, a float32 npy array stays bound to the mapping
+        matrix = CompactMatrix(npy ? parse_npy(data, size, mapping, filepath) : convert_array(data, layout, filepath), StorageType::Float32);
+    }
+    stats.bytes = size;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return matrix;
+}
+
+void DataLoader::write_npy(Matrix A, std::string filepath) {
+    std::string bytes = npy_bytes(A);
+    std::ofstream file(filepath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open() || !file.write(bytes.data(), bytes.size())) {
+        throw std::runtime_error("Failed to write file: " + filepath);
+    }
+}
+
+std::map<std::string, Matrix> DataLoader::load_npz(std::string filepath) {
+    auto start = std::chrono::steady_clock::now();
+    size_t size = 0;
+    std::shared_ptr<const char> mapping = map_file(filepath, size);
+    const char* data = mapping.get();
+    const std::endian little = std::endian::little;
+
+    // The end of central directory record is the last 22 bytes plus a comment of up to 65535 bytes
+    size_t end_record = size;
+    size_t lowest = size > 22 + 65535 ? size - 22 - 65535 : 0;
+    for (size_t position = size >= 22 ? size - 21 : 0; position-- > lowest;) {
+        if (read_integer<uint32_t>(data + position, little) == 0x06054b50) {
+            end_record = position;
+            break;
+        }
+    }
+    if (end_record == size) {
+        throw std::runtime_error("Not a zip archive: " + filepath);
+    }
+    size_t entries = read_integer<uint16_t>(data + end_record + 10, little);
+    size_t directory = read_integer<uint32_t>(data + end_record + 16, little);
+
+    std::map<std::string, Matrix> arrays;
+    for (size_t entry = 0; entry < entries; entry++) {
+        if (directory + 46 > size || read_integer<uint32_t>(data + directory, little) != 0x02014b50) {
+            throw std::runtime_error("Invalid zip central directory in file: " + filepath);
+        }
+        uint16_t method = read_integer<uint16_t>(data + directory + 10, little);
+        size_t compressed_size = read_integer<uint32_t>(data + directory + 20, little);
+        size_t name_length = read_integer<uint16_t>(data + directory + 28, little);
+        size_t extra_length = read_integer<uint16_t>(data + directory + 30, little);
+        size_t comment_length = read_integer<uint16_t>(data + directory + 32, little);
+        size_t local_header = read_integer<uint32_t>(data + directory + 42, little);
+        std::string name(data + directory + 46, name_length);
+        directory += 46 + name_length + extra_length + comment_length;
+
+        if (method != 0) {
+            throw std::runtime_error("Compressed npz entries are not supported, save " + name + " with numpy.savez: " + filepath);
+        }
+        if (compressed_size == UINT32_MAX || local_header + 30 > size) {
+            throw std::runtime_error("Zip64 or truncated npz entry " + name + " in file: " + filepath);
+        }
+        size_t payload = local_header + 30 + read_integer<uint16_t>(data + local_header + 26, little) +
+                         read_integer<uint16_t>(data + local_header + 28, little);
+        if (payload + compressed_size > size) {
+            throw std::runtime_error("Truncated npz entry " + name + " in file: " + filepath);
+        }
+        if (name.size() > 4 && name.ends_with(".npy")) {
+            name.resize(name.size() - 4);
+        }
+        // The entries are not aligned within the archive, so they are always copied
+        arrays.emplace(name, parse_npy(data + payload, compressed_size, nullptr, filepath + ":" + name));
+    }
+    stats.bytes = size;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return arrays;
+}
+
+void DataLoader::write_npz(const std::map<std::string, Matrix>& arrays, std::string filepath) {
+    std::string archive, directory;
+    for (auto& [key, matrix] : arrays) {
+        std::string name = key + ".npy";
+        std::string payload = npy_bytes(matrix);
+        if (archive.size() > UINT32_MAX || payload.size() > UINT32_MAX) {
+            throw std::runtime_error("Arrays are too large for an npz archive without Zip64: " + filepath);
+        }
+        uint32_t checksum = crc32(payload.data(), payload.size());
+        uint32_t offset = archive.size();
+
+        // Local file header: stored, no data descriptor
+        append_little_endian<uint32_t>(archive, 0x04034b50);
+        append_little_endian<uint16_t>(archive, 20);
+        append_little_endian<uint16_t>(archive, 0);
+        append_little_endian<uint16_t>(archive, 0);
+        append_little_endian<uint32_t>(archive, 0);
+        append_little_endian<uint32_t>(archive, checksum);
+        append_little_endian<uint32_t>(archive, payload.size());
+        append_little_endian<uint32_t>(archive, payload.size());
+        append_little_endian<uint16_t>(archive, name.size());
+        append_little_endian<uint16_t>(archive, 0);
+        archive += name;
+        archive += payload;
+
+        append_little_endian<uint32_t>(directory, 0x02014b50);
+        append_little_endian<uint16_t>(directory, 20);
+        append_little_endian<uint16_t>(directory, 20);
+        append_little_endian<uint16_t>(directory, 0);
+        append_little_endian<uint16_t>(directory, 0);
+        append_little_endian<uint32_t>(directory, 0);
+        append_little_endian<uint32_t>(directory, checksum);
+        append_little_endian<uint32_t>(directory, payload.size());
+        append_little_endian<uint32_t>(directory, payload.size());
+        append_little_endian<uint16_t>(directory, name.size());
+        append_little_endian<uint16_t>(directory, 0);
+        append_little_endian<uint16_t>(directory, 0);
+        append_little_endian<uint16_t>(directory, 0);
+        append_little_endian<uint16_t>(directory, 0);
+        append_little_endian<uint32_t>(directory, 0);
+        append_little_endian<uint32_t>(directory, offset);
+        directory += name;
+    }
+    uint32_t directory_offset = archive.size();
+    archive += directory;
+    append_little_endian<uint32_t>(archive, 0x06054b50);
+    append_little_endian<uint16_t>(archive, 0);
+    append_little_endian<uint16_t>(archive, 0);
+    append_little_endian<uint16_t>(archive, arrays.size());
+    append_little_endian<uint16_t>(archive, arrays.size());
+    append_little_endian<uint32_t>(archive, directory.size());
+    append_little_endian<uint32_t>(archive, directory_offset);
+    append_little_endian<uint16_t>(archive, 0);
+
+    std::ofstream file(filepath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open() || !file.write(archive.data(), archive.size())) {
+        throw std::runtime_error("Failed to write file: " + filepath);
+    }
+}
+
+/**
+ * @brief Parse an .npy array, a little-endian float32 array in C order is bound to the mapping if one is given
+ */
+/**
+ * @brief Parse the header of an IDX file, the first dimension becomes the rows and the others the columns
+ */
+ArrayLayout parse_idx_header(const char* data, size_t size, const std::string& filepath) {
+    if (size >= 2 && static_cast<unsigned char>(data[0]) == 0x1f && static_cast<unsigned char>(data[1]) == 0x8b) {
+        throw std::runtime_error("IDX file is gzipped, decompress it first: " + filepath);
+    }
+    if (size < 4 || data[0] != 0 || data[1] != 0) {
+        throw std::runtime_error("Not an IDX file: " + filepath);
+    }
+    char kind;
+    size_t bytes;
+    switch (static_cast<unsigned char>(data[2])) {
+        case 0x08: kind = 'u'; bytes = 1; break;
+        case 0x09: kind = 'i'; bytes = 1; break;
+        case 0x0B: kind = 'i'; bytes = 2; break;
+        case 0x0C: kind = 'i'; bytes = 4; break;
+        case 0x0D: kind = 'f'; bytes = 4; break;
+        case 0x0E: kind = 'f'; bytes = 8; break;
+        default: throw std::runtime_error("Unknown IDX element type in file: " + filepath);
+    }
+    size_t dimensions = static_cast<unsigned char>(data[3]);
+    if (dimensions == 0 || size < 4 + 4 * dimensions) {
+        throw std::runtime_error("Invalid IDX header in file: " + filepath);
+    }
+    size_t rows = read_integer<uint32_t>(data + 4, std::endian::big);
+    size_t cols = 1;
+    for (size_t d = 1; d < dimensions; d++) {
+        cols *= read_integer<uint32_t>(data + 4 + 4 * d, std::endian::big);
+    }
+    size_t payload = 4 + 4 * dimensions;
+    if (size < payload + rows * cols * bytes) {
+        throw std::runtime_error("IDX file is truncated: " + filepath);
+    }
+    return {rows, cols, kind, bytes, std::endian::native != std::endian::big, false, payload};
+}
+
+/**
+ * @brief Parse the header of an npy file, the first dimension becomes the rows and the others the columns
+ */
+ArrayLayout parse_npy_header(const char* data, size_t size, const std::string& filepath) {
+    if (size < 10 || std::memcmp(data, "\x93NUMPY", 6) != 0) {
+        throw std::runtime_error("Not an npy file: " + filepath);
+    }
+    // Version 1 stores the header length in 2 bytes, versions 2 and 3 in 4 bytes
+    uint8_t major = data[6];
+    size_t header_offset = major == 1 ? 10 : 12;
+    if (major < 1 || major > 3 || size < header_offset) {
+        throw std::runtime_error("Invalid npy header in file: " + filepath);
+    }
+    size_t header_length = major == 1 ? read_integer<uint16_t>(data + 8, std::endian::little) : read_integer<uint32_t>(data + 8, std::endian::little);
+    if (header_offset + header_length > size) {
+        throw std::runtime_error("Invalid npy header in file: " + filepath);
+    }
+    std::string header(data + header_offset, header_length);
+    auto value_of = [&](const std::string& key) {
+        size_t position = header.find("'" + key + "'");
+        if (position == std::string::npos) {
+            throw std::runtime_error("npy header without " + key + " in file: " + filepath);
+        }
+        position = header.find(':', position) + 1;
+        while (position < header.size() && header[position] == ' ') {
+            position++;
+        }
+        size_t end = header[position] == '(' ? header.find(')', position) + 1 : header.find_first_of(",}", position);
+        return header.substr(position, end - position);
+    };
+
+    std::string descr = value_of("descr");
+    if (descr.size() < 5 || descr.front() != '\'' || descr.back() != '\'') {
+        throw std::runtime_error("Unsupported npy dtype " + descr + " in file: " + filepath);
+    }
+    char order = descr[1], kind = descr[2];
+    size_t bytes = std::stoul(descr.substr(3, descr.size() - 4));
+    bool swap_bytes = bytes > 1 && (order == '<' ? std::endian::native != std::endian::little :
+                                    order == '>' ? std::endian::native != std::endian::big : false);
+    bool fortran_order = value_of("fortran_order") == "True";
+
+    std::vector<size_t> shape;
+    std::string dimensions = value_of("shape");
+    for (size_t position = 1; position < dimensions.size();) {
+        size_t end = position;
+        while (end < dimensions.size() && std::isdigit(static_cast<unsigned char>(dimensions[end]))) {
+            end++;
+        }
+        if (end > position) {
+            shape.push_back(std::stoul(dimensions.substr(position, end - position)));
+        }
+        position = end + 1;
+    }
+    size_t rows = shape.empty() ? 1 : shape[0];
+    size_t cols = 1;
+    for (size_t d = 1; d < shape.size(); d++) {
+        cols *= shape[d];
+    }
+    if (fortran_order && shape.size() > 2) {
+        throw std::runtime_error("Fortran order is only supported for 1-D and 2-D npy arrays: " + filepath);
+    }
+    size_t payload = header_offset + header_length;
+    if (payload + rows * cols * bytes > size) {
+        throw std::runtime_error("npy file is truncated: " + filepath);
+    }
+    return {rows, cols, kind, bytes, swap_bytes, fortran_order, payload};
+
+}
+
+Matrix parse_npy(const char* data, size_t size, std::shared_ptr<const char> mapping, const std::string& filepath) {
+    ArrayLayout layout = parse_npy_header(data, size, filepath);
+    const char* values = data + layout.payload;
+    if (mapping && layout.kind == 'f' && layout.bytes == 4 && !layout.swap_bytes && !layout.fortran_order &&
+        reinterpret_cast<uintptr_t>(values) % alignof(float) == 0) {
+        float* storage = reinterpret_cast<float*>(const_cast<char*>(values));
+        return Matrix::view_of(layout.rows, layout.cols, storage, std::shared_ptr<float>(mapping, storage));
+    }
+    return convert_array(data, layout, filepath);
+}
+
+/**
+ * @brief Convert the payload of an array to a row-major float matrix in parallel
+ */
+Matrix convert_array(const char* data, const ArrayLayout& layout, const std::string& filepath) {
+    // A Fortran order 2-D array is the C order transpose
+    Matrix matrix = layout.fortran_order ? Matrix(layout.cols, layout.rows, 0) : Matrix(layout.rows, layout.cols, 0);
+    convert_payload(data + layout.payload, layout.kind, layout.bytes, layout.rows * layout.cols, layout.swap_bytes, matrix.raw(), filepath);
+    return layout.fortran_order ? matrix.transpose().contiguous() : matrix;
+}
+
+/**
+ * @brief Serialize the matrix as a version 1.0 .npy file of little-endian float32 values in C order
+ */
+std::string npy_bytes(Matrix A) {
+    A = A.contiguous();
+    std::string header = "{'descr': '<f4', 'fortran_order': False, 'shape': (" + std::to_string(A.rows()) + ", " +
+                         std::to_string(A.cols()) + "), }";
+    // The header is padded with spaces and ends with a newline, so the data starts at a multiple of 64 bytes
+    header.append(63 - (10 + header.size()) % 64, ' ');
+    header += '\n';
+    std::string bytes = "\x93NUMPY";
+    bytes += '\x01';
+    bytes += '\x00';
+    append_little_endian<uint16_t>(bytes, header.size());
+    bytes += header;
+    size_t count = A.rows() * A.cols();
+    size_t payload = bytes.size();
+    bytes.resize(payload + count * sizeof(float));
+    const float* values = A.raw();
+    for (size_t i = 0; i < count; i++) {
+        uint32_t bits = std::bit_cast<uint32_t>(values[i]);
+        if (std::endian::native != std::endian::little) {
+            bits = std::byteswap(bits);
+        }
+        std::memcpy(bytes.data() + payload + i * sizeof(float), &bits, sizeof(float));
+    }
+    return bytes;
+}
+
+/**
+ * @brief Convert count elements of the NumPy kind (b, u, i or f) and size in bytes to floats
+ */
+void convert_payload(const char* source, char kind, size_t bytes, size_t count, bool swap_bytes, float* destination, const std::string& filepath) {
+    switch (kind == 'b' ? 'u' : kind) {
+        case 'u':
+            if (bytes == 1) return convert_elements<uint8_t, uint8_t>(source, count, false, destination);
+            if (bytes == 2) return convert_elements<uint16_t, uint16_t>(source, count, swap_bytes, destination);
+            if (bytes == 4) return convert_elements<uint32_t, uint32_t>(source, count, swap_bytes, destination);
+            if (bytes == 8) return convert_elements<uint64_t, uint64_t>(source, count, swap_bytes, destination);
+            break;
+        case 'i':
+            if (bytes == 1) return convert_elements<int8_t, uint8_t>(source, count, false, destination);
+            if (bytes == 2) return convert_elements<int16_t, uint16_t>(source, count, swap_bytes, destination);
+            if (bytes == 4) return convert_elements<int32_t, uint32_t>(source, count, swap_bytes, destination);
+            if (bytes == 8) return convert_elements<int64_t, uint64_t>(source, count, swap_bytes, destination);
+            break;
+        case 'f':
+            if (bytes == 4) return convert_elements<float, uint32_t>(source, count, swap_bytes, destination);
+            if (bytes == 8) return convert_elements<double, uint64_t>(source, count, swap_bytes, destination);
+            break;
+    }
+    throw std::runtime_error("Unsupported element type " + std::string(1, kind) + std::to_string(bytes) + " in file: " + filepath);
+}
+
+/**
+ * @brief The CRC-32 of zip archives
+ */
+uint32_t crc32(const char* data, size_t size) {
+    static const std::vector<uint32_t> table = []() {
+        std::vector<uint32_t> table(256);
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; bit++) {
+                value = value & 1 ? 0xEDB88320 ^ (value >> 1) : value >> 1;
+            }
+            table[i] = value;
+        }
+        return table;
+    }();
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+std::shared_ptr<const char> map_file(const std::string& filepath, size_t& size, bool copy_on_write) {
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) {
         throw std::runtime_error("Failed to open file: " + filepath);
     }
-    return file;
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+        close(fd);
+        throw std::runtime_error("Failed to read the size of file: " + filepath);
+    }
+    size = status.st_size;
+    if (size == 0) {
+        close(fd);
+        throw std::runtime_error("File is empty: " + filepath);
+    }
+    void* memory = mmap(nullptr, size, copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid after closing the descriptor
+    close(fd);
+    if (memory == MAP_FAILED) {
+        throw std::runtime_error("Failed to map file: " + filepath);
+    }
+    madvise(memory, size, MADV_SEQUENTIAL);
+    return std::shared_ptr<const char>(static_cast<const char*>(memory), [size](const char* pointer) {
+        munmap(const_cast<char*>(pointer), size);
+    });
 }
 
-std::vector<float> parse_row(const std::string& line, size_t current_row) {
-    std::stringstream line_stream(line);
-    std::string cell;
-    std::vector<float> row_data;
+/**
+ * @brief 64-bit checksum of the payload, four interleaved FNV-1a lanes over 8-byte words so it runs at memory speed
+ */
+uint64_t payload_checksum(const char* data, size_t size) {
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t lanes[4] = {0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL, 0x9ce484222325cbf2ULL, 0x2325cbf29ce48422ULL};
+    size_t words = size / 8;
+    size_t i = 0;
+    for (; i + 4 <= words; i += 4) {
+        for (size_t lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            std::memcpy(&word, data + (i + lane) * 8, 8);
+            lanes[lane] = (lanes[lane] ^ word) * prime;
+        }
+    }
+    for (size_t byte = i * 8; byte < size; byte++) {
+        lanes[0] = (lanes[0] ^ static_cast<unsigned char>(data[byte])) * prime;
+    }
+    uint64_t checksum = size;
+    for (uint64_t lane : lanes) {
+        checksum = (checksum ^ lane) * prime;
+    }
+    return checksum;
+}
 
-    while (getline(line_stream, cell, ',')) {
-        try {
-            float value = stof(cell);
-            row_data.push_back(value);
-        } catch (std::invalid_argument const& ex) {
-            throw std::runtime_error("Invalid numerical value at row " + std::to_string(current_row) +
-                                ", column " + std::to_string(row_data.size()));
+bool is_blank(const char* begin, const char* end) {
+    while (begin < end && (*begin == ' ' || *begin == '\t' || *begin == '\r')) {
+        begin++;
+    }
+    return begin == end;
+}
+
+/**
+ * @brief Return the number of values in the first non-empty line
+ */
+size_t count_columns(const char* begin, const char* end) {
+    while (begin < end) {
+        const char* newline = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+        const char* line_end = newline == nullptr ? end : newline;
+        if (!is_blank(begin, line_end)) {
+            return std::count(begin, line_end, ',') + 1;
         }
+        begin = line_end + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Return the number of non-empty lines
+ */
+size_t count_rows(const char* begin, const char* end) {
+    size_t rows = 0;
+    while (begin < end) {
+        const char* newline = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+        const char* line_end = newline == nullptr ? end : newline;
+        rows += !is_blank(begin, line_end);
+        begin = line_end + 1;
+    }
+    return rows;
+}
+
+/**
+ * @brief Parse one value and return the position after it, or nullptr if there is no valid number
+ * Integers of up to 7 digits, e.g. pixel values and labels, are exact in a float and are parsed directly,
+ * everything else goes through std::from_chars
+ */
+const char* parse_value(const char* begin, const char* end, float& value) {
+    const char* digits = begin + (begin < end && *begin == '-');
+    const char* position = digits;
+    uint32_t integer = 0;
+    while (position < end && position - digits < 8 && static_cast<unsigned>(*position - '0') < 10) {
+        integer = integer * 10 + (*position - '0');
+        position++;
+    }
+    size_t length = position - digits;
+    bool complete = position == end || (*position != '.' && *position != 'e' && *position != 'E' && static_cast<unsigned>(*position - '0') >= 10);
+    if (length > 0 && length <= 7 && complete) {
+        value = digits == begin ? integer : -static_cast<float>(integer);
+        return position;
     }
+    auto [value_end, error] = std::from_chars(begin, end, value);
+    return error == std::errc() ? value_end : nullptr;
+}
 
-    return row_data;
+/**
+ * @brief Parse the next non-empty line into cols floats and return the position after it
+ */
+const char* parse_row(const char* begin, const char* end, float* destination, size_t cols, size_t current_row) {
+    const char* line_end;
+    while (true) {
+        const char* newline = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+        line_end = newline == nullptr ? end : newline;
+        if (!is_blank(begin, line_end)) {
+            break;
+        }
+        begin = line_end + 1;
+    }
+
+    const char* position = begin;
+    size_t col = 0;
+    while (true) {
+        while (position < line_end && (*position == ' ' || *position == '\t' || *position == '+')) {
+            position++;
+        }
+        if (col == cols) {
+            throw std::runtime_error("Error while loading data from CSV: Expected " + std::to_string(cols) +
+                                     " columns but encountered more at row " + std::to_string(current_row));
+        }
+        const char* value_end = parse_value(position, line_end, destination[col]);
+        if (value_end == nullptr) {
+            throw std::runtime_error("Invalid numerical value at row " + std::to_string(current_row) +
+                                     ", column " + std::to_string(col));
+        }
+        col++;
+        position = value_end;
+        while (position < line_end && (*position == ' ' || *position == '\t' || *position == '\r')) {
+            position++;
+        }
+        if (position == line_end) {
+            break;
+        }
+        if (*position != ',') {
+            throw std::runtime_error("Invalid numerical value at row " + std::to_string(current_row) +
+                                     ", column " + std::to_string(col - 1));
+        }
+        position++;
+    }
+    if (col != cols) {
+        throw std::runtime_error("Error while loading data from CSV: Expected " + std::to_string(cols) +
+                                 " columns but encountered " + std::to_string(col) + " at row " + std::to_string(current_row));
+    }
+    return line_end == end ? end : line_end + 1;
 }
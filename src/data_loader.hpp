@@ -2,6 +2,29 @@
 #include "matrix.hpp"
 #include <string>
 #include <vector>
+#include <memory>
+#include <map>
+#include <cstdint>
+
+class CompactMatrix;
+
+/**
+ * @brief Size and wall time of the last file loaded by a DataLoader
+ */
+struct LoadStats {
+    size_t bytes = 0;
+    double seconds = 0;
+
+    double gigabytes_per_second() const;
+};
+
+/**
+ * @brief Element types that write_idx can store
+ */
+enum class IdxType : uint8_t {
+    UnsignedByte = 0x08,
+    Float = 0x0D,
+};
 
 /**
  * @brief Class provides functionality for loading data into matrices
@@ -9,8 +32,22 @@
  */
 class DataLoader {
     public:
+        /**
+         * @brief With cache_binary, load_from_csv keeps a binary copy of every CSV file next to it (x.csv -> x.bin)
+         * The first load parses the CSV and writes the binary file, later loads read the binary file as long as
+         * it is newer than the CSV file. load_from_csv returns an owning matrix either way, use load_binary
+         * directly for a matrix bound to the mapped file.
+         *
+         * @param cache_binary 
+         */
+        DataLoader(bool cache_binary=false);
+
         /**
         * @brief Load CSV numeric data from the specified file into a matrix. 
+        *
+        * The file is memory-mapped and split into one newline-aligned chunk per thread. Every chunk counts its
+        * rows, so each thread knows where its rows start, and then parses its values with std::from_chars
+        * straight into the presized matrix. Empty lines are skipped and Windows line endings are accepted.
         * 
         * @param filepath 
         * @return Matrix 
@@ -19,4 +56,118 @@ class DataLoader {
 
         void write_to_csv(Matrix A, std::string filepath);
 
+        /**
+         * @brief Write the matrix as a binary tensor file
+         *
+         * The file starts with a 64-byte header: the magic "NPTENSOR", the format version, the byte order mark
+         * 0x01020304, the dtype (1 = float32), the rows, the columns, the payload size and a 64-bit checksum of the
+         * payload, all in the byte order of the writing machine. The row-major payload follows at offset 64, so it
+         * is 64-byte aligned in a mapping. The file is written under a temporary name and renamed when complete.
+         *
+         * @param A 
+         * @param filepath 
+         */
+        void write_binary(Matrix A, std::string filepath);
+
+        /**
+         * @brief Map a binary tensor file and return a matrix bound to the mapped payload, nothing is copied
+         *
+         * The mapping is private and copy-on-write, so writes to the matrix never reach the file. Like every bound
+         * matrix, it only accepts assignments of the same shape, assign a copy to change the shape.
+         *
+         * @param filepath 
+         * @param verify_checksum 
+         * @return Matrix 
+         */
+        Matrix load_binary(std::string filepath, bool verify_checksum=true);
+
+        /**
+         * @brief Load an IDX file as used by MNIST, the first dimension becomes the rows and the others are flattened
+         * into the columns, so 60000 x 28 x 28 images give a 60000 x 784 matrix and 1-D labels a column vector.
+         * All IDX element types are supported, the big-endian payload is converted from the mapped file in parallel.
+         * Gzipped files must be decompressed first.
+         *
+         * @param filepath 
+         * @return Matrix 
+         */
+        Matrix load_idx(std::string filepath);
+
+        /**
+         * @brief Write the matrix as an IDX file with 2 dimensions, or 1 dimension if it has a single column
+         * UnsignedByte needs integer values in [0, 255]
+         *
+         * @param A 
+         * @param filepath 
+         * @param type 
+         */
+        void write_idx(Matrix A, std::string filepath, IdxType type=IdxType::Float);
+
+        /**
+         * @brief Load a NumPy .npy file of bool, integer or floating point values in either byte order
+         *
+         * The first dimension becomes the rows and the others are flattened into the columns. A little-endian
+         * float32 array in C order is returned bound to the copy-on-write mapping of the file without copying,
+         * all other arrays are converted in parallel. Fortran order is supported for 1-D and 2-D arrays.
+         *
+         * @param filepath 
+         * @return Matrix 
+         */
+        Matrix load_npy(std::string filepath);
+
+        /**
+         * @brief Load an IDX or npy file (told apart by the npy magic) in its narrowest CompactMatrix storage
+         *
+         * Unsigned bytes and bools are read straight into UInt8 and signed 8 and 16-bit integers into Int16,
+         * without a float copy in between. Wider types are loaded as floats, a float32 npy array in C order
+         * stays bound to the mapping of the file.
+         *
+         * @param filepath 
+         * @return CompactMatrix 
+         */
+        CompactMatrix load_compact(std::string filepath);
+
+        /**
+         * @brief Write the matrix as a 2-D little-endian float32 .npy file
+         *
+         * @param A 
+         * @param filepath 
+         */
+        void write_npy(Matrix A, std::string filepath);
+
+        /**
+         * @brief Load all arrays of an uncompressed .npz archive as written by numpy.savez, keyed by their names
+         * Compressed archives from numpy.savez_compressed are rejected
+         *
+         * @param filepath 
+         * @return std::map<std::string, Matrix> 
+         */
+        std::map<std::string, Matrix> load_npz(std::string filepath);
+
+        /**
+         * @brief Write the matrices as an uncompressed .npz archive that numpy.load reads
+         *
+         * @param arrays 
+         * @param filepath 
+         */
+        void write_npz(const std::map<std::string, Matrix>& arrays, std::string filepath);
+
+        /**
+         * @brief Return the size and load time of the last loaded file
+         *
+         * @return const LoadStats& 
+         */
+        const LoadStats& last_stats() const;
+    private:
+        bool cache_binary;
+        LoadStats stats;
 };
+
+/**
+ * @brief Map the whole file privately into memory, the mapping is released with the last copy of the returned pointer
+ *
+ * @param filepath 
+ * @param size set to the size of the file in bytes
+ * @param copy_on_write map the pages writable, writes only go to private copies of the touched pages
+ * @return std::shared_ptr<const char> 
+ */
+std::shared_ptr<const char> map_file(const std::string& filepath, size_t& size, bool copy_on_write=false);
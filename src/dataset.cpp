@@ -0,0 +1,577 @@
+#include "dataset.hpp"
+#include "data_loader.hpp"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <numeric>
+#include <cmath>
+#include <bit>
+#include <limits>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+bool is_blank(const char* begin, const char* end);
+size_t count_columns(const char* begin, const char* end);
+const char* parse_row(const char* begin, const char* end, float* destination, size_t cols, size_t current_row);
+void gather_rows(const float* source, size_t cols, const size_t* indices, size_t count, float* destination);
+uint16_t float_to_half(float value);
+float half_to_float(uint16_t half);
+
+/************************************************
+ *                   Datasets                   *
+ ************************************************/
+
+MatrixDataset::MatrixDataset(Matrix data) : data(std::move(data), StorageType::Float32) {}
+
+MatrixDataset::MatrixDataset(CompactMatrix data) : data(std::move(data)) {}
+
+Matrix MatrixDataset::read(size_t max_rows) {
+    size_t end = std::min(data.rows(), position + max_rows);
+    std::vector<size_t> indices(end - position);
+    std::iota(indices.begin(), indices.end(), position);
+    Matrix rows(indices.size(), data.cols(), 0);
+    data.gather(indices.data(), indices.size(), rows.raw());
+    position = end;
+    return rows;
+}
+
+void MatrixDataset::reset() {
+    position = 0;
+}
+
+CsvDataset::CsvDataset(std::string filepath) : filepath(filepath) {
+    mapping = map_file(filepath, size);
+    cols = count_columns(mapping.get(), mapping.get() + size);
+    if (cols == 0) {
+        throw std::runtime_error("Error while loading data from CSV: " + filepath + " contains no rows");
+    }
+    position = mapping.get();
+}
+
+Matrix CsvDataset::read(size_t max_rows) {
+    const char* text = mapping.get();
+    const char* text_end = text + size;
+    // Find the end of the next max_rows non-empty lines first, so the block can be allocated at its final size
+    const char* block_end = position;
+    size_t rows = 0;
+    while (rows < max_rows && block_end < text_end) {
+        const char* newline = static_cast<const char*>(std::memchr(block_end, '\n', text_end - block_end));
+        const char* line_end = newline == nullptr ? text_end : newline;
+        rows += !is_blank(block_end, line_end);
+        block_end = newline == nullptr ? text_end : newline + 1;
+    }
+
+    Matrix block(rows, cols, 0);
+    for (size_t row = 0; row < rows; row++) {
+        position = parse_row(position, block_end, block.raw() + row * cols, cols, rows_read + row);
+    }
+    rows_read += rows;
+    position = block_end;
+
+    // Drop the parsed pages, so the resident part of the file stays small however large the file is
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t parsed_pages = (position - text) / page * page;
+    if (parsed_pages > 0) {
+        madvise(const_cast<char*>(text), parsed_pages, MADV_DONTNEED);
+    }
+    return block;
+}
+
+void CsvDataset::reset() {
+    position = mapping.get();
+    rows_read = 0;
+}
+
+std::shared_ptr<Dataset> open_dataset(std::string filepath) {
+    std::filesystem::path path(filepath);
+    std::string extension = path.extension().string();
+    DataLoader loader;
+    if (extension == ".csv") {
+        return std::make_shared<CsvDataset>(filepath);
+    } else if (extension == ".bin") {
+        return std::make_shared<MatrixDataset>(loader.load_binary(filepath));
+    } else if (extension == ".npy" || extension == ".idx" || path.filename().string().ends_with("-ubyte")) {
+        // Bytes and 16-bit integers stay narrow until their rows are read
+        return std::make_shared<MatrixDataset>(loader.load_compact(filepath));
+    }
+    throw std::runtime_error("Unknown dataset file type: " + filepath);
+}
+
+/************************************************
+ *                 DataIterator                 *
+ ************************************************/
+
+DataIterator::DataIterator(Dataset& inputs, Dataset& targets, size_t batch_size, size_t prefetch, Transform transform)
+: inputs(inputs), targets(targets), batch_size(batch_size), prefetch(prefetch), transform(transform) {
+    if (batch_size == 0) {
+        throw std::runtime_error("DataIterator batch size must be positive.");
+    }
+    if (prefetch == 0) {
+        throw std::runtime_error("DataIterator must prefetch at least one batch.");
+    }
+}
+
+DataIterator::~DataIterator() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    space.notify_all();
+    if (producer.joinable()) {
+        producer.join();
+    }
+}
+
+bool DataIterator::next(Matrix& inputs, Matrix& targets) {
+    if (!running) {
+        start_pass();
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    if (queue.empty() && !finished) {
+        auto start = std::chrono::steady_clock::now();
+        ready.wait(lock, [this] { return !queue.empty() || finished; });
+        pass_stats.stall_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    if (queue.empty()) {
+        lock.unlock();
+        finish_pass();
+        return false;
+    }
+    inputs = std::move(queue.front().first);
+    targets = std::move(queue.front().second);
+    queue.pop_front();
+    pass_stats.batches++;
+    pass_stats.rows += inputs.rows();
+    lock.unlock();
+    space.notify_one();
+    return true;
+}
+
+IteratorStats DataIterator::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pass_stats;
+}
+
+void DataIterator::start_pass() {
+    inputs.reset();
+    targets.reset();
+    queue.clear();
+    finished = false;
+    error = nullptr;
+    pass_stats = IteratorStats();
+    pass_begin = std::chrono::steady_clock::now();
+    running = true;
+    producer = std::thread(&DataIterator::produce, this);
+}
+
+void DataIterator::finish_pass() {
+    producer.join();
+    running = false;
+    std::lock_guard<std::mutex> lock(mutex);
+    pass_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - pass_begin).count();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void DataIterator::produce() {
+    try {
+        while (true) {
+            auto start = std::chrono::steady_clock::now();
+            Matrix batch_inputs = inputs.read(batch_size);
+            Matrix batch_targets = targets.read(batch_size);
+            if (batch_inputs.rows() != batch_targets.rows()) {
+                throw std::runtime_error("DataIterator inputs and targets have different numbers of rows.");
+            }
+            if (batch_inputs.rows() == 0) {
+                break;
+            }
+            if (transform) {
+                transform(batch_inputs, batch_targets);
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::unique_lock<std::mutex> lock(mutex);
+            pass_stats.produce_seconds += seconds;
+            space.wait(lock, [this] { return queue.size() < prefetch || stop; });
+            if (stop) {
+                return;
+            }
+            queue.emplace_back(std::move(batch_inputs), std::move(batch_targets));
+            lock.unlock();
+            ready.notify_one();
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        error = std::current_exception();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+    }
+    ready.notify_one();
+}
+
+double IteratorStats::rows_per_second() const {
+    return seconds > 0 ? rows / seconds : 0;
+}
+
+double IteratorStats::stall_fraction() const {
+    return seconds > 0 ? stall_seconds / seconds : 0;
+}
+
+/************************************************
+ *                CompactMatrix                 *
+ ************************************************/
+
+/**
+ * @brief Gather rows of narrow values as floats normalized per column
+ * The inner loop has no branches, so it is vectorized for every element type including half precision
+ */
+template <typename T, typename Convert>
+void gather_converted(const T* source, size_t cols, const size_t* indices, size_t count, const float* scale,
+                      const float* offset, float* destination, Convert convert) {
+    const size_t distance = 4;
+    // 64-byte cache lines
+    const size_t line = 64 / sizeof(T);
+    #pragma omp parallel for schedule(static) if (count * cols >= 65536)
+    for (size_t i = 0; i < count; i++) {
+        if (i + distance < count) {
+            const T* ahead = source + indices[i + distance] * cols;
+            for (size_t col = 0; col < cols; col += line) {
+                __builtin_prefetch(ahead + col);
+            }
+        }
+        const T* row = source + indices[i] * cols;
+        float* result = destination + i * cols;
+        #pragma omp simd
+        for (size_t col = 0; col < cols; col++) {
+            result[col] = convert(row[col]) * scale[col] + offset[col];
+        }
+    }
+}
+
+CompactMatrix::CompactMatrix(Matrix A, StorageType type)
+: rows_(A.rows()), cols_(A.cols()), type_(type), scale(A.cols(), 1), offset(A.cols(), 0) {
+    // Moving keeps a bound matrix bound, only a transposed one is copied into row-major order
+    Matrix source = A.is_transposed() ? A.contiguous() : std::move(A);
+    const float* data = source.raw();
+    size_t size = rows_ * cols_;
+    auto store = [&]<typename T>(std::vector<T> stored, float min, float max) {
+        for (size_t i = 0; i < size; i++) {
+            if (!(data[i] >= min && data[i] <= max) || data[i] != std::floor(data[i])) {
+                throw std::runtime_error("CompactMatrix value " + std::to_string(data[i]) + " at index " + std::to_string(i) +
+                                         " is not an integer in [" + std::to_string(static_cast<int>(min)) + ", " +
+                                         std::to_string(static_cast<int>(max)) + "]");
+            }
+            stored[i] = static_cast<T>(data[i]);
+        }
+        values = std::move(stored);
+    };
+    switch (type) {
+        case StorageType::UInt8:
+            store(std::vector<uint8_t>(size), 0, 255);
+            break;
+        case StorageType::Int16:
+            store(std::vector<int16_t>(size), std::numeric_limits<int16_t>::min(), std::numeric_limits<int16_t>::max());
+            break;
+        case StorageType::Float16: {
+            std::vector<uint16_t> halves(size);
+            #pragma omp parallel for
+            for (size_t i = 0; i < size; i++) {
+                halves[i] = float_to_half(data[i]);
+            }
+            values = std::move(halves);
+            break;
+        }
+        case StorageType::Float32:
+            values.emplace<Matrix>(std::move(source));
+            break;
+    }
+}
+
+CompactMatrix& CompactMatrix::operator=(const CompactMatrix& other) {
+    return *this = CompactMatrix(other);
+}
+
+CompactMatrix& CompactMatrix::operator=(CompactMatrix&& other) {
+    if (this == &other) {
+        return *this;
+    }
+    rows_ = other.rows_;
+    cols_ = other.cols_;
+    type_ = other.type_;
+    // Emplacing instead of assigning, a bound matrix would receive the values of the other one in its storage
+    std::visit([&](auto& stored) { values.emplace<std::decay_t<decltype(stored)>>(std::move(stored)); }, other.values);
+    scale = std::move(other.scale);
+    offset = std::move(other.offset);
+    identity = other.identity;
+    return *this;
+}
+
+CompactMatrix::CompactMatrix(size_t rows, size_t cols, std::vector<uint8_t> values)
+: rows_(rows), cols_(cols), type_(StorageType::UInt8), values(std::move(values)), scale(cols, 1), offset(cols, 0) {
+    if (std::get<std::vector<uint8_t>>(this->values).size() != rows * cols) {
+        throw std::runtime_error("CompactMatrix needs rows x cols values.");
+    }
+}
+
+CompactMatrix::CompactMatrix(size_t rows, size_t cols, std::vector<int16_t> values)
+: rows_(rows), cols_(cols), type_(StorageType::Int16), values(std::move(values)), scale(cols, 1), offset(cols, 0) {
+    if (std::get<std::vector<int16_t>>(this->values).size() != rows * cols) {
+        throw std::runtime_error("CompactMatrix needs rows x cols values.");
+    }
+}
+
+size_t CompactMatrix::rows() const {
+    return rows_;
+}
+
+size_t CompactMatrix::cols() const {
+    return cols_;
+}
+
+StorageType CompactMatrix::type() const {
+    return type_;
+}
+
+size_t CompactMatrix::bytes() const {
+    size_t width = type_ == StorageType::UInt8 ? 1 : type_ == StorageType::Float32 ? sizeof(float) : 2;
+    return rows_ * cols_ * width;
+}
+
+void CompactMatrix::normalize(float scale, float offset) {
+    normalize(std::vector<float>(cols_, scale), std::vector<float>(cols_, offset));
+}
+
+void CompactMatrix::normalize(std::vector<float> scale, std::vector<float> offset) {
+    if (scale.size() != cols_ || offset.size() != cols_) {
+        throw std::runtime_error("CompactMatrix needs one scale and one offset per column.");
+    }
+    identity = std::all_of(scale.begin(), scale.end(), [](float value) { return value == 1; }) &&
+               std::all_of(offset.begin(), offset.end(), [](float value) { return value == 0; });
+    this->scale = std::move(scale);
+    this->offset = std::move(offset);
+}
+
+void CompactMatrix::gather(const size_t* indices, size_t count, float* destination) const {
+    for (size_t i = 0; i < count; i++) {
+        if (indices[i] >= rows_) {
+            throw std::out_of_range("CompactMatrix row index out of bounds");
+        }
+    }
+    switch (type_) {
+        case StorageType::UInt8:
+            gather_converted(std::get<std::vector<uint8_t>>(values).data(), cols_, indices, count, scale.data(), offset.data(),
+                             destination, [](uint8_t value) { return static_cast<float>(value); });
+            break;
+        case StorageType::Int16:
+            gather_converted(std::get<std::vector<int16_t>>(values).data(), cols_, indices, count, scale.data(), offset.data(),
+                             destination, [](int16_t value) { return static_cast<float>(value); });
+            break;
+        case StorageType::Float16:
+            gather_converted(std::get<std::vector<uint16_t>>(values).data(), cols_, indices, count, scale.data(), offset.data(),
+                             destination, [](uint16_t value) { return half_to_float(value); });
+            break;
+        case StorageType::Float32:
+            if (identity) {
+                gather_rows(std::get<Matrix>(values).raw(), cols_, indices, count, destination);
+            } else {
+                gather_converted(std::get<Matrix>(values).raw(), cols_, indices, count, scale.data(), offset.data(),
+                                 destination, [](float value) { return value; });
+            }
+            break;
+    }
+}
+
+Matrix CompactMatrix::matrix() const {
+    std::vector<size_t> indices(rows_);
+    std::iota(indices.begin(), indices.end(), 0);
+    Matrix result(rows_, cols_, 0);
+    gather(indices.data(), rows_, result.raw());
+    return result;
+}
+
+/**
+ * @brief Round to the nearest half precision value, ties to even, overflow gives infinity
+ */
+uint16_t float_to_half(float value) {
+    uint32_t bits = std::bit_cast<uint32_t>(value);
+    uint32_t sign = bits & 0x80000000u;
+    bits ^= sign;
+    uint32_t half;
+    if (bits >= 0x47800000u) {
+        // 65536 and above, infinity or NaN
+        half = bits > 0x7f800000u ? 0x7e00 : 0x7c00;
+    } else if (bits < 0x38800000u) {
+        // Below 2^-14 the result is subnormal, adding 0.5 lets the float addition do the rounding
+        half = std::bit_cast<uint32_t>(std::bit_cast<float>(bits) + 0.5f) - 0x3f000000u;
+    } else {
+        // Rebias the exponent from 127 to 15 and round the 13 dropped mantissa bits
+        uint32_t odd = (bits >> 13) & 1;
+        bits += 0xc8000fffu + odd;
+        half = bits >> 13;
+    }
+    return static_cast<uint16_t>(half | (sign >> 16));
+}
+
+/**
+ * @brief Exact conversion of a half precision value, all three cases are computed and the right one selected
+ */
+float half_to_float(uint16_t half) {
+    uint32_t magnitude = static_cast<uint32_t>(half & 0x7fff) << 13;
+    uint32_t exponent = half & 0x7c00;
+    uint32_t normal = magnitude + (112u << 23);
+    // 2^-14 * (1 + m / 1024) - 2^-14 is the subnormal 2^-14 * m / 1024
+    uint32_t subnormal = std::bit_cast<uint32_t>(std::bit_cast<float>(magnitude + (113u << 23)) - std::bit_cast<float>(113u << 23));
+    uint32_t special = magnitude | 0x7f800000u;
+    // Masks instead of conditionals keep the loops that call this vectorizable
+    uint32_t is_special = 0u - (exponent == 0x7c00);
+    uint32_t is_subnormal = 0u - (exponent == 0);
+    uint32_t bits = (special & is_special) | (subnormal & is_subnormal) | (normal & ~(is_special | is_subnormal));
+    return std::bit_cast<float>(bits | (static_cast<uint32_t>(half & 0x8000) << 16));
+}
+
+/************************************************
+ *                 BatchSampler                 *
+ ************************************************/
+
+BatchSampler::BatchSampler(Matrix inputs, Matrix targets, size_t batch_size, bool drop_last, unsigned seed)
+: BatchSampler(CompactMatrix(std::move(inputs), StorageType::Float32), std::move(targets), batch_size, drop_last, seed) {}
+
+BatchSampler::BatchSampler(CompactMatrix inputs, Matrix targets, size_t batch_size, bool drop_last, unsigned seed)
+: data_inputs(std::move(inputs)),
+  data_targets(targets.is_transposed() ? targets.contiguous() : std::move(targets)),
+  batch_size(batch_size), drop_last(drop_last), gen(seed), samples_per_epoch(data_inputs.rows()) {
+    if (batch_size == 0) {
+        throw std::runtime_error("BatchSampler batch size must be positive.");
+    }
+    if (data_inputs.rows() != data_targets.rows()) {
+        throw std::runtime_error("BatchSampler inputs and targets have different numbers of rows.");
+    }
+}
+
+void BatchSampler::stratify(const Matrix& labels) {
+    if (labels.rows() != data_inputs.rows() || labels.cols() != 1) {
+        throw std::runtime_error("BatchSampler needs a column with one label per row to stratify.");
+    }
+    class_rows.clear();
+    for (size_t row = 0; row < labels.rows(); row++) {
+        // A single column has the same storage order whether transposed or not
+        float label = labels.raw()[row];
+        if (label < 0 || label != std::floor(label)) {
+            throw std::runtime_error("BatchSampler labels must be non-negative integers.");
+        }
+        if (label >= class_rows.size()) {
+            class_rows.resize(static_cast<size_t>(label) + 1);
+        }
+        class_rows[label].push_back(row);
+    }
+    mode = Mode::Stratified;
+    samples_per_epoch = data_inputs.rows();
+    in_epoch = false;
+}
+
+void BatchSampler::weight(std::vector<float> weights, size_t samples_per_epoch) {
+    if (weights.size() != data_inputs.rows()) {
+        throw std::runtime_error("BatchSampler needs one weight per row.");
+    }
+    if (std::any_of(weights.begin(), weights.end(), [](float weight) { return !(weight >= 0); }) ||
+        std::accumulate(weights.begin(), weights.end(), 0.0) <= 0) {
+        throw std::runtime_error("BatchSampler weights must be non-negative and not all zero.");
+    }
+    distribution = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+    mode = Mode::Weighted;
+    this->samples_per_epoch = samples_per_epoch == 0 ? data_inputs.rows() : samples_per_epoch;
+    in_epoch = false;
+}
+
+bool BatchSampler::next() {
+    if (!in_epoch) {
+        start_epoch();
+    }
+    size_t count = std::min(batch_size, order.size() - position);
+    if (count == 0 || (drop_last && count < batch_size)) {
+        in_epoch = false;
+        return false;
+    }
+    slot = 1 - slot;
+    Buffers& buffers = (count == batch_size ? full : tail)[slot];
+    if (buffers.inputs.rows() != count) {
+        buffers.inputs = Matrix(count, data_inputs.cols(), 0);
+        buffers.targets = Matrix(count, data_targets.cols(), 0);
+    }
+    data_inputs.gather(order.data() + position, count, buffers.inputs.raw());
+    gather_rows(data_targets.raw(), data_targets.cols(), order.data() + position, count, buffers.targets.raw());
+    position += count;
+    current = &buffers;
+    return true;
+}
+
+const Matrix& BatchSampler::inputs() const {
+    if (current == nullptr) {
+        throw std::runtime_error("BatchSampler has no batch before the first call to next().");
+    }
+    return current->inputs;
+}
+
+const Matrix& BatchSampler::targets() const {
+    if (current == nullptr) {
+        throw std::runtime_error("BatchSampler has no batch before the first call to next().");
+    }
+    return current->targets;
+}
+
+size_t BatchSampler::num_batches() const {
+    return drop_last ? samples_per_epoch / batch_size : (samples_per_epoch + batch_size - 1) / batch_size;
+}
+
+void BatchSampler::start_epoch() {
+    order.resize(samples_per_epoch);
+    if (mode == Mode::Shuffle) {
+        std::iota(order.begin(), order.end(), 0);
+        std::shuffle(order.begin(), order.end(), gen);
+    } else if (mode == Mode::Weighted) {
+        for (size_t& row : order) {
+            row = distribution(gen);
+        }
+    } else {
+        // The j-th of the n rows of a class in random order is placed at (j + u) / n with u uniform in [0, 1),
+        // so every class is spread evenly over the epoch and each batch gets its share of every class
+        std::uniform_real_distribution<double> jitter(0, 1);
+        std::vector<std::pair<double, size_t>> keys;
+        keys.reserve(samples_per_epoch);
+        for (std::vector<size_t>& rows : class_rows) {
+            std::shuffle(rows.begin(), rows.end(), gen);
+            for (size_t j = 0; j < rows.size(); j++) {
+                keys.emplace_back((j + jitter(gen)) / rows.size(), rows[j]);
+            }
+        }
+        std::sort(keys.begin(), keys.end());
+        for (size_t i = 0; i < keys.size(); i++) {
+            order[i] = keys[i].second;
+        }
+    }
+    position = 0;
+    in_epoch = true;
+}
+
+/**
+ * @brief Copy the rows at the indices into the rows of the destination
+ * The rows a few positions ahead are prefetched, since the random rows defeat the hardware prefetcher
+ */
+void gather_rows(const float* source, size_t cols, const size_t* indices, size_t count, float* destination) {
+    const size_t distance = 4;
+    #pragma omp parallel for schedule(static) if (count * cols >= 65536)
+    for (size_t i = 0; i < count; i++) {
+        if (i + distance < count) {
+            const float* ahead = source + indices[i + distance] * cols;
+            for (size_t col = 0; col < cols; col += 16) {
+                __builtin_prefetch(ahead + col);
+            }
+        }
+        std::memcpy(destination + i * cols, source + indices[i] * cols, cols * sizeof(float));
+    }
+}
@@ -0,0 +1,332 @@
+#pragma once
+#include "matrix.hpp"
+
+#include <memory>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <exception>
+#include <utility>
+#include <chrono>
+#include <array>
+#include <vector>
+#include <random>
+#include <variant>
+#include <cstdint>
+
+
+/**
+ * @brief A source of rows that is read front to back in blocks, e.g. a file that does not fit into memory
+ */
+class Dataset {
+    public:
+        virtual ~Dataset() = default;
+
+        /**
+         * @brief Return the next block of at most max_rows rows, an empty matrix once all rows have been read
+         *
+         * @param max_rows 
+         * @return Matrix 
+         */
+        virtual Matrix read(size_t max_rows) = 0;
+
+        /**
+         * @brief Start reading from the first row again
+         */
+        virtual void reset() = 0;
+};
+
+/**
+ * @brief Element types that a CompactMatrix stores, Float16 is IEEE half precision
+ */
+enum class StorageType : uint8_t {
+    UInt8,
+    Int16,
+    Float16,
+    Float32,
+};
+
+/**
+ * @brief A read-only matrix of rows stored in a narrow element type, e.g. 8-bit pixels at a quarter of the memory of floats
+ *
+ * Rows are only converted to float when they are gathered, and the conversion is fused with a per-feature
+ * normalization value * scale + offset, so neither a float copy nor a normalized copy of the data is ever kept.
+ */
+class CompactMatrix {
+    public:
+        CompactMatrix() = default;
+
+        /**
+         * @brief Store the values of the matrix as the given type
+         * UInt8 and Int16 need integer values in their range, Float16 rounds to the nearest half.
+         * Float32 keeps the matrix itself, so a matrix bound to e.g. a memory-mapped file is not copied.
+         *
+         * @param A 
+         * @param type 
+         */
+        CompactMatrix(Matrix A, StorageType type);
+
+        /**
+         * @brief Take row-major values that are already narrow, e.g. read from a file, as UInt8 or Int16
+         *
+         * @param rows 
+         * @param cols 
+         * @param values rows x cols values
+         */
+        CompactMatrix(size_t rows, size_t cols, std::vector<uint8_t> values);
+        CompactMatrix(size_t rows, size_t cols, std::vector<int16_t> values);
+        CompactMatrix(const CompactMatrix& other) = default;
+        CompactMatrix(CompactMatrix&& other) = default;
+        CompactMatrix& operator=(const CompactMatrix& other);
+        CompactMatrix& operator=(CompactMatrix&& other);
+
+        size_t rows() const;
+        size_t cols() const;
+        StorageType type() const;
+
+        /**
+         * @brief Return the size of the stored values in bytes
+         *
+         * @return size_t 
+         */
+        size_t bytes() const;
+
+        /**
+         * @brief Convert every value to value * scale + offset when gathering
+         *
+         * @param scale 
+         * @param offset 
+         */
+        void normalize(float scale, float offset=0);
+
+        /**
+         * @brief Convert value of column c to value * scale[c] + offset[c] when gathering
+         *
+         * @param scale one factor per column
+         * @param offset one offset per column
+         */
+        void normalize(std::vector<float> scale, std::vector<float> offset);
+
+        /**
+         * @brief Convert and normalize the rows at the indices into consecutive rows of the destination
+         *
+         * @param indices 
+         * @param count 
+         * @param destination count x cols floats
+         */
+        void gather(const size_t* indices, size_t count, float* destination) const;
+
+        /**
+         * @brief Return all rows converted and normalized
+         *
+         * @return Matrix 
+         */
+        Matrix matrix() const;
+    private:
+        size_t rows_ = 0;
+        size_t cols_ = 0;
+        StorageType type_ = StorageType::Float32;
+        // Half precision values are kept as their bit patterns, floats as the row-major matrix they came from
+        std::variant<std::vector<uint8_t>, std::vector<int16_t>, std::vector<uint16_t>, Matrix> values;
+        std::vector<float> scale;
+        std::vector<float> offset;
+        bool identity = true;
+};
+
+/**
+ * @brief A dataset over the rows of a matrix
+ * With a matrix mapped from a binary tensor or npy file the rows are paged in from disk as they are read.
+ * The rows of a CompactMatrix are converted to floats as they are read.
+ */
+class MatrixDataset : public Dataset {
+    public:
+        MatrixDataset(Matrix data);
+        MatrixDataset(CompactMatrix data);
+        Matrix read(size_t max_rows) override;
+        void reset() override;
+    private:
+        CompactMatrix data;
+        size_t position = 0;
+};
+
+/**
+ * @brief A dataset that parses a mapped CSV file block by block while it is read, so the file is never loaded as a whole
+ */
+class CsvDataset : public Dataset {
+    public:
+        CsvDataset(std::string filepath);
+        Matrix read(size_t max_rows) override;
+        void reset() override;
+    private:
+        std::string filepath;
+        std::shared_ptr<const char> mapping;
+        size_t size = 0;
+        size_t cols = 0;
+        size_t rows_read = 0;
+        const char* position = nullptr;
+};
+
+/**
+ * @brief Open a file as a dataset by its extension: .csv is parsed while reading, .bin and .npy are mapped,
+ * IDX files (.idx or -ubyte) are converted to floats in memory when opened
+ *
+ * @param filepath 
+ * @return std::shared_ptr<Dataset> 
+ */
+std::shared_ptr<Dataset> open_dataset(std::string filepath);
+
+/**
+ * @brief Wall time of one pass of a DataIterator and how long the consumer waited for batches
+ */
+struct IteratorStats {
+    size_t batches = 0;
+    size_t rows = 0;
+    // Time the background thread spent reading and transforming batches
+    double produce_seconds = 0;
+    // Time next() waited for a batch that was not ready yet
+    double stall_seconds = 0;
+    double seconds = 0;
+
+    double rows_per_second() const;
+    double stall_fraction() const;
+};
+
+/**
+ * @brief Iterate over batches of matching input and target rows of two datasets, read on a background thread
+ *
+ * The background thread reads, and optionally transforms, up to prefetch batches ahead into a bounded queue,
+ * e.g. 2 for double and 3 for triple buffering, so reading and parsing overlap the training on earlier batches.
+ * The transform runs on the background thread as well, e.g. to normalize inputs or one-hot encode labels.
+ * The last batch of a pass holds the remaining rows.
+ */
+class DataIterator {
+    public:
+        using Transform = std::function<void(Matrix& inputs, Matrix& targets)>;
+
+        DataIterator(Dataset& inputs, Dataset& targets, size_t batch_size, size_t prefetch=2, Transform transform=nullptr);
+        ~DataIterator();
+        DataIterator(const DataIterator&) = delete;
+        DataIterator& operator=(const DataIterator&) = delete;
+
+        /**
+         * @brief Return the next batch of the current pass, false at the end of the pass
+         * The first call and the first call after the end of a pass start a new pass from the first rows
+         *
+         * @param inputs 
+         * @param targets 
+         * @return bool 
+         */
+        bool next(Matrix& inputs, Matrix& targets);
+
+        /**
+         * @brief Return the statistics of the current or last pass
+         *
+         * @return IteratorStats 
+         */
+        IteratorStats stats();
+    private:
+        Dataset& inputs;
+        Dataset& targets;
+        size_t batch_size;
+        size_t prefetch;
+        Transform transform;
+
+        std::thread producer;
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::condition_variable space;
+        std::deque<std::pair<Matrix, Matrix>> queue;
+        bool running = false;
+        bool finished = false;
+        bool stop = false;
+        std::exception_ptr error;
+        IteratorStats pass_stats;
+        std::chrono::steady_clock::time_point pass_begin;
+
+        void start_pass();
+        void finish_pass();
+        void produce();
+};
+
+/**
+ * @brief Draw mini-batches of rows from in-memory inputs and targets in a new random order every epoch
+ *
+ * Every batch is gathered from the sampled rows into one of two buffers that are allocated once and used
+ * in turn, so a batch stays valid while the next one is gathered. The rows are copied in parallel while the
+ * rows a few positions ahead are prefetched. The last batch of an epoch holds the remaining rows unless
+ * drop_last is set. Besides plain shuffling, batches can be stratified by class or rows drawn by weight.
+ * Inputs given as a CompactMatrix are converted and normalized while they are gathered.
+ */
+class BatchSampler {
+    public:
+        BatchSampler(Matrix inputs, Matrix targets, size_t batch_size, bool drop_last=false, unsigned seed=std::random_device{}());
+        BatchSampler(CompactMatrix inputs, Matrix targets, size_t batch_size, bool drop_last=false, unsigned seed=std::random_device{}());
+
+        /**
+         * @brief Order every epoch so that each batch holds the classes in about the proportions of the whole dataset
+         *
+         * @param labels column of class indices, one per row
+         */
+        void stratify(const Matrix& labels);
+
+        /**
+         * @brief Draw the rows of every epoch with replacement, each with probability proportional to its weight
+         *
+         * @param weights one non-negative weight per row
+         * @param samples_per_epoch number of rows drawn per epoch, the number of rows if 0
+         */
+        void weight(std::vector<float> weights, size_t samples_per_epoch=0);
+
+        /**
+         * @brief Gather the next batch, false at the end of the epoch
+         * The first call and the first call after the end of an epoch start a new epoch in a new order
+         *
+         * @return bool 
+         */
+        bool next();
+
+        /**
+         * @brief Return the inputs of the current batch, valid until the call to next() after the following one
+         *
+         * @return const Matrix& 
+         */
+        const Matrix& inputs() const;
+        const Matrix& targets() const;
+
+        /**
+         * @brief Return the number of batches per epoch
+         *
+         * @return size_t 
+         */
+        size_t num_batches() const;
+    private:
+        struct Buffers {
+            Matrix inputs;
+            Matrix targets;
+        };
+        enum class Mode { Shuffle, Stratified, Weighted };
+
+        CompactMatrix data_inputs;
+        Matrix data_targets;
+        size_t batch_size;
+        bool drop_last;
+        std::mt19937 gen;
+        Mode mode = Mode::Shuffle;
+        std::vector<std::vector<size_t>> class_rows;
+        std::discrete_distribution<size_t> distribution;
+        size_t samples_per_epoch;
+
+        std::vector<size_t> order;
+        size_t position = 0;
+        bool in_epoch = false;
+        // Full and tail batches have their own buffers, so neither is reallocated between epochs
+        std::array<Buffers, 2> full;
+        std::array<Buffers, 2> tail;
+        Buffers* current = nullptr;
+        size_t slot = 0;
+
+        void start_epoch();
+};
@@ -0,0 +1,497 @@
+#include "distributed.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+#include <omp.h>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+void send_all(int socket, const void* buffer, size_t size);
+void receive_all(int socket, void* buffer, size_t size);
+std::runtime_error socket_error(const std::string& message);
+
+/**************************************
+             Process group
+ **************************************/
+
+ProcessGroup::ProcessGroup(size_t rank, size_t world_size, std::string address, size_t chunk_size)
+: rank_(rank), world_size_(world_size), chunk_size(chunk_size) {
+    if (world_size == 0 || rank >= world_size) {
+        throw std::runtime_error("Invalid rank " + std::to_string(rank) + " for world size " + std::to_string(world_size));
+    }
+    if (chunk_size == 0) {
+        throw std::runtime_error("ProcessGroup chunk size must be positive.");
+    }
+    if (world_size > 1) {
+        connect_ring(address);
+    }
+}
+
+ProcessGroup::~ProcessGroup() {
+    for (int socket : {listen_socket, next_socket, previous_socket}) {
+        if (socket >= 0) {
+            close(socket);
+        }
+    }
+    if (!socket_path.empty()) {
+        unlink(socket_path.c_str());
+    }
+}
+
+ProcessGroup ProcessGroup::from_environment() {
+    const char* rank = std::getenv("RANK");
+    const char* world_size = std::getenv("WORLD_SIZE");
+    const char* address = std::getenv("MASTER_ADDR");
+    if (rank == nullptr || world_size == nullptr || address == nullptr) {
+        throw std::runtime_error("RANK, WORLD_SIZE and MASTER_ADDR must be set to create a process group.");
+    }
+    return ProcessGroup(std::stoul(rank), std::stoul(world_size), address);
+}
+
+size_t ProcessGroup::rank() const {
+    return rank_;
+}
+
+size_t ProcessGroup::world_size() const {
+    return world_size_;
+}
+
+/**
+ * @brief Listen for the previous rank, connect to the next rank and accept the previous one
+ * Connecting only needs the peer to listen, so every rank can connect before any rank accepts
+ */
+void ProcessGroup::connect_ring(const std::string& address) {
+    size_t next = (rank_ + 1) % world_size_;
+    const auto timeout = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+
+    if (address.rfind("unix:", 0) == 0) {
+        std::string directory = address.substr(5);
+        auto path_of = [&](size_t rank) {
+            return directory + "/rank_" + std::to_string(rank) + ".sock";
+        };
+        sockaddr_un local{};
+        local.sun_family = AF_UNIX;
+        socket_path = path_of(rank_);
+        if (socket_path.size() >= sizeof(local.sun_path)) {
+            throw std::runtime_error("Unix socket path is too long: " + socket_path);
+        }
+        std::strncpy(local.sun_path, socket_path.c_str(), sizeof(local.sun_path) - 1);
+        unlink(socket_path.c_str());
+        listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_socket < 0 || bind(listen_socket, reinterpret_cast<sockaddr*>(&local), sizeof(local)) < 0 || listen(listen_socket, 1) < 0) {
+            throw socket_error("Failed to listen on " + socket_path);
+        }
+
+        sockaddr_un remote{};
+        remote.sun_family = AF_UNIX;
+        std::strncpy(remote.sun_path, path_of(next).c_str(), sizeof(remote.sun_path) - 1);
+        while (true) {
+            next_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (connect(next_socket, reinterpret_cast<sockaddr*>(&remote), sizeof(remote)) == 0) {
+                break;
+            }
+            close(next_socket);
+            next_socket = -1;
+            if (std::chrono::steady_clock::now() > timeout) {
+                throw socket_error("Timed out connecting to rank " + std::to_string(next));
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    } else if (address.rfind("tcp:", 0) == 0) {
+        size_t separator = address.rfind(':');
+        std::string host = address.substr(4, separator - 4);
+        int base_port = std::stoi(address.substr(separator + 1));
+
+        listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+        int enable = 1;
+        setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        sockaddr_in local{};
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_ANY);
+        local.sin_port = htons(base_port + rank_);
+        if (listen_socket < 0 || bind(listen_socket, reinterpret_cast<sockaddr*>(&local), sizeof(local)) < 0 || listen(listen_socket, 1) < 0) {
+            throw socket_error("Failed to listen on port " + std::to_string(base_port + rank_));
+        }
+
+        addrinfo hints{}, *resolved = nullptr;
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), std::to_string(base_port + next).c_str(), &hints, &resolved) != 0) {
+            throw std::runtime_error("Failed to resolve host " + host);
+        }
+        while (true) {
+            next_socket = socket(AF_INET, SOCK_STREAM, 0);
+            if (connect(next_socket, resolved->ai_addr, resolved->ai_addrlen) == 0) {
+                break;
+            }
+            close(next_socket);
+            next_socket = -1;
+            if (std::chrono::steady_clock::now() > timeout) {
+                freeaddrinfo(resolved);
+                throw socket_error("Timed out connecting to rank " + std::to_string(next));
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        freeaddrinfo(resolved);
+        setsockopt(next_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    } else {
+        throw std::runtime_error("Unsupported process group address: " + address);
+    }
+
+    previous_socket = accept(listen_socket, nullptr, nullptr);
+    if (previous_socket < 0) {
+        throw socket_error("Failed to accept the previous rank");
+    }
+    if (address.rfind("tcp:", 0) == 0) {
+        int enable = 1;
+        setsockopt(previous_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    }
+
+    // Make sure the connection from the predecessor really is the predecessor
+    uint64_t identity = rank_, peer = 0;
+    send_all(next_socket, &identity, sizeof(identity));
+    receive_all(previous_socket, &peer, sizeof(peer));
+    if (peer != (rank_ + world_size_ - 1) % world_size_) {
+        throw std::runtime_error("Rank " + std::to_string(rank_) + " was connected to rank " + std::to_string(peer) + " instead of its predecessor");
+    }
+}
+
+void ProcessGroup::all_reduce(float* data, size_t size) {
+    if (world_size_ == 1 || size == 0) {
+        return;
+    }
+    const size_t W = world_size_;
+    auto segment_begin = [&](size_t segment) { return segment * size / W; };
+    auto chunks_in = [&](size_t segment) {
+        return (segment_begin(segment + 1) - segment_begin(segment) + chunk_size - 1) / chunk_size;
+    };
+    // Step s sends segment (rank - s) and receives segment (rank - s - 1), for reduce-scatter and all-gather alike,
+    // so the segment sent in step s + 1 is exactly the one received in step s
+    const size_t steps = 2 * (W - 1);
+    auto send_segment = [&](size_t step) { return (rank_ + 2 * W - step) % W; };
+    auto receive_segment = [&](size_t step) { return (rank_ + 2 * W - step - 1) % W; };
+
+    // Number of chunks received (and reduced) so far, in step order
+    std::vector<size_t> step_offset(steps + 1, 0);
+    for (size_t step = 0; step < steps; step++) {
+        step_offset[step + 1] = step_offset[step] + chunks_in(receive_segment(step));
+    }
+    size_t received = 0;
+    std::mutex mutex;
+    std::condition_variable progress;
+
+    std::exception_ptr send_error;
+    std::thread sender([&]() {
+        try {
+            for (size_t step = 0; step < steps; step++) {
+                size_t segment = send_segment(step);
+                size_t begin = segment_begin(segment), end = segment_begin(segment + 1);
+                for (size_t chunk = 0; begin + chunk * chunk_size < end; chunk++) {
+                    if (step > 0) {
+                        // Wait until this chunk of the segment has been received and reduced in the previous step
+                        std::unique_lock<std::mutex> lock(mutex);
+                        progress.wait(lock, [&]() { return received > step_offset[step - 1] + chunk; });
+                    }
+                    size_t chunk_begin = begin + chunk * chunk_size;
+                    size_t chunk_end = std::min(end, chunk_begin + chunk_size);
+                    send_all(next_socket, data + chunk_begin, (chunk_end - chunk_begin) * sizeof(float));
+                }
+            }
+        } catch (...) {
+            send_error = std::current_exception();
+        }
+    });
+
+    std::vector<float> buffer(chunk_size);
+    std::exception_ptr receive_error;
+    try {
+        for (size_t step = 0; step < steps; step++) {
+            size_t segment = receive_segment(step);
+            size_t begin = segment_begin(segment), end = segment_begin(segment + 1);
+            bool reduce = step < W - 1;
+            for (size_t chunk_begin = begin; chunk_begin < end; chunk_begin += chunk_size) {
+                size_t count = std::min(end, chunk_begin + chunk_size) - chunk_begin;
+                if (reduce) {
+                    receive_all(previous_socket, buffer.data(), count * sizeof(float));
+                    #pragma omp simd
+                    for (size_t i = 0; i < count; i++) {
+                        data[chunk_begin + i] += buffer[i];
+                    }
+                } else {
+                    receive_all(previous_socket, data + chunk_begin, count * sizeof(float));
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    received++;
+                }
+                progress.notify_one();
+            }
+        }
+    } catch (...) {
+        receive_error = std::current_exception();
+        // Unblock the sender, the group is unusable after a failed collective anyway
+        std::lock_guard<std::mutex> lock(mutex);
+        received = step_offset[steps];
+        progress.notify_one();
+    }
+    sender.join();
+    if (receive_error) {
+        std::rethrow_exception(receive_error);
+    }
+    if (send_error) {
+        std::rethrow_exception(send_error);
+    }
+}
+
+void ProcessGroup::broadcast(float* data, size_t size, size_t root) {
+    if (world_size_ == 1 || size == 0) {
+        return;
+    }
+    if (root >= world_size_) {
+        throw std::runtime_error("Broadcast root " + std::to_string(root) + " is not a rank of the group");
+    }
+    bool forward = (rank_ + 1) % world_size_ != root;
+    for (size_t begin = 0; begin < size; begin += chunk_size) {
+        size_t count = std::min(size, begin + chunk_size) - begin;
+        if (rank_ != root) {
+            receive_all(previous_socket, data + begin, count * sizeof(float));
+        }
+        if (forward) {
+            send_all(next_socket, data + begin, count * sizeof(float));
+        }
+    }
+}
+
+void ProcessGroup::barrier() {
+    float token = 0;
+    all_reduce(&token, 1);
+}
+
+void send_all(int socket, const void* buffer, size_t size) {
+    const char* bytes = static_cast<const char*>(buffer);
+    while (size > 0) {
+        ssize_t sent = send(socket, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw socket_error("Failed to send to the next rank");
+        }
+        bytes += sent;
+        size -= sent;
+    }
+}
+
+void receive_all(int socket, void* buffer, size_t size) {
+    char* bytes = static_cast<char*>(buffer);
+    while (size > 0) {
+        ssize_t received = recv(socket, bytes, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            throw socket_error("Failed to receive from the previous rank");
+        }
+        bytes += received;
+        size -= received;
+    }
+}
+
+std::runtime_error socket_error(const std::string& message) {
+    return std::runtime_error(message + ": " + std::strerror(errno));
+}
+
+/**************************************
+          Distributed trainer
+ **************************************/
+
+DistributedTrainer::DistributedTrainer(Model& model, Optimizer& optimizer, Loss& loss, ProcessGroup& group, size_t bucket_size)
+: Trainer(model, optimizer, loss), group(group) {
+    // Start every replica from the weights of rank 0
+    ParameterArena& arena = optimizer.arena();
+    group.broadcast(arena.data(), arena.size(), 0);
+
+    // Buckets need the parameters of every layer to be one range of the arena, in the order of the layers
+    sequential = dynamic_cast<Sequential*>(&model);
+    std::vector<size_t> first_parameter;
+    if (sequential != nullptr) {
+        const std::vector<std::shared_ptr<Parameter>>& optimized = arena.parameters();
+        size_t count = 0;
+        for (size_t i = 0; i < sequential->size() && sequential != nullptr; i++) {
+            first_parameter.push_back(count);
+            for (auto& parameter : sequential->layer(i).parameters()) {
+                if (count >= optimized.size() || optimized[count] != parameter) {
+                    sequential = nullptr;
+                    break;
+                }
+                count++;
+            }
+        }
+        first_parameter.push_back(count);
+        if (count != optimized.size()) {
+            sequential = nullptr;
+        }
+    }
+    if (sequential == nullptr) {
+        return;
+    }
+
+    // The backward pass visits the layers from the last one, so the buckets are collected from the end
+    size_t end_layer = sequential->size();
+    for (size_t layer = sequential->size(); layer > 0; layer--) {
+        size_t begin = arena.offset(first_parameter[layer - 1]);
+        size_t end = arena.offset(first_parameter[end_layer]);
+        if (end - begin >= bucket_size || layer == 1) {
+            if (end > begin) {
+                bucket_begin.push_back(begin);
+                bucket_end.push_back(end);
+                bucket_first_layer.push_back(layer - 1);
+            }
+            end_layer = layer - 1;
+        }
+    }
+    communicator = std::thread(&DistributedTrainer::run_communicator, this);
+    sequential->set_backward_hook([this](size_t layer) {
+        // All ranks run the same layers, so the buckets are reduced in the same order everywhere
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t bucket = 0; bucket < bucket_first_layer.size(); bucket++) {
+            if (bucket_first_layer[bucket] == layer) {
+                pending.push_back(bucket);
+                work_ready.notify_one();
+            }
+        }
+    });
+}
+
+DistributedTrainer::~DistributedTrainer() {
+    if (communicator.joinable()) {
+        sequential->set_backward_hook(nullptr);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        work_ready.notify_one();
+        communicator.join();
+    }
+}
+
+float DistributedTrainer::train_step(Matrix inputs, Matrix targets) {
+    optimizer.zero_grad();
+    Matrix output = model.forward(inputs);
+    float error = loss.compute_error(targets, output);
+    model.backward(loss.compute_error_derivative(targets, output));
+
+    ParameterArena& arena = optimizer.arena();
+    if (communicator.joinable()) {
+        // The buckets were handed to the communication thread during the backward pass
+        std::unique_lock<std::mutex> lock(mutex);
+        work_done.wait(lock, [this] { return pending.empty() && !reducing; });
+        if (communicator_error) {
+            std::exception_ptr exception = communicator_error;
+            communicator_error = nullptr;
+            std::rethrow_exception(exception);
+        }
+    } else {
+        // All gradients are one contiguous region of the arena
+        group.all_reduce(arena.grad(), arena.size());
+    }
+    for (auto& parameter : arena.parameters()) {
+        // The other ranks may have touched any row
+        if (parameter->row_sparse) {
+            parameter->touched_rows.resize(parameter->grad.rows());
+            std::iota(parameter->touched_rows.begin(), parameter->touched_rows.end(), 0);
+        }
+    }
+    optimizer.step();
+
+    // Average the loss over the global batch
+    float totals[2] = {error * inputs.rows(), static_cast<float>(inputs.rows())};
+    group.all_reduce(totals, 2);
+    return totals[0] / totals[1];
+}
+
+void DistributedTrainer::run_communicator() {
+    // The additions of the reduction run next to the parallel backward pass, a single thread keeps up with the sockets
+    omp_set_num_threads(1);
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        work_ready.wait(lock, [this] { return stop || !pending.empty(); });
+        if (pending.empty()) {
+            return;
+        }
+        size_t bucket = pending.front();
+        pending.pop_front();
+        reducing = true;
+        // After a failed reduction the ring is out of step, the remaining buckets are skipped
+        bool failed = communicator_error != nullptr;
+        lock.unlock();
+        try {
+            if (!failed) {
+                group.all_reduce(optimizer.arena().grad() + bucket_begin[bucket], bucket_end[bucket] - bucket_begin[bucket]);
+            }
+        } catch (...) {
+            lock.lock();
+            communicator_error = std::current_exception();
+            lock.unlock();
+        }
+        lock.lock();
+        reducing = false;
+        if (pending.empty()) {
+            work_done.notify_all();
+        }
+    }
+}
+
+/**************************************
+            Local launcher
+ **************************************/
+
+size_t run_local_processes(size_t world_size, std::string address, std::function<void(ProcessGroup&)> fn) {
+    std::vector<pid_t> children;
+    for (size_t rank = 0; rank < world_size; rank++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            throw socket_error("Failed to fork rank " + std::to_string(rank));
+        }
+        if (pid == 0) {
+            int status = 0;
+            // The OpenMP thread pool of the parent does not survive the fork, the processes are the parallelism here
+            omp_set_num_threads(1);
+            try {
+                ProcessGroup group(rank, world_size, address);
+                fn(group);
+            } catch (const std::exception& error) {
+                std::cerr << "Rank " << rank << " failed: " << error.what() << std::endl;
+                status = 1;
+            }
+            // Skip the exit handlers of the parent process, e.g. a test framework
+            _exit(status);
+        }
+        children.push_back(pid);
+    }
+
+    size_t failed = 0;
+    for (pid_t child : children) {
+        int status = 0;
+        waitpid(child, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed++;
+        }
+    }
+    return failed;
+}
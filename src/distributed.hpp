@@ -0,0 +1,140 @@
+#pragma once
+#include "matrix.hpp"
+#include "model.hpp"
+#include "optimizers.hpp"
+#include "loss.hpp"
+#include "trainer.hpp"
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+
+
+/**
+ * @brief A group of processes connected in a ring, used for multi-process data-parallel training
+ *
+ * Rank r listens for its predecessor and connects to its successor (r + 1) % world_size.
+ * The address selects the transport:
+ *  - "unix:<directory>" uses Unix domain sockets <directory>/rank_<r>.sock
+ *  - "tcp:<host>:<port>" uses TCP, rank r listens on port + r of its own host
+ * All ranks must use the same address, which also makes it easy to run N processes on one host.
+ */
+class ProcessGroup {
+    public:
+        ProcessGroup(size_t rank, size_t world_size, std::string address, size_t chunk_size=16384);
+        ~ProcessGroup();
+        ProcessGroup(const ProcessGroup&) = delete;
+        ProcessGroup& operator=(const ProcessGroup&) = delete;
+
+        /**
+         * @brief Create the process group from the RANK, WORLD_SIZE and MASTER_ADDR environment variables
+         *
+         * @return ProcessGroup
+         */
+        static ProcessGroup from_environment();
+
+        size_t rank() const;
+        size_t world_size() const;
+
+        /**
+         * @brief Sum the buffer over all ranks in place with a chunked ring all-reduce
+         *
+         * The buffer is split into world_size segments. In world_size - 1 reduce-scatter steps every rank
+         * receives a segment, adds it to its own and passes it on, then world_size - 1 all-gather steps
+         * circulate the fully reduced segments. Sending runs on a separate thread and every chunk is forwarded
+         * as soon as it has been reduced, so transfers in both directions overlap with the additions.
+         *
+         * @param data
+         * @param size
+         */
+        void all_reduce(float* data, size_t size);
+
+        /**
+         * @brief Copy the buffer of the root rank to all other ranks, pipelined chunk by chunk along the ring
+         *
+         * @param data
+         * @param size
+         * @param root
+         */
+        void broadcast(float* data, size_t size, size_t root=0);
+
+        /**
+         * @brief Block until every rank has reached the barrier
+         */
+        void barrier();
+    private:
+        size_t rank_;
+        size_t world_size_;
+        size_t chunk_size;
+        int listen_socket = -1;
+        int next_socket = -1;
+        int previous_socket = -1;
+        std::string socket_path;
+
+        void connect_ring(const std::string& address);
+};
+
+/**
+ * @brief A trainer for data-parallel training over several processes
+ *
+ * Every process trains on its own shard of the data. The initial weights are broadcast from rank 0,
+ * and the gradient region of the parameter arena of the optimizer is summed over all ranks before the
+ * optimizer step, so all replicas stay identical. The optimizer must own all parameters of the model.
+ *
+ * For a Sequential model whose optimizer holds its parameters in the order of model.parameters(), the
+ * gradient region is split into buckets of consecutive layers of at least bucket_size floats. A backward
+ * hook hands every bucket to a communication thread as soon as the backward pass has reached its first
+ * layer, so the all-reduce of the later layers overlaps the backward pass of the earlier ones. This needs
+ * every layer to write only the gradients of its own parameters. Other models are reduced in one piece
+ * after the backward pass.
+ */
+class DistributedTrainer : public Trainer {
+    public:
+        DistributedTrainer(Model& model, Optimizer& optimizer, Loss& loss, ProcessGroup& group, size_t bucket_size=262144);
+        ~DistributedTrainer();
+        DistributedTrainer(const DistributedTrainer&) = delete;
+        DistributedTrainer& operator=(const DistributedTrainer&) = delete;
+
+        /**
+         * @brief Run one training step on the local batch
+         *
+         * @param inputs
+         * @param targets
+         * @return float loss of the global batch of all ranks
+         */
+        float train_step(Matrix inputs, Matrix targets) override;
+    private:
+        ProcessGroup& group;
+        Sequential* sequential = nullptr;
+        // Bucket b spans the floats [bucket_begin[b], bucket_end[b]) of the gradient region and is complete
+        // once the backward pass of the layer bucket_first_layer[b] has finished
+        std::vector<size_t> bucket_begin;
+        std::vector<size_t> bucket_end;
+        std::vector<size_t> bucket_first_layer;
+        std::thread communicator;
+        std::mutex mutex;
+        std::condition_variable work_ready;
+        std::condition_variable work_done;
+        std::deque<size_t> pending;
+        bool reducing = false;
+        bool stop = false;
+        std::exception_ptr communicator_error;
+
+        void run_communicator();
+};
+
+/**
+ * @brief Fork world_size local processes, run the function with a process group in each of them and wait for all
+ * Mainly useful for testing the distributed backend on a single host
+ *
+ * @param world_size
+ * @param address
+ * @param fn
+ * @return size_t number of processes that failed or threw an exception
+ */
+size_t run_local_processes(size_t world_size, std::string address, std::function<void(ProcessGroup&)> fn);
@@ -0,0 +1,82 @@
+#include "embedding.hpp"
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+Matrix initialize_weights(size_t rows, size_t cols, float min, float max);
+
+/************************************************
+ *               Embedding Layer                *
+ ************************************************/
+
+EmbeddingLayer::EmbeddingLayer(size_t num_embeddings, size_t embedding_dim, size_t sequence_length)
+: num_embeddings(num_embeddings), embedding_dim(embedding_dim), sequence_length(sequence_length) {
+    if (num_embeddings == 0 || embedding_dim == 0 || sequence_length == 0) {
+        throw std::runtime_error("EmbeddingLayer sizes must be positive.");
+    }
+    table = std::make_shared<Parameter>(Parameter(initialize_weights(num_embeddings, embedding_dim, -0.05, 0.05)));
+    table->row_sparse = true;
+}
+
+Matrix EmbeddingLayer::forward(Matrix input, bool training) {
+    if (input.cols() != sequence_length) {
+        throw std::runtime_error("EmbeddingLayer received input with " + std::to_string(input.cols()) +
+                                 " columns, expected " + std::to_string(sequence_length));
+    }
+    size_t batch_size = input.rows();
+    indices.resize(batch_size * sequence_length);
+    for (size_t n = 0; n < batch_size; n++) {
+        for (size_t t = 0; t < sequence_length; t++) {
+            float index = input[n, t];
+            if (index < 0 || index >= num_embeddings || index != std::floor(index)) {
+                throw std::runtime_error("EmbeddingLayer index " + std::to_string(index) + " is not a row of a table with " +
+                                         std::to_string(num_embeddings) + " rows.");
+            }
+            indices[n * sequence_length + t] = static_cast<size_t>(index);
+        }
+    }
+
+    Matrix output(batch_size, sequence_length * embedding_dim, 0);
+    const float* rows = table->data.raw();
+    float* destination = output.raw();
+    #pragma omp parallel for
+    for (size_t i = 0; i < indices.size(); i++) {
+        const float* row = rows + indices[i] * embedding_dim;
+        std::copy(row, row + embedding_dim, destination + i * embedding_dim);
+    }
+    return output;
+}
+
+Matrix EmbeddingLayer::backward(Matrix output_gradient) {
+    size_t batch_size = output_gradient.rows();
+    if (batch_size * sequence_length != indices.size() || output_gradient.cols() != sequence_length * embedding_dim) {
+        throw std::runtime_error("EmbeddingLayer received a gradient that does not match the last forward pass.");
+    }
+    if (output_gradient.is_transposed()) {
+        output_gradient = output_gradient.contiguous();
+    }
+    // An index may repeat within the batch, so the rows are accumulated sequentially
+    float* grad = table->grad.raw();
+    const float* source = output_gradient.raw();
+    for (size_t i = 0; i < indices.size(); i++) {
+        float* row = grad + indices[i] * embedding_dim;
+        const float* row_gradient = source + i * embedding_dim;
+        #pragma omp simd
+        for (size_t d = 0; d < embedding_dim; d++) {
+            row[d] += row_gradient[d];
+        }
+    }
+    table->touch_rows(indices);
+    return Matrix(batch_size, sequence_length, 0);
+}
+
+std::vector<std::shared_ptr<Parameter>> EmbeddingLayer::parameters() {
+    return {table};
+}
+
+std::shared_ptr<Model> EmbeddingLayer::clone() {
+    auto copy = std::make_shared<EmbeddingLayer>(*this);
+    copy->table = std::make_shared<Parameter>(*table);
+    return copy;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "matrix.hpp"
+#include "model.hpp"
+
+#include <memory>
+#include <vector>
+
+
+/**
+ * @brief A class to represent an embedding layer, a lookup table of num_embeddings vectors of embedding_dim features
+ *
+ * Every row of the input holds sequence_length indices into the table, stored as floats, and the output row
+ * concatenates their vectors (batch x sequence_length * embedding_dim). The table is a row-sparse parameter:
+ * the backward pass only adds to the gradient rows of the looked up indices and records them as touched,
+ * so zero_grad and row-sparse optimizers such as SparseAdam only visit those rows.
+ */
+class EmbeddingLayer : public Model {
+    public:
+        EmbeddingLayer(size_t num_embeddings, size_t embedding_dim, size_t sequence_length=1);
+        Matrix forward(Matrix input, bool training=true) override;
+
+        /**
+         * @brief Accumulate the gradients of the looked up rows, the indices have no gradient so zeros are returned
+         *
+         * @param output_gradient 
+         * @return Matrix 
+         */
+        Matrix backward(Matrix output_gradient) override;
+        std::vector<std::shared_ptr<Parameter>> parameters() override;
+        std::shared_ptr<Model> clone() override;
+    private:
+        size_t num_embeddings;
+        size_t embedding_dim;
+        size_t sequence_length;
+        std::shared_ptr<Parameter> table;
+        // The looked up rows of the last forward pass, one per input element
+        std::vector<size_t> indices;
+};
@@ -6,6 +6,8 @@
 #include "data_loader.hpp"
 #include "utils.hpp"
 #include "evaluate.hpp"
+#include "trainer.hpp"
+#include "dataset.hpp"
 
 #include <iostream>
 #include <cassert>
@@ -20,10 +22,13 @@ int main()
 {
     omp_set_num_threads(16);
     
-    DataLoader loader;
+    // Later runs read the binary copies written next to the CSV files
+    DataLoader loader(true);
     
     // Load data
     Matrix train_x = loader.load_from_csv("data/fashion_mnist_train_vectors.csv");
+    std::cout << "Loaded " << loader.last_stats().bytes / 1e6 << " MB of training vectors in " << loader.last_stats().seconds
+              << " s (" << loader.last_stats().gigabytes_per_second() << " GB/s)" << std::endl;
     Matrix train_y = loader.load_from_csv("data/fashion_mnist_train_labels.csv");
     Matrix test_x = loader.load_from_csv("data/fashion_mnist_test_vectors.csv");
     Matrix test_y = loader.load_from_csv("data/fashion_mnist_test_labels.csv");
@@ -42,26 +47,26 @@ int main()
     std::tie(train_x, val_x) = Matrix::split(train_x, 0.1);
     std::tie(train_y, val_y) = Matrix::split(train_y, 0.1);
 
+    // Keep the training pixels as bytes, they are normalized while the batches are gathered
+    CompactMatrix train_pixels(std::move(train_x), StorageType::UInt8);
+    train_pixels.normalize(1 / 255.0f);
+
     // Normalize the data
-    train_x = Matrix::div(train_x, 255.0);
     val_x = Matrix::div(val_x, 255.0);
     test_x = Matrix::div(test_x, 255.0);
 
-    // One hot encode the labels
-    train_y = Matrix::one_hot_encoding(train_y, 10);
-    
-    // Split into batches
-    std::vector<Matrix> train_x_batches = Matrix::batch(train_x, 128);
-    std::vector<Matrix> train_y_batches = Matrix::batch(train_y, 128);
+    // Draw batches in a new order every epoch, each with about the class proportions of the training set
+    BatchSampler sampler(train_pixels, Matrix::one_hot_encoding(train_y, 10), 128);
+    sampler.stratify(train_y);
 
     // Define the model
     ReLU relu;
     LeakyReLU leaky;
     Linear lin;
     Sigmoid sig;
-    FullyConnectedLayer layer1(train_x_batches[0].cols(), 256, leaky);
+    FullyConnectedLayer layer1(train_pixels.cols(), 256, leaky);
     FullyConnectedLayer layer2(256, 32, leaky);
-    FullyConnectedLayer layer3(32, train_y_batches[0].cols(), lin);
+    FullyConnectedLayer layer3(32, 10, lin);
     DropoutLayer dropout(0.15);
 
     Sequential model({
@@ -72,30 +77,26 @@ int main()
     });
 
     Adam optimizer(model.parameters(), 0.0005, 0.99, 0.999, 1e-8);
+    CategoricalCrossEntropy loss;
+    DataParallelTrainer trainer(model, optimizer, loss, omp_get_max_threads());
     
     std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
 
     // Training loop
     for (int epoch = 0; epoch < 35; epoch++) {
         float loss_sum = 0;
-        for (size_t batch = 0; batch < train_x_batches.size(); batch++) {
-            optimizer.zero_grad();
-            Matrix output = model.forward(train_x_batches[batch]);
-            float loss = CategoricalCrossEntropy().compute_error(train_y_batches[batch], output);
-            loss_sum += loss;
-            Matrix loss_derivative = CategoricalCrossEntropy().compute_error_derivative(train_y_batches[batch], output);
-            model.backward(loss_derivative);
-            optimizer.step();
+        while (sampler.next()) {
+            loss_sum += trainer.train_step(sampler.inputs(), sampler.targets());
         }
         std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
         float valid_acc = accuracy(val_y,Matrix::rowwise_argmax(model.forward(val_x)));
-        std::cout << "Epoch: " << epoch << " AVG Loss: " << loss_sum / train_x_batches.size() << " VAL ACC: " << valid_acc << " Time elapsed: " << std::chrono::duration_cast<std::chrono::seconds> (end - begin).count() << std::endl;
+        std::cout << "Epoch: " << epoch << " AVG Loss: " << loss_sum / sampler.num_batches() << " VAL ACC: " << valid_acc << " Time elapsed: " << std::chrono::duration_cast<std::chrono::seconds> (end - begin).count() << std::endl;
    }
 
     float acc = accuracy(test_y,Matrix::rowwise_argmax(model.forward(test_x)));
     std::cout << "Test Accuracy: " << acc << std::endl;
 
-    Matrix output = model.forward(train_x);
+    Matrix output = model.forward(train_pixels.matrix());
     Matrix predictions = Matrix::rowwise_argmax(output);
     loader.write_to_csv(predictions, "train_predictions.csv");
     
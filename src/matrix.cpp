@@ -1,5 +1,6 @@
 #include "matrix.hpp"
 #include <vector>
+#include <algorithm>
 
 /***********************************************
  *                Constructors                 *
@@ -32,6 +33,64 @@ Matrix::Matrix(std::tuple<size_t, size_t> shape, std::vector<float> data) {
     this->shape = shape;
 }
 
+Matrix::Matrix(const Matrix& A) : transposed(A.transposed), data(A.values()), shape(A.shape) {}
+
+Matrix::Matrix(Matrix&& A) noexcept
+: transposed(A.transposed), data(std::move(A.data)), view(A.view), view_owner(std::move(A.view_owner)), shape(A.shape) {
+    A.view = nullptr;
+}
+
+Matrix& Matrix::operator=(const Matrix& A) {
+    if (this != &A) {
+        assign(A);
+    }
+    return *this;
+}
+
+Matrix& Matrix::operator=(Matrix&& A) {
+    if (this == &A) {
+        return *this;
+    }
+    if (this->view) {
+        assign(A);
+        return *this;
+    }
+    this->data = std::move(A.data);
+    this->view = A.view;
+    this->view_owner = std::move(A.view_owner);
+    this->transposed = A.transposed;
+    this->shape = A.shape;
+    A.view = nullptr;
+    return *this;
+}
+
+/**
+ * @brief Copy the values of the matrix, a bound matrix keeps its storage and receives the values in row-major order
+ */
+void Matrix::assign(const Matrix& A) {
+    if (!this->view) {
+        this->data = A.values();
+        this->transposed = A.transposed;
+        this->shape = A.shape;
+        return;
+    }
+    if (this->rows() != A.rows() || this->cols() != A.cols()) {
+        throw std::runtime_error("Tried to assign a matrix with a different shape to a bound matrix.");
+    }
+    if (A.raw() == this->view) {
+        return;
+    }
+    if (!A.transposed) {
+        std::copy(A.raw(), A.raw() + A.rows() * A.cols(), this->view);
+        return;
+    }
+    for (size_t row = 0; row < A.rows(); row++) {
+        for (size_t col = 0; col < A.cols(); col++) {
+            this->view[row * A.cols() + col] = A.raw()[col * A.rows() + row];
+        }
+    }
+}
+
 /***********************************************
  *              Getters & Setters              *
  ***********************************************/
@@ -41,9 +100,9 @@ float& Matrix::operator[](size_t row, size_t col) {
         throw std::out_of_range("Matrix index out of bounds");
     }
     if (this->transposed) {
-        return data[col * this->rows() +  row];
+        return raw()[col * this->rows() +  row];
     } 
-    return data[row * this->cols() + col];
+    return raw()[row * this->cols() + col];
 }
 
 float Matrix::get(size_t row, size_t col) {
@@ -51,32 +110,34 @@ float Matrix::get(size_t row, size_t col) {
         throw std::out_of_range("Matrix index out of bounds");
     }
     if (transposed) {
-        return data[col * this->rows() + row];
+        return raw()[col * this->rows() + row];
     }
-    return this->data[row * this->cols() + col];
+    return raw()[row * this->cols() + col];
 }
 void Matrix::set(size_t row, size_t col, float value) {
     if (row >= this->rows() || col >= this->cols()) {
         throw std::out_of_range("Matrix index out of bounds");
     }
     if (transposed) {
-        this->data[col * this->rows() + row] = value;
+        raw()[col * this->rows() + row] = value;
     } else {
-        this->data[row * this->cols() + col] = value;
+        raw()[row * this->cols() + col] = value;
     }
 }
 
 void Matrix::set(std::vector<float> data) {
-    if (this->data.size() != data.size()) {
+    if (this->rows() * this->cols() != data.size()) {
         throw std::runtime_error("Tried to load vector into matrix with incompatible size.");
     }
+    if (this->view) {
+        std::copy(data.begin(), data.end(), this->view);
+        return;
+    }
     this->data = data;
 }
 
 void Matrix::set_all(float value) {
-    for (size_t i = 0; i < this->data.size(); i++) {
-        this->data[i] = value;
-    }
+    std::fill(raw(), raw() + this->rows() * this->cols(), value);
 }
 
 size_t Matrix::rows() const {
@@ -87,6 +148,49 @@ size_t Matrix::cols() const {
     return std::get<1>(this->shape);
 }
 
+float* Matrix::raw() {
+    return this->view ? this->view : this->data.data();
+}
+
+const float* Matrix::raw() const {
+    return this->view ? this->view : this->data.data();
+}
+
+bool Matrix::is_transposed() const {
+    return this->transposed;
+}
+
+void Matrix::bind(float* storage, std::shared_ptr<float> owner) {
+    Matrix values = this->contiguous();
+    std::copy(values.raw(), values.raw() + this->rows() * this->cols(), storage);
+    this->view = storage;
+    this->view_owner = std::move(owner);
+    this->transposed = false;
+    this->data = std::vector<float>();
+}
+
+void Matrix::rebind(float* storage, std::shared_ptr<float> owner) {
+    this->view = storage;
+    this->view_owner = std::move(owner);
+    this->transposed = false;
+    this->data = std::vector<float>();
+}
+
+Matrix Matrix::view_of(size_t rows, size_t cols, float* storage, std::shared_ptr<float> owner) {
+    Matrix matrix;
+    matrix.shape = std::make_tuple(rows, cols);
+    matrix.rebind(storage, std::move(owner));
+    return matrix;
+}
+
+bool Matrix::is_view() const {
+    return this->view != nullptr;
+}
+
+std::vector<float> Matrix::values() const {
+    return std::vector<float>(raw(), raw() + this->rows() * this->cols());
+}
+
 /***********************************************
  *                 Other                       *
  ***********************************************/
@@ -98,7 +202,7 @@ bool Matrix::isEqual(const Matrix& A) const {
         return false;
     }
 
-    if (this->data != A.data) {
+    if (!std::equal(this->raw(), this->raw() + this->rows() * this->cols(), A.raw())) {
         return false;
     }
 
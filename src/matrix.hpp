@@ -10,6 +10,7 @@
 #include <cmath>
 #include <omp.h>
 #include <random>
+#include <memory>
 
 
 /**
@@ -20,7 +21,12 @@ class Matrix {
     private:
         bool transposed=false;
         std::vector<float> data;
+        // Storage of a matrix bound to external memory, e.g. a ParameterArena, data is empty then
+        float* view = nullptr;
+        std::shared_ptr<float> view_owner;
         bool isEqual(const Matrix& A) const;
+        std::vector<float> values() const;
+        void assign(const Matrix& A);
     public:
         bool operator==(const Matrix& A) const;
         /**
@@ -37,6 +43,16 @@ class Matrix {
         Matrix(size_t rows, size_t cols, std::vector<float> data);
         Matrix(std::tuple<size_t, size_t> shape, float value);
         Matrix(std::tuple<size_t, size_t> shape, std::vector<float> data);
+
+        /**
+         * @brief Copying a matrix always creates a matrix with its own storage, also when copying a bound matrix,
+         * while moving a bound matrix moves the binding. Assigning to a bound matrix writes the values into the
+         * external storage, so the shapes must match
+         */
+        Matrix(const Matrix& A);
+        Matrix(Matrix&& A) noexcept;
+        Matrix& operator=(const Matrix& A);
+        Matrix& operator=(Matrix&& A);
         
         /***********************************************
          *               Getters & Setters             *
@@ -90,6 +106,57 @@ class Matrix {
          */
         size_t cols() const;
 
+        /**
+         * @brief Return a pointer to the underlying row-major storage
+         * The storage order ignores the transposed flag, use contiguous() first if needed
+         *
+         * @return float* 
+         */
+        float* raw();
+        const float* raw() const;
+
+        /**
+         * @brief Return whether the matrix is a transposed view of its storage
+         * 
+         * @return bool 
+         */
+        bool is_transposed() const;
+
+        /**
+         * @brief Move the values of the matrix into external storage of rows() * cols() floats and keep using it
+         * The owner keeps the storage alive for as long as the matrix refers to it
+         *
+         * @param storage 
+         * @param owner 
+         */
+        void bind(float* storage, std::shared_ptr<float> owner);
+
+        /**
+         * @brief Point the matrix at other external storage of rows() * cols() floats without copying the values
+         *
+         * @param storage 
+         * @param owner 
+         */
+        void rebind(float* storage, std::shared_ptr<float> owner);
+
+        /**
+         * @brief Create a matrix bound to external storage of rows * cols floats in row-major order without copying
+         *
+         * @param rows 
+         * @param cols 
+         * @param storage 
+         * @param owner 
+         * @return Matrix 
+         */
+        static Matrix view_of(size_t rows, size_t cols, float* storage, std::shared_ptr<float> owner);
+
+        /**
+         * @brief Return whether the matrix is bound to external storage
+         * 
+         * @return bool 
+         */
+        bool is_view() const;
+
         /***********************************************
          *               Matrix Operations             *
          ***********************************************/
@@ -100,7 +167,7 @@ class Matrix {
             * @return Matrix 
             */
         Matrix transpose() {
-            Matrix transposed_m(this->cols(), this->rows(), this->data);
+            Matrix transposed_m(this->cols(), this->rows(), this->values());
             transposed_m.transposed = true;
             return transposed_m;
         }
@@ -111,14 +178,48 @@ class Matrix {
          * @return Matrix 
          */
         Matrix copy() {
-            Matrix res(this->shape, this->data);
+            Matrix res(this->shape, this->values());
             if (this->transposed) {
                 res.transposed = true;
             }
             return res;
         }
 
-                
+        /**
+         * @brief Return a copy of the matrix whose storage is row-major (not transposed)
+         * 
+         * @return Matrix 
+         */
+        Matrix contiguous() {
+            if (!this->transposed) {
+                return this->copy();
+            }
+            Matrix res(this->rows(), this->cols(), 0);
+            #pragma omp parallel for
+            for (size_t row = 0; row < this->rows(); row++) {
+                for (size_t col = 0; col < this->cols(); col++) {
+                    res.data[row * this->cols() + col] = this->raw()[col * this->rows() + row];
+                }
+            }
+            return res;
+        }
+
+        /**
+         * @brief Return a matrix with the same elements in row-major order but a different shape
+         * 
+         * @param rows 
+         * @param cols 
+         * @return Matrix 
+         */
+        Matrix reshape(size_t rows, size_t cols) {
+            if (rows * cols != this->rows() * this->cols()) {
+                throw std::runtime_error(std::string("Tried to reshape matrix into incompatible dimensions."));
+            }
+            if (this->transposed) {
+                return this->contiguous().reshape(rows, cols);
+            }
+            return Matrix(rows, cols, this->values());
+        }
 
         /***********************************************
          *          Linear Algebra Operations          *
@@ -181,6 +282,34 @@ class Matrix {
             return result;
         }
 
+        /**
+         * @brief Add the second matrix to the first one in place, e.g. to accumulate gradients without a new allocation
+         *
+         * @param A 
+         * @param B 
+         */
+        static void add_inplace(Matrix& A, const Matrix& B) {
+            if (A.rows() != B.rows() || A.cols() != B.cols()) {
+                throw std::runtime_error(std::string("Tried to add matrices with incompatible dimensions."));
+            }
+            if (A.transposed == B.transposed) {
+                float* a = A.raw();
+                const float* b = B.raw();
+                #pragma omp parallel for simd
+                for (size_t i = 0; i < A.rows() * A.cols(); i++) {
+                    a[i] += b[i];
+                }
+                return;
+            }
+            Matrix source = B;
+            #pragma omp parallel for
+            for (size_t row  = 0; row < A.rows(); row++) {
+                for (size_t col = 0; col < A.cols(); col++) {
+                    A[row, col] += source[row, col];
+                }
+            }
+        }
+
         static Matrix sub(Matrix A, Matrix B) {
             size_t A_row_count, A_col_count, B_row_count, B_col_count;
             std::tie(A_row_count, A_col_count) = A.shape;
@@ -700,6 +829,30 @@ class Matrix {
             return result;
         }
 
+        /**
+         * @brief Return a copy of the rows [begin, end) of the matrix
+         *
+         * @param A 
+         * @param begin 
+         * @param end 
+         * @return Matrix 
+         */
+        static Matrix slice_rows(const Matrix& A, size_t begin, size_t end) {
+            if (begin > end || end > A.rows()) {
+                throw std::out_of_range("Row slice out of bounds");
+            }
+            if (!A.transposed) {
+                return Matrix(end - begin, A.cols(), std::vector<float>(A.raw() + begin * A.cols(), A.raw() + end * A.cols()));
+            }
+            Matrix result(end - begin, A.cols(), 0);
+            for (size_t row = begin; row < end; row++) {
+                for (size_t col = 0; col < A.cols(); col++) {
+                    result.data[(row - begin) * A.cols() + col] = A.raw()[col * A.rows() + row];
+                }
+            }
+            return result;
+        }
+
         static std::tuple<Matrix, Matrix> split(Matrix A, float split_percentage) {
             if (split_percentage < 0.0f || split_percentage > 1.0f) {
                 throw std::runtime_error("Split percentage must be between 0 and 1.");
@@ -5,6 +5,22 @@
 #include <cassert>
 #include <iostream>
 #include <stdexcept>
+#include <algorithm>
+#include <iterator>
+
+
+/************************************************
+ *                  Parameter                   *
+ ************************************************/
+
+void Parameter::touch_rows(std::vector<size_t> rows) {
+    std::sort(rows.begin(), rows.end());
+    rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+    std::vector<size_t> merged;
+    merged.reserve(touched_rows.size() + rows.size());
+    std::set_union(touched_rows.begin(), touched_rows.end(), rows.begin(), rows.end(), std::back_inserter(merged));
+    touched_rows = std::move(merged);
+}
 
 
 /************************************************
@@ -30,7 +46,7 @@ FullyConnectedLayer::FullyConnectedLayer(size_t input_size, size_t output_size,
   biases(std::make_shared<Parameter>(Parameter(initialize_weights(1, output_size, -0.1, 0.1)))),
   activation_fn(std::move(activation_fn)) {}
 
-Matrix FullyConnectedLayer::forward(Matrix input, bool training=true) {
+Matrix FullyConnectedLayer::forward(Matrix input, bool training) {
     Matrix results = Matrix::matMul(input, weights->data);
     results = Matrix::colwise_add(results, biases->data);
     this->inner_potential = results.copy();
@@ -41,8 +57,8 @@ Matrix FullyConnectedLayer::forward(Matrix input, bool training=true) {
 
 Matrix FullyConnectedLayer::backward(Matrix loss_gradient) {
     loss_gradient = Matrix::mul(loss_gradient, Matrix::apply(inner_potential, [&](float x) {return activation_fn.get().derivative(x);}));
-    weights->grad = Matrix::add(weights->grad, Matrix::matMul(inputs.transpose(), loss_gradient));
-    biases->grad = Matrix::add(biases->grad, Matrix::colwise_sum(loss_gradient));
+    Matrix::add_inplace(weights->grad, Matrix::matMul(inputs.transpose(), loss_gradient));
+    Matrix::add_inplace(biases->grad, Matrix::colwise_sum(loss_gradient));
     Matrix next_loss_gradient = Matrix::matMul(loss_gradient, weights->data.transpose());
     return next_loss_gradient;
 }
@@ -50,15 +66,22 @@ Matrix FullyConnectedLayer::backward(Matrix loss_gradient) {
 std::vector<std::shared_ptr<Parameter>> FullyConnectedLayer::parameters() {
     return {weights, biases};
 }
+
+std::shared_ptr<Model> FullyConnectedLayer::clone() {
+    auto copy = std::make_shared<FullyConnectedLayer>(*this);
+    copy->weights = std::make_shared<Parameter>(*weights);
+    copy->biases = std::make_shared<Parameter>(*biases);
+    return copy;
+}
 /************************************************
  *                   Dropout                    *
  ************************************************/
 
 DropoutLayer::DropoutLayer(float dropout_rate) : dropout_rate(dropout_rate) {}
-Matrix DropoutLayer::forward(Matrix input, bool training=true) {
+Matrix DropoutLayer::forward(Matrix input, bool training) {
 
     if (!training) {
-        return Matrix::mul(input, 1 - dropout_rate)
+        return Matrix::mul(input, 1 - dropout_rate);
     }
 
     // Generate random mask to zero some inputs
@@ -84,6 +107,10 @@ std::vector<std::shared_ptr<Parameter>> DropoutLayer::parameters() {
     return {};
 }
 
+std::shared_ptr<Model> DropoutLayer::clone() {
+    return std::make_shared<DropoutLayer>(*this);
+}
+
 /************************************************
  *                  BatchNorm                   *
  ************************************************/
@@ -91,7 +118,7 @@ std::vector<std::shared_ptr<Parameter>> DropoutLayer::parameters() {
 // NOT WORKING YET!!!
 
 BatchNormLayer::BatchNormLayer(size_t size, float epsilon) : size(size), epsilon(epsilon), weights(std::make_shared<Parameter>(Parameter(Matrix(1, size, 1)))), biases(std::make_shared<Parameter>(Parameter(Matrix(1, size, 0)))) {}
-Matrix BatchNormLayer::forward(Matrix input, bool training=true) {
+Matrix BatchNormLayer::forward(Matrix input, bool training) {
     inputs = inputs.copy();
     mean = Matrix::div(Matrix::colwise_sum(input), input.rows());
     std = Matrix::sqrt(Matrix::add(Matrix::colwise_sum(Matrix::apply(Matrix::colwise_sub(input, mean), [](float x) {return x*x;})), epsilon));
@@ -109,13 +136,199 @@ std::vector<std::shared_ptr<Parameter>> BatchNormLayer::parameters() {
     return {weights, biases};
 }
 
+std::shared_ptr<Model> BatchNormLayer::clone() {
+    auto copy = std::make_shared<BatchNormLayer>(*this);
+    copy->weights = std::make_shared<Parameter>(*weights);
+    copy->biases = std::make_shared<Parameter>(*biases);
+    return copy;
+}
+
+/************************************************
+ *                  LayerNorm                   *
+ ************************************************/
+
+LayerNorm::LayerNorm(size_t size, float epsilon) : size(size), epsilon(epsilon), weights(std::make_shared<Parameter>(Parameter(Matrix(1, size, 1)))), biases(std::make_shared<Parameter>(Parameter(Matrix(1, size, 0)))) {}
+
+Matrix LayerNorm::forward(Matrix input, bool training) {
+    if (input.cols() != size) {
+        throw std::runtime_error(std::string("LayerNorm received input with incompatible dimensions."));
+    }
+    if (input.is_transposed()) {
+        input = input.contiguous();
+    }
+    size_t rows = input.rows();
+    Matrix output(rows, size, 0);
+    normalized_inputs = Matrix(rows, size, 0);
+    inv_std = std::vector<float>(rows);
+
+    const float* x = input.raw();
+    const float* gamma = weights->data.raw();
+    const float* beta = biases->data.raw();
+    float* x_hat = normalized_inputs.raw();
+    float* y = output.raw();
+    #pragma omp parallel for
+    for (size_t row = 0; row < rows; row++) {
+        const float* x_row = x + row * size;
+        // Sum and sum of squares in a single pass, shifted by the first element to avoid cancellation
+        float shift = x_row[0], sum = 0, sum_sq = 0;
+        #pragma omp simd reduction(+:sum, sum_sq)
+        for (size_t col = 0; col < size; col++) {
+            float centered = x_row[col] - shift;
+            sum += centered;
+            sum_sq += centered * centered;
+        }
+        float mean_shifted = sum / size;
+        float variance = std::max(sum_sq / size - mean_shifted * mean_shifted, 0.0f);
+        float mean = shift + mean_shifted;
+        float rstd = 1.0f / std::sqrt(variance + epsilon);
+        inv_std[row] = rstd;
+        #pragma omp simd
+        for (size_t col = 0; col < size; col++) {
+            float normalized = (x_row[col] - mean) * rstd;
+            x_hat[row * size + col] = normalized;
+            y[row * size + col] = normalized * gamma[col] + beta[col];
+        }
+    }
+    return output;
+}
+
+Matrix LayerNorm::backward(Matrix loss_gradient) {
+    if (loss_gradient.is_transposed()) {
+        loss_gradient = loss_gradient.contiguous();
+    }
+    size_t rows = loss_gradient.rows();
+    Matrix input_gradient(rows, size, 0);
+
+    const float* dy = loss_gradient.raw();
+    const float* gamma = weights->data.raw();
+    const float* x_hat = normalized_inputs.raw();
+    float* dx = input_gradient.raw();
+    float* d_gamma = weights->grad.raw();
+    float* d_beta = biases->grad.raw();
+    #pragma omp parallel for reduction(+:d_gamma[:size], d_beta[:size])
+    for (size_t row = 0; row < rows; row++) {
+        const float* dy_row = dy + row * size;
+        const float* x_hat_row = x_hat + row * size;
+        float sum_g = 0, sum_g_x_hat = 0;
+        #pragma omp simd reduction(+:sum_g, sum_g_x_hat)
+        for (size_t col = 0; col < size; col++) {
+            float g = dy_row[col] * gamma[col];
+            sum_g += g;
+            sum_g_x_hat += g * x_hat_row[col];
+            d_gamma[col] += dy_row[col] * x_hat_row[col];
+            d_beta[col] += dy_row[col];
+        }
+        float mean_g = sum_g / size, mean_g_x_hat = sum_g_x_hat / size;
+        #pragma omp simd
+        for (size_t col = 0; col < size; col++) {
+            float g = dy_row[col] * gamma[col];
+            dx[row * size + col] = inv_std[row] * (g - mean_g - x_hat_row[col] * mean_g_x_hat);
+        }
+    }
+    return input_gradient;
+}
+
+std::vector<std::shared_ptr<Parameter>> LayerNorm::parameters() {
+    return {weights, biases};
+}
+
+std::shared_ptr<Model> LayerNorm::clone() {
+    auto copy = std::make_shared<LayerNorm>(*this);
+    copy->weights = std::make_shared<Parameter>(*weights);
+    copy->biases = std::make_shared<Parameter>(*biases);
+    return copy;
+}
+
+/************************************************
+ *                   RMSNorm                    *
+ ************************************************/
+
+RMSNorm::RMSNorm(size_t size, float epsilon) : size(size), epsilon(epsilon), weights(std::make_shared<Parameter>(Parameter(Matrix(1, size, 1)))) {}
+
+Matrix RMSNorm::forward(Matrix input, bool training) {
+    if (input.cols() != size) {
+        throw std::runtime_error(std::string("RMSNorm received input with incompatible dimensions."));
+    }
+    if (input.is_transposed()) {
+        input = input.contiguous();
+    }
+    size_t rows = input.rows();
+    Matrix output(rows, size, 0);
+    normalized_inputs = Matrix(rows, size, 0);
+    inv_rms = std::vector<float>(rows);
+
+    const float* x = input.raw();
+    const float* gamma = weights->data.raw();
+    float* x_hat = normalized_inputs.raw();
+    float* y = output.raw();
+    #pragma omp parallel for
+    for (size_t row = 0; row < rows; row++) {
+        const float* x_row = x + row * size;
+        float sum_sq = 0;
+        #pragma omp simd reduction(+:sum_sq)
+        for (size_t col = 0; col < size; col++) {
+            sum_sq += x_row[col] * x_row[col];
+        }
+        float rrms = 1.0f / std::sqrt(sum_sq / size + epsilon);
+        inv_rms[row] = rrms;
+        #pragma omp simd
+        for (size_t col = 0; col < size; col++) {
+            float normalized = x_row[col] * rrms;
+            x_hat[row * size + col] = normalized;
+            y[row * size + col] = normalized * gamma[col];
+        }
+    }
+    return output;
+}
+
+Matrix RMSNorm::backward(Matrix loss_gradient) {
+    if (loss_gradient.is_transposed()) {
+        loss_gradient = loss_gradient.contiguous();
+    }
+    size_t rows = loss_gradient.rows();
+    Matrix input_gradient(rows, size, 0);
+
+    const float* dy = loss_gradient.raw();
+    const float* gamma = weights->data.raw();
+    const float* x_hat = normalized_inputs.raw();
+    float* dx = input_gradient.raw();
+    float* d_gamma = weights->grad.raw();
+    #pragma omp parallel for reduction(+:d_gamma[:size])
+    for (size_t row = 0; row < rows; row++) {
+        const float* dy_row = dy + row * size;
+        const float* x_hat_row = x_hat + row * size;
+        float sum_g_x_hat = 0;
+        #pragma omp simd reduction(+:sum_g_x_hat)
+        for (size_t col = 0; col < size; col++) {
+            sum_g_x_hat += dy_row[col] * gamma[col] * x_hat_row[col];
+            d_gamma[col] += dy_row[col] * x_hat_row[col];
+        }
+        float mean_g_x_hat = sum_g_x_hat / size;
+        #pragma omp simd
+        for (size_t col = 0; col < size; col++) {
+            dx[row * size + col] = inv_rms[row] * (dy_row[col] * gamma[col] - x_hat_row[col] * mean_g_x_hat);
+        }
+    }
+    return input_gradient;
+}
+
+std::vector<std::shared_ptr<Parameter>> RMSNorm::parameters() {
+    return {weights};
+}
+
+std::shared_ptr<Model> RMSNorm::clone() {
+    auto copy = std::make_shared<RMSNorm>(*this);
+    copy->weights = std::make_shared<Parameter>(*weights);
+    return copy;
+}
+
 /************************************************
  *                  Sequential                  *
  ************************************************/
 
 Sequential::Sequential(std::vector<std::reference_wrapper<Model>> layers) : layers(std::move(layers)) {}
 
-Matrix Sequential::forward(Matrix input, bool training=true) {
+Matrix Sequential::forward(Matrix input, bool training) {
     Matrix output = input;
     for (size_t i = 0; i < layers.size(); i++) {
         output = layers[i].get().forward(output, training);
@@ -129,6 +342,9 @@ Matrix Sequential::backward(Matrix input) {
     while (i > 0) {
         i--;
         output = layers[i].get().backward(output);        
+        if (backward_hook) {
+            backward_hook(i);
+        }
     }
     return output;
 }
@@ -141,4 +357,25 @@ std::vector<std::shared_ptr<Parameter>> Sequential::parameters() {
         params.insert(params.end(), layer_params.begin(), layer_params.end());
     }
     return params;
-}
\ No newline at end of file
+}
+
+std::shared_ptr<Model> Sequential::clone() {
+    auto copy = std::make_shared<Sequential>(std::vector<std::reference_wrapper<Model>>{});
+    for (size_t i = 0; i < layers.size(); i++) {
+        copy->owned_layers.push_back(layers[i].get().clone());
+        copy->layers.push_back(*copy->owned_layers.back());
+    }
+    return copy;
+}
+
+size_t Sequential::size() const {
+    return layers.size();
+}
+
+Model& Sequential::layer(size_t index) {
+    return layers.at(index).get();
+}
+
+void Sequential::set_backward_hook(std::function<void(size_t)> hook) {
+    backward_hook = hook;
+}
@@ -3,6 +3,8 @@
 #include "activations.hpp"
 
 #include <memory>
+#include <functional>
+#include <vector>
 
 
 /**
@@ -13,9 +15,31 @@ class Parameter {
     public:
         Matrix data;
         Matrix grad;
+        // Set for parameters whose gradients only touch a few rows per batch, e.g. embedding tables
+        bool row_sparse = false;
+        // The rows with gradients since the last zero_grad, sorted and unique, only kept for row-sparse parameters
+        std::vector<size_t> touched_rows;
         
+        // Alive while the parameter is bound to a ParameterArena, copies of the parameter are not bound
+        std::weak_ptr<const void> arena;
+
         Parameter() = default;
         Parameter(Matrix data) : data(data), grad(data.shape, 0) {}
+        Parameter(const Parameter& other) : data(other.data), grad(other.grad), row_sparse(other.row_sparse), touched_rows(other.touched_rows) {}
+        Parameter& operator=(const Parameter& other) {
+            data = other.data;
+            grad = other.grad;
+            row_sparse = other.row_sparse;
+            touched_rows = other.touched_rows;
+            return *this;
+        }
+
+        /**
+         * @brief Add rows to the touched rows, which stay sorted and unique
+         *
+         * @param rows 
+         */
+        void touch_rows(std::vector<size_t> rows);
 };
 
 /**
@@ -27,6 +51,14 @@ class Model {
         virtual std::vector<std::shared_ptr<Parameter>> parameters() = 0;
         virtual Matrix forward(Matrix input, bool training=true) = 0;
         virtual Matrix backward(Matrix input) = 0;
+
+        /**
+         * @brief Return a copy of the model that owns its own copies of all parameters
+         * Used to create independent replicas of a model, e.g. for data-parallel training
+         *
+         * @return std::shared_ptr<Model>
+         */
+        virtual std::shared_ptr<Model> clone() = 0;
 };
 
 /**
@@ -39,8 +71,22 @@ class Sequential: public Model {
         Matrix forward(Matrix input, bool training=true) override;
         Matrix backward(Matrix input) override;
         std::vector<std::shared_ptr<Parameter>> parameters() override;
+        std::shared_ptr<Model> clone() override;
+        size_t size() const;
+        Model& layer(size_t index);
+
+        /**
+         * @brief Call the hook with the index of every layer right after its backward pass, e.g. to update its parameters eagerly
+         * An empty function removes the hook, clones do not inherit it
+         *
+         * @param hook 
+         */
+        void set_backward_hook(std::function<void(size_t)> hook);
     private:
         std::vector<std::reference_wrapper<Model>> layers;
+        std::function<void(size_t)> backward_hook;
+        // Layers created by clone(), the layers of a user constructed model are owned by the caller
+        std::vector<std::shared_ptr<Model>> owned_layers;
 };
 
 /**
@@ -53,6 +99,7 @@ class FullyConnectedLayer : public Model {
         Matrix forward(Matrix input, bool training=true) override;
         Matrix backward(Matrix output_gradient) override;
         std::vector<std::shared_ptr<Parameter>> parameters() override;
+        std::shared_ptr<Model> clone() override;
     private:
         std::shared_ptr<Parameter> weights;
         std::shared_ptr<Parameter> biases;
@@ -71,6 +118,7 @@ class DropoutLayer : public Model {
         Matrix forward(Matrix input, bool training=true) override;
         Matrix backward(Matrix input) override;
         std::vector<std::shared_ptr<Parameter>> parameters() override;
+        std::shared_ptr<Model> clone() override;
     private:
         float dropout_rate;
         Matrix mask;
@@ -86,6 +134,7 @@ class BatchNormLayer : public Model {
         Matrix forward(Matrix input, bool training=true) override;
         Matrix backward(Matrix) override;
         std::vector<std::shared_ptr<Parameter>> parameters() override;
+        std::shared_ptr<Model> clone() override;
     private:
         Matrix inputs;
         Matrix normalized_inputs;
@@ -95,4 +144,43 @@ class BatchNormLayer : public Model {
         float epsilon;
         std::shared_ptr<Parameter> weights;
         std::shared_ptr<Parameter> biases;
-};
\ No newline at end of file
+};
+
+/**
+ * @brief A class to represent a layer normalization layer of a neural network model
+ * Every row is normalized by its own mean and variance and then scaled and shifted per feature
+ */
+class LayerNorm : public Model {
+    public:
+        LayerNorm(size_t size, float epsilon);
+        Matrix forward(Matrix input, bool training=true) override;
+        Matrix backward(Matrix output_gradient) override;
+        std::vector<std::shared_ptr<Parameter>> parameters() override;
+        std::shared_ptr<Model> clone() override;
+    private:
+        size_t size;
+        float epsilon;
+        Matrix normalized_inputs;
+        std::vector<float> inv_std;
+        std::shared_ptr<Parameter> weights;
+        std::shared_ptr<Parameter> biases;
+};
+
+/**
+ * @brief A class to represent a root mean square normalization layer of a neural network model
+ * Every row is divided by its root mean square and then scaled per feature, without centering
+ */
+class RMSNorm : public Model {
+    public:
+        RMSNorm(size_t size, float epsilon);
+        Matrix forward(Matrix input, bool training=true) override;
+        Matrix backward(Matrix output_gradient) override;
+        std::vector<std::shared_ptr<Parameter>> parameters() override;
+        std::shared_ptr<Model> clone() override;
+    private:
+        size_t size;
+        float epsilon;
+        Matrix normalized_inputs;
+        std::vector<float> inv_rms;
+        std::shared_ptr<Parameter> weights;
+};
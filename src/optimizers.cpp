@@ -1,21 +1,151 @@
 #include "optimizers.hpp"
 #include "utils.hpp"
+#include <algorithm>
+
+void Optimizer::step() {
+    start_step();
+    const float scale = gradient_scale();
+    if (!ema_due) {
+        update(0, parameters.size(), scale);
+        return;
+    }
+    for (size_t b = 0; b + 1 < ema_blocks.size(); b++) {
+        update(ema_blocks[b], ema_blocks[b + 1], scale);
+        update_ema(ema_blocks[b], ema_blocks[b + 1]);
+    }
+}
+
+void Optimizer::begin_step() {
+    if (max_grad_norm > 0) {
+        throw std::runtime_error("Gradient clipping needs all gradients and cannot be combined with eager updates.");
+    }
+    start_step();
+}
+
+void Optimizer::step_parameters(size_t first, size_t last) {
+    if (first > last || last > parameters.size()) {
+        throw std::runtime_error("Invalid parameter range [" + std::to_string(first) + ", " + std::to_string(last) + ") of an optimizer with " +
+                                 std::to_string(parameters.size()) + " parameters.");
+    }
+    update(first, last, 1.0f);
+    if (ema_due) {
+        update_ema(first, last);
+    }
+}
+
+void Optimizer::start_step() {
+    if (ema_swapped) {
+        throw std::runtime_error("Swap the moving average of the weights back out before the next step.");
+    }
+    prepare();
+    steps++;
+    ema_due = ema_enabled && steps % ema_every == 0;
+}
+
+void Optimizer::enable_ema(float decay, size_t every) {
+    if (decay < 0 || decay >= 1 || every == 0) {
+        throw std::runtime_error("The EMA decay must be in [0, 1) and the interval positive.");
+    }
+    ema_decay = decay;
+    ema_every = every;
+    if (ema_enabled) {
+        return;
+    }
+    ema_slot = parameter_arena->add_state_slot();
+    std::copy(parameter_arena->data(), parameter_arena->data() + parameter_arena->size(), parameter_arena->state(ema_slot));
+    // Blocks of about 32 KiB of weights, so the weights of a block are still in cache when its average is updated
+    const size_t block_floats = 8192;
+    ema_blocks = {0};
+    for (size_t p = 1; p <= parameters.size(); p++) {
+        if (p == parameters.size() || parameter_arena->offset(p) - parameter_arena->offset(ema_blocks.back()) >= block_floats) {
+            ema_blocks.push_back(p);
+        }
+    }
+    ema_enabled = true;
+}
+
+void Optimizer::swap_ema_weights() {
+    if (!ema_enabled) {
+        throw std::runtime_error("No moving average of the weights, call enable_ema() first.");
+    }
+    if (ema_swapped) {
+        parameter_arena->point_data_at_values();
+    } else {
+        parameter_arena->point_data_at_state(ema_slot);
+    }
+    ema_swapped = !ema_swapped;
+}
+
+void Optimizer::update_ema(size_t first, size_t last) {
+    const size_t begin = parameter_arena->offset(first), end = parameter_arena->offset(last);
+    const float* data = parameter_arena->data();
+    float* ema = parameter_arena->state(ema_slot);
+    #pragma omp parallel for simd
+    for (size_t i = begin; i < end; i++) {
+        ema[i] = ema_decay * ema[i] + (1 - ema_decay) * data[i];
+    }
+}
 
 void Optimizer::zero_grad() {
-    for (size_t i = 0; i < parameters.size(); i++) {
-        parameters[i]->grad.set_all(0);
+    parameter_arena->zero_grad();
+}
+
+ParameterArena& Optimizer::arena() {
+    return *parameter_arena;
+}
+
+float Optimizer::get_learning_rate() const {
+    return learning_rate;
+}
+
+void Optimizer::set_learning_rate(float learning_rate) {
+    this->learning_rate = learning_rate;
+}
+
+void Optimizer::set_max_grad_norm(float max_norm) {
+    max_grad_norm = max_norm;
+}
+
+float Optimizer::get_grad_norm() const {
+    return grad_norm;
+}
+
+/**
+ * @brief Return the factor the gradients are multiplied with inside the fused update
+ * With clipping enabled the global norm is reduced in one parallel pass over the gradient region of the arena
+ */
+float Optimizer::gradient_scale() {
+    if (max_grad_norm <= 0) {
+        return 1.0f;
+    }
+    const float* grad = parameter_arena->grad();
+    double squared_norm = 0;
+    #pragma omp parallel for simd reduction(+:squared_norm)
+    for (size_t i = 0; i < parameter_arena->size(); i++) {
+        squared_norm += grad[i] * grad[i];
     }
+    grad_norm = std::sqrt(squared_norm);
+    return grad_norm > max_grad_norm ? max_grad_norm / (grad_norm + 1e-6f) : 1.0f;
+}
+
+size_t Optimizer::state_bytes() const {
+    return parameter_arena->state_slots() * parameter_arena->size() * sizeof(float);
 }
 
 /**************************************
                   SGD                 
  **************************************/
 
-SGD::SGD(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate): Optimizer(parameters), learning_rate(learning_rate) {};
+SGD::SGD(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate): Optimizer(parameters, learning_rate) {};
 
-void SGD::step() {
-    for (size_t i = 0; i < parameters.size(); i++) {
-        parameters[i]->data = Matrix::add(parameters[i]->data, Matrix::mul(parameters[i]->grad, -learning_rate));
+void SGD::update(size_t first, size_t last, float scale) {
+    const size_t begin = parameter_arena->offset(first), end = parameter_arena->offset(last);
+    float* data = parameter_arena->data();
+    const float* grad = parameter_arena->grad();
+    #pragma omp parallel for simd
+    for (size_t i = begin; i < end; i++) {
+        float g = scale * grad[i];
+        data[i] -= learning_rate * g;
     }
 }
 
@@ -24,87 +154,415 @@ void SGD::step() {
            SGD with momentum                 
  **************************************/
 
-SGDWithMomentum::SGDWithMomentum(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float momentum): Optimizer(parameters), learning_rate(learning_rate), momentum(momentum) {
-    for (size_t i = 0; i < parameters.size(); i++) {
-        velocities.push_back(Matrix(parameters[i]->data.shape, 0));
+SGDWithMomentum::SGDWithMomentum(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float momentum): Optimizer(parameters, learning_rate, 1), momentum(momentum) {}
+
+void SGDWithMomentum::update(size_t first, size_t last, float scale) {
+    const size_t begin = parameter_arena->offset(first), end = parameter_arena->offset(last);
+    float* data = parameter_arena->data();
+    const float* grad = parameter_arena->grad();
+    float* velocity = parameter_arena->state(0);
+    #pragma omp parallel for simd
+    for (size_t i = begin; i < end; i++) {
+        float g = scale * grad[i];
+        velocity[i] = momentum * velocity[i] - learning_rate * g;
+        data[i] += velocity[i];
     }
 }
 
-void SGDWithMomentum::step() {
-    for (size_t i = 0; i < parameters.size(); i++) {
-        velocities[i] = Matrix::add(Matrix::mul(velocities[i], momentum), Matrix::mul(parameters[i]->grad, -learning_rate));
-        parameters[i]->data = Matrix::add(parameters[i]->data, velocities[i]);
+/**************************************
+                  AdaGrad                 
+ **************************************/
+
+AdaGrad::AdaGrad(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float epsilon): Optimizer(parameters, learning_rate, 1), epsilon(epsilon) {}
+
+void AdaGrad::update(size_t first, size_t last, float scale) {
+    const size_t begin = parameter_arena->offset(first), end = parameter_arena->offset(last);
+    float* data = parameter_arena->data();
+    const float* grad = parameter_arena->grad();
+    float* squared_gradients = parameter_arena->state(0);
+    #pragma omp parallel for simd
+    for (size_t i = begin; i < end; i++) {
+        float g = scale * grad[i];
+        squared_gradients[i] += g * g;
+        data[i] -= learning_rate * g / (std::sqrt(squared_gradients[i]) + epsilon);
     }
 }
 
 /**************************************
-                  AdaGrad                 
+                  RMSprop                 
  **************************************/
 
-AdaGrad::AdaGrad(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float epsilon): Optimizer(parameters), learning_rate(learning_rate), epsilon(epsilon) {
-    for (size_t i = 0; i < parameters.size(); i++) {
-        squared_gradients.push_back(Matrix(parameters[i]->data.shape, 0));
+RMSprop::RMSprop(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float decay, float epsilon): Optimizer(parameters, learning_rate, 1), decay(decay), epsilon(epsilon) {}
+
+void RMSprop::update(size_t first, size_t last, float scale) {
+    const size_t begin = parameter_arena->offset(first), end = parameter_arena->offset(last);
+    float* data = parameter_arena->data();
+    const float* grad = parameter_arena->grad();
+    float* v = parameter_arena->state(0);
+    #pragma omp parallel for simd
+    for (size_t i = begin; i < end; i++) {
+        float g = scale * grad[i];
+        v[i] = decay * v[i] + (1 - decay) * g * g;
+        data[i] -= learning_rate * g / (std::sqrt(v[i]) + epsilon);
     }
 }
 
-void AdaGrad::step() {
-    for (size_t i = 0; i < parameters.size(); i++) {
-        squared_gradients[i] = Matrix::add(squared_gradients[i], Matrix::mul(parameters[i]->grad, parameters[i]->grad));
-        Matrix adaptive_learning_rate = Matrix::mul(Matrix::add(Matrix::sqrt(squared_gradients[i]), epsilon), -learning_rate); 
-        parameters[i]->data = Matrix::add(parameters[i]->data, Matrix::mul(parameters[i]->grad, adaptive_learning_rate));
+
+/**************************************
+                  Adam                 
+ **************************************/
+
+Adam::Adam(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float beta1, float beta2, float epsilon): Optimizer(parameters, learning_rate, 2), beta1(beta1), beta2(beta2), epsilon(epsilon) {}
+
+/**
+ * @brief Advance the step counter, the bias corrections are folded into the step size, so the loop body has a single division
+ */
+void Adam::prepare() {
+    t++;
+    step_size = learning_rate / (1.0f - std::pow(beta1, t));
+    inv_sqrt_correction2 = 1.0f / std::sqrt(1.0f - std::pow(beta2, t));
+}
+
+/**
+ * @brief Update the moments and the weights in a single pass over the arena range of the parameters
+ * AdamW applies the decoupled weight decay to the weights in the same pass
+ */
+void Adam::update(size_t first, size_t last, float scale) {
+    const size_t begin = parameter_arena->offset(first), end = parameter_arena->offset(last);
+    const float decay = 1 - weight_decay;
+    float* data = parameter_arena->data();
+    const float* grad = parameter_arena->grad();
+    float* m = parameter_arena->state(0);
+    float* v = parameter_arena->state(1);
+    #pragma omp parallel for simd
+    for (size_t i = begin; i < end; i++) {
+        float g = scale * grad[i];
+        m[i] = beta1 * m[i] + (1 - beta1) * g;
+        v[i] = beta2 * v[i] + (1 - beta2) * g * g;
+        data[i] = decay * data[i] - step_size * m[i] / (std::sqrt(v[i]) * inv_sqrt_correction2 + epsilon);
     }
 }
 
+
 /**************************************
-                  RMSprop                 
+              Sparse Adam                 
+ **************************************/
+
+SparseAdam::SparseAdam(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float beta1, float beta2, float epsilon)
+: Optimizer(parameters, learning_rate, 2), beta1(beta1), beta2(beta2), epsilon(epsilon) {
+    for (auto& parameter : parameters) {
+        row_steps.push_back(std::vector<uint32_t>(parameter->row_sparse ? parameter->data.rows() : 0, 0));
+    }
+}
+
+void SparseAdam::prepare() {
+    t++;
+    step_size = learning_rate / (1.0f - std::pow(beta1, t));
+    inv_sqrt_correction2 = 1.0f / std::sqrt(1.0f - std::pow(beta2, t));
+}
+
+void SparseAdam::update(size_t first, size_t last, float scale) {
+    float* data = parameter_arena->data();
+    const float* grad = parameter_arena->grad();
+    float* m = parameter_arena->state(0);
+    float* v = parameter_arena->state(1);
+    for (size_t p = first; p < last; p++) {
+        const size_t begin = parameter_arena->offset(p);
+        if (!parameters[p]->row_sparse) {
+            const size_t end = parameter_arena->offset(p + 1);
+            #pragma omp parallel for simd
+            for (size_t i = begin; i < end; i++) {
+                float g = scale * grad[i];
+                m[i] = beta1 * m[i] + (1 - beta1) * g;
+                v[i] = beta2 * v[i] + (1 - beta2) * g * g;
+                data[i] -= step_size * m[i] / (std::sqrt(v[i]) * inv_sqrt_correction2 + epsilon);
+            }
+            continue;
+        }
+
+        const std::vector<size_t>& rows = parameters[p]->touched_rows;
+        const size_t cols = parameters[p]->data.cols();
+        std::vector<uint32_t>& steps = row_steps[p];
+        #pragma omp parallel for
+        for (size_t k = 0; k < rows.size(); k++) {
+            uint32_t row_t = ++steps[rows[k]];
+            const float row_step_size = learning_rate / (1.0f - std::pow(beta1, row_t));
+            const float row_inv_sqrt_correction2 = 1.0f / std::sqrt(1.0f - std::pow(beta2, row_t));
+            const size_t row_begin = begin + rows[k] * cols;
+            #pragma omp simd
+            for (size_t i = row_begin; i < row_begin + cols; i++) {
+                float g = scale * grad[i];
+                m[i] = beta1 * m[i] + (1 - beta1) * g;
+                v[i] = beta2 * v[i] + (1 - beta2) * g * g;
+                data[i] -= row_step_size * m[i] / (std::sqrt(v[i]) * row_inv_sqrt_correction2 + epsilon);
+            }
+        }
+    }
+}
+
+size_t SparseAdam::state_bytes() const {
+    size_t bytes = Optimizer::state_bytes();
+    for (auto& steps : row_steps) {
+        bytes += steps.size() * sizeof(uint32_t);
+    }
+    return bytes;
+}
+
+
+/**************************************
+            Quantized Adam                 
  **************************************/
 
-RMSprop::RMSprop(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float decay, float epsilon): Optimizer(parameters), learning_rate(learning_rate), decay(decay), epsilon(epsilon) {
-    for (size_t i = 0; i < parameters.size(); i++) {
-        v.push_back(Matrix(parameters[i]->data.shape, 0));
+QuantizedAdam::QuantizedAdam(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float beta1, float beta2, float epsilon,
+                             float weight_decay, size_t block_size)
+: Optimizer(parameters, learning_rate), beta1(beta1), beta2(beta2), epsilon(epsilon), weight_decay(weight_decay), block_size(block_size) {
+    if (block_size == 0) {
+        throw std::runtime_error("QuantizedAdam block size must be positive.");
     }
+    for (size_t p = 0; p < parameters.size(); p++) {
+        first_block.push_back(block_offsets.size());
+        for (size_t offset = parameter_arena->offset(p); offset < parameter_arena->offset(p + 1); offset += block_size) {
+            block_offsets.push_back(offset);
+        }
+    }
+    size_t blocks = block_offsets.size();
+    first_block.push_back(blocks);
+    // The end of the last block
+    block_offsets.push_back(parameter_arena->size());
+    m = std::vector<int8_t>(parameter_arena->size(), 0);
+    v = std::vector<uint8_t>(parameter_arena->size(), 0);
+    m_scales = std::vector<float>(blocks, 0);
+    v_scales = std::vector<float>(blocks, 0);
+}
+
+void QuantizedAdam::prepare() {
+    t++;
+    step_size = learning_rate / (1.0f - std::pow(beta1, t));
+    inv_sqrt_correction2 = 1.0f / std::sqrt(1.0f - std::pow(beta2, t));
 }
 
-void RMSprop::step() {
-    for (size_t i = 0; i < parameters.size(); i++) {
-        v[i] = Matrix::add(Matrix::mul(v[i], decay), Matrix::mul(Matrix::mul(parameters[i]->grad, parameters[i]->grad), 1 - decay));
-        Matrix adaptive_learning_rate = Matrix::mul(Matrix::add(Matrix::sqrt(v[i]), epsilon), -learning_rate);
-        parameters[i]->data = Matrix::add(parameters[i]->data, Matrix::mul(parameters[i]->grad, adaptive_learning_rate)); 
+void QuantizedAdam::update(size_t first, size_t last, float scale) {
+    const float decay = 1 - weight_decay;
+    const size_t blocks_begin = first_block[first], blocks_end = first_block[last];
+    float* data = parameter_arena->data();
+    const float* grad = parameter_arena->grad();
+
+    #pragma omp parallel
+    {
+        std::vector<float> m_block(block_size), v_block(block_size);
+        #pragma omp for schedule(static)
+        for (size_t block = blocks_begin; block < blocks_end; block++) {
+            size_t begin = block_offsets[block];
+            size_t count = block_offsets[block + 1] - begin;
+            float m_max = 0, v_max = 0;
+            for (size_t i = 0; i < count; i++) {
+                float g = scale * grad[begin + i];
+                float code = m[begin + i] / 127.0f;
+                float code2 = v[begin + i] / 255.0f;
+                float m_i = beta1 * std::copysign(code * code, code) * m_scales[block] + (1 - beta1) * g;
+                float v_i = beta2 * code2 * code2 * code2 * code2 * v_scales[block] + (1 - beta2) * g * g;
+                data[begin + i] = decay * data[begin + i] - step_size * m_i / (std::sqrt(v_i) * inv_sqrt_correction2 + epsilon);
+                m_block[i] = m_i;
+                v_block[i] = v_i;
+                m_max = std::max(m_max, std::abs(m_i));
+                v_max = std::max(v_max, v_i);
+            }
+            m_scales[block] = m_max;
+            v_scales[block] = v_max;
+            float m_inv = m_max > 0 ? 1.0f / m_max : 0;
+            float v_inv = v_max > 0 ? 1.0f / v_max : 0;
+            for (size_t i = 0; i < count; i++) {
+                m[begin + i] = static_cast<int8_t>(std::lround(std::copysign(127.0f * std::sqrt(std::abs(m_block[i]) * m_inv), m_block[i])));
+                v[begin + i] = static_cast<uint8_t>(std::lround(255.0f * std::sqrt(std::sqrt(v_block[i] * v_inv))));
+            }
+        }
     }
 }
 
+size_t QuantizedAdam::state_bytes() const {
+    return m.size() * sizeof(int8_t) + v.size() * sizeof(uint8_t) + (m_scales.size() + v_scales.size()) * sizeof(float);
+}
 
 /**************************************
-                  Adam                 
+               Overshoot                 
  **************************************/
 
- Adam::Adam(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float beta1, float beta2, float epsilon): Optimizer(parameters), learning_rate(learning_rate), beta1(beta1), beta2(beta2), epsilon(epsilon) {
-    for (size_t i = 0; i < parameters.size(); i++) {
-        v.push_back(Matrix(parameters[i]->data.shape, 0));
-        m.push_back(Matrix(parameters[i]->data.shape, 0));
+Overshoot::Overshoot(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float overshoot, size_t state_slots)
+: Optimizer(parameters, learning_rate, state_slots), overshoot(overshoot) {
+    // Before the first step the base and the overshot weights coincide
+    std::copy(parameter_arena->data(), parameter_arena->data() + parameter_arena->size(), parameter_arena->state(0));
+}
+
+void Overshoot::swap_base_weights() {
+    std::swap_ranges(parameter_arena->data(), parameter_arena->data() + parameter_arena->size(), parameter_arena->state(0));
+}
+
+
+/**************************************
+           SGD with overshoot                 
+ **************************************/
+
+SGDwithOvershoot::SGDwithOvershoot(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float momentum, float overshoot)
+: Overshoot(parameters, learning_rate, overshoot, 2), momentum(momentum) {}
+
+void SGDwithOvershoot::update(size_t first, size_t last, float scale) {
+    const size_t begin = parameter_arena->offset(first), end = parameter_arena->offset(last);
+    float* data = parameter_arena->data();
+    const float* grad = parameter_arena->grad();
+    float* base = parameter_arena->state(0);
+    float* velocity = parameter_arena->state(1);
+    #pragma omp parallel for simd
+    for (size_t i = begin; i < end; i++) {
+        float g = scale * grad[i];
+        velocity[i] = momentum * velocity[i] + g;
+        base[i] -= learning_rate * velocity[i];
+        data[i] = base[i] - overshoot * learning_rate * velocity[i];
     }
- }
+}
+
+
+/**************************************
+           Adam with overshoot                 
+ **************************************/
 
- void Adam::step() {
-    for (size_t i = 0; i < parameters.size(); i++) {
-        m[i] = Matrix::add(Matrix::mul(m[i], beta1), Matrix::mul(parameters[i]->grad, 1 - beta1));
-        v[i] = Matrix::add(Matrix::mul(v[i], beta2), Matrix::mul(Matrix::mul(parameters[i]->grad, parameters[i]->grad), 1 - beta2));
-        Matrix velocity = Matrix::div(m[i], 1.0f - std::pow(beta1, t+1));
-        Matrix scaled_v = Matrix::div(v[i], 1.0f - std::pow(beta2, t+1));
-        Matrix adaptive_learning_rate = Matrix::div(-learning_rate, Matrix::add(Matrix::sqrt(scaled_v), epsilon));
-        parameters[i] ->data = Matrix::add(parameters[i]->data, Matrix::mul(adaptive_learning_rate, velocity));
-        t++;
+AdamwithOvershoot::AdamwithOvershoot(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float beta1, float beta2, float epsilon, float overshoot)
+: Overshoot(parameters, learning_rate, overshoot, 3), beta1(beta1), beta2(beta2), epsilon(epsilon) {}
+
+void AdamwithOvershoot::prepare() {
+    t++;
+    step_size = learning_rate / (1.0f - std::pow(beta1, t));
+    inv_sqrt_correction2 = 1.0f / std::sqrt(1.0f - std::pow(beta2, t));
+}
+
+void AdamwithOvershoot::update(size_t first, size_t last, float scale) {
+    const size_t begin = parameter_arena->offset(first), end = parameter_arena->offset(last);
+    float* data = parameter_arena->data();
+    const float* grad = parameter_arena->grad();
+    float* base = parameter_arena->state(0);
+    float* m = parameter_arena->state(1);
+    float* v = parameter_arena->state(2);
+    #pragma omp parallel for simd
+    for (size_t i = begin; i < end; i++) {
+        float g = scale * grad[i];
+        m[i] = beta1 * m[i] + (1 - beta1) * g;
+        v[i] = beta2 * v[i] + (1 - beta2) * g * g;
+        float update = step_size * m[i] / (std::sqrt(v[i]) * inv_sqrt_correction2 + epsilon);
+        base[i] -= update;
+        data[i] = base[i] - overshoot * update;
+    }
+}
+
+
+/**************************************
+                  LAMB                 
+ **************************************/
+
+LAMB::LAMB(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float beta1, float beta2, float epsilon, float weight_decay)
+: Optimizer(parameters, learning_rate, 2), beta1(beta1), beta2(beta2), epsilon(epsilon), weight_decay(weight_decay) {}
+
+void LAMB::prepare() {
+    t++;
+    bias_correction1 = 1.0f - std::pow(beta1, t);
+    inv_sqrt_correction2 = 1.0f / std::sqrt(1.0f - std::pow(beta2, t));
+}
+
+void LAMB::update(size_t first, size_t last, float scale) {
+    for (size_t p = first; p < last; p++) {
+        size_t offset = parameter_arena->offset(p);
+        size_t size = parameters[p]->data.rows() * parameters[p]->data.cols();
+        float* data = parameter_arena->data() + offset;
+        const float* grad = parameter_arena->grad() + offset;
+        float* m = parameter_arena->state(0) + offset;
+        float* v = parameter_arena->state(1) + offset;
+
+        float weight_norm = 0, update_norm = 0;
+        #pragma omp parallel for simd reduction(+:weight_norm, update_norm)
+        for (size_t i = 0; i < size; i++) {
+            float g = scale * grad[i];
+            m[i] = beta1 * m[i] + (1 - beta1) * g;
+            v[i] = beta2 * v[i] + (1 - beta2) * g * g;
+            float update = m[i] / bias_correction1 / (std::sqrt(v[i]) * inv_sqrt_correction2 + epsilon) + weight_decay * data[i];
+            weight_norm += data[i] * data[i];
+            update_norm += update * update;
+        }
+        weight_norm = std::sqrt(weight_norm);
+        update_norm = std::sqrt(update_norm);
+        // Tensors with zero weights, e.g. freshly initialized biases, use the plain learning rate
+        float trust_ratio = weight_norm > 0 && update_norm > 0 ? weight_norm / update_norm : 1.0f;
+        float step_size = learning_rate * trust_ratio;
+
+        #pragma omp parallel for simd
+        for (size_t i = 0; i < size; i++) {
+            float update = m[i] / bias_correction1 / (std::sqrt(v[i]) * inv_sqrt_correction2 + epsilon) + weight_decay * data[i];
+            data[i] -= step_size * update;
+        }
+    }
+}
+
+
+/**************************************
+                  LARS                 
+ **************************************/
+
+LARS::LARS(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float momentum, float weight_decay, float trust_coefficient, float epsilon)
+: Optimizer(parameters, learning_rate, 1), momentum(momentum), weight_decay(weight_decay), trust_coefficient(trust_coefficient), epsilon(epsilon) {}
+
+void LARS::update(size_t first, size_t last, float scale) {
+    for (size_t p = first; p < last; p++) {
+        size_t offset = parameter_arena->offset(p);
+        size_t size = parameters[p]->data.rows() * parameters[p]->data.cols();
+        float* data = parameter_arena->data() + offset;
+        const float* grad = parameter_arena->grad() + offset;
+        float* velocity = parameter_arena->state(0) + offset;
+
+        float weight_norm = 0, grad_norm = 0;
+        #pragma omp parallel for simd reduction(+:weight_norm, grad_norm)
+        for (size_t i = 0; i < size; i++) {
+            float g = scale * grad[i];
+            weight_norm += data[i] * data[i];
+            grad_norm += g * g;
+        }
+        weight_norm = std::sqrt(weight_norm);
+        grad_norm = std::sqrt(grad_norm);
+        float trust_ratio = weight_norm > 0 && grad_norm > 0 ? trust_coefficient * weight_norm / (grad_norm + weight_decay * weight_norm + epsilon) : 1.0f;
+        float local_learning_rate = learning_rate * trust_ratio;
+
+        #pragma omp parallel for simd
+        for (size_t i = 0; i < size; i++) {
+            float g = scale * grad[i];
+            velocity[i] = momentum * velocity[i] + local_learning_rate * (g + weight_decay * data[i]);
+            data[i] -= velocity[i];
+        }
     }
- }
+}
 
 
 /**************************************
-                  AdamW                 
+        Linear warmup scheduler                 
  **************************************/
 
-void AdamW::step() {
-    for (size_t i = 0; i < parameters.size(); ++i) {
-        parameters[i]->data = Matrix::mul(parameters[i]->data, 1 - weight_decay);
+LinearWarmupScheduler::LinearWarmupScheduler(Optimizer& optimizer, size_t warmup_steps, size_t total_steps)
+: optimizer(optimizer), peak_learning_rate(optimizer.get_learning_rate()), warmup_steps(warmup_steps), total_steps(total_steps) {
+    if (total_steps != 0 && total_steps < warmup_steps) {
+        throw std::runtime_error("The total number of steps must not be smaller than the number of warmup steps.");
     }
-    Adam::step();
-}
\ No newline at end of file
+    optimizer.set_learning_rate(learning_rate_at(0));
+}
+
+void LinearWarmupScheduler::step() {
+    steps++;
+    optimizer.set_learning_rate(learning_rate_at(steps));
+}
+
+float LinearWarmupScheduler::learning_rate_at(size_t step) const {
+    if (step < warmup_steps) {
+        return peak_learning_rate * (step + 1) / warmup_steps;
+    }
+    if (total_steps == 0) {
+        return peak_learning_rate;
+    }
+    if (step >= total_steps) {
+        return 0;
+    }
+    return peak_learning_rate * (total_steps - step) / (total_steps - warmup_steps);
+}
@@ -1,101 +1,342 @@
 #pragma once
 #include "model.hpp"
+#include "arena.hpp"
 #include <vector>
+#include <cstdint>
 
+/**
+ * @brief Base class of the optimizers
+ * The parameters, their gradients and state_slots optimizer states per parameter are moved into one ParameterArena.
+ * A parameter belongs to at most one optimizer at a time, creating a second optimizer over a parameter throws
+ * until the first optimizer has been destroyed. The values and gradients stay in the arena of the destroyed
+ * optimizer, so the next optimizer starts from the current weights.
+ *
+ * A step is split into prepare(), which runs once per step (e.g. advancing the step counter), and update(),
+ * the fused kernel over a range of parameters. step() updates all parameters in one sweep. For eager updates
+ * during the backward pass, begin_step() prepares the step and step_parameters() then updates every range
+ * of parameters as soon as its gradients are final.
+ */
 class Optimizer {
     public:
-        Optimizer(std::vector<std::shared_ptr<Parameter>> parameters): parameters(parameters) {};
-        virtual void step() = 0;
+        Optimizer(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, size_t state_slots=0)
+        : parameters(parameters), parameter_arena(std::make_shared<ParameterArena>(parameters, state_slots)), learning_rate(learning_rate) {};
+        virtual ~Optimizer() = default;
+        void step();
         void zero_grad();
+        ParameterArena& arena();
+        float get_learning_rate() const;
+        void set_learning_rate(float learning_rate);
+
+        /**
+         * @brief Start a step whose parameters are then updated range by range with step_parameters()
+         * Gradient clipping needs the global norm of all gradients, so it cannot be combined with eager updates
+         */
+        void begin_step();
+
+        /**
+         * @brief Update the parameters with the indices [first, last) of the step started by begin_step()
+         *
+         * @param first 
+         * @param last 
+         */
+        void step_parameters(size_t first, size_t last);
+
+        /**
+         * @brief Return the memory used by the optimizer states in bytes
+         *
+         * @return size_t 
+         */
+        virtual size_t state_bytes() const;
+
+        /**
+         * @brief Clip the global L2 norm of all gradients to max_norm in every following step, 0 disables clipping
+         * The gradients are not modified, the scale factor is applied inside the fused update
+         *
+         * @param max_norm 
+         */
+        void set_max_grad_norm(float max_norm);
+
+        /**
+         * @brief Return the global gradient norm before clipping of the last step, computed only with clipping enabled
+         *
+         * @return float 
+         */
+        float get_grad_norm() const;
+
+        /**
+         * @brief Keep an exponential moving average of the weights, ema = decay * ema + (1 - decay) * weights, every `every` steps
+         *
+         * The average lives in an extra state slot of the arena and is updated right after the optimizer has updated a
+         * cache-sized block of parameters, while their weights are still in cache. Call it before training, adding the
+         * slot reallocates the arena. Calling it again only changes the decay and the interval.
+         *
+         * @param decay 
+         * @param every 
+         */
+        void enable_ema(float decay, size_t every=1);
+
+        /**
+         * @brief Exchange the weights used by the layers with the moving average and back, e.g. for evaluation
+         * Only the data matrices of the parameters are pointed at the other region, nothing is copied. Steps are
+         * rejected while the average is swapped in.
+         */
+        void swap_ema_weights();
     protected:
         std::vector<std::shared_ptr<Parameter>> parameters;
+        std::shared_ptr<ParameterArena> parameter_arena;
+        float learning_rate;
+        float max_grad_norm = 0;
+        float grad_norm = 0;
+
+        float gradient_scale();
+        virtual void prepare() {}
+        virtual void update(size_t first, size_t last, float scale) = 0;
+    private:
+        bool ema_enabled = false;
+        bool ema_swapped = false;
+        bool ema_due = false;
+        float ema_decay = 0;
+        size_t ema_every = 1;
+        size_t ema_slot = 0;
+        size_t steps = 0;
+        // The blocks of parameters [ema_blocks[b], ema_blocks[b + 1]) updated together with their moving average
+        std::vector<size_t> ema_blocks;
+
+        void start_step();
+        void update_ema(size_t first, size_t last);
 };
 
 class SGD: public Optimizer {
     public:
         SGD(std::vector<std::shared_ptr<Parameter>>, float learning_rate);
-        void step() override;
-    private:
-        float learning_rate;
+    protected:
+        void update(size_t first, size_t last, float scale) override;
 };
 
 
 class SGDWithMomentum: public Optimizer {
     public:
         SGDWithMomentum(std::vector<std::shared_ptr<Parameter>>, float learning_rate, float momentum);
-        void step() override;
+    protected:
+        void update(size_t first, size_t last, float scale) override;
     private:
-        float learning_rate;
         float momentum;
-        std::vector<Matrix> velocities;
 };
 
 class AdaGrad: public Optimizer {
     public:
         AdaGrad(std::vector<std::shared_ptr<Parameter>>, float learning_rate, float epsilon);
-        void step() override;
+    protected:
+        void update(size_t first, size_t last, float scale) override;
     private:
-        float learning_rate;
         float epsilon;
-        std::vector<Matrix> squared_gradients;
 };
 
 class RMSprop: public Optimizer {
     public:
         RMSprop(std::vector<std::shared_ptr<Parameter>>, float learning_rate, float decay, float epsilon);
-        void step() override;
+    protected:
+        void update(size_t first, size_t last, float scale) override;
     private:
-        float learning_rate;
         float decay;
         float epsilon;
-        std::vector<Matrix> v;
 };
 
+/**
+ * @brief Adam with the first and second moments in the state slots 0 and 1 of the arena
+ * Every step updates all moments and weights in one fused pass and advances the step counter once
+ */
 class Adam: public Optimizer {
     public:
         Adam(std::vector<std::shared_ptr<Parameter>>, float learning_rate, float beta1, float beta2, float epsilon);
-        void step() override;
+    protected:
+        // Decoupled weight decay, zero for Adam
+        float weight_decay = 0;
+
+        void prepare() override;
+        void update(size_t first, size_t last, float scale) override;
     private:
-        float learning_rate;
         float beta1;
         float beta2;
         float epsilon;
-        std::vector<Matrix> m;
-        std::vector<Matrix> v;
         int t = 0;
+        float step_size = 0;
+        float inv_sqrt_correction2 = 0;
 }; 
 
 
 class AdamW : public Adam {
 public:
     AdamW(std::vector<std::shared_ptr<Parameter>> parameters, float learning_rate, float beta1, float beta2, float epsilon, float weight_decay)
-        : Adam(parameters, learning_rate, beta1, beta2, epsilon), weight_decay(weight_decay) {}
-
-    void step() override;
+        : Adam(parameters, learning_rate, beta1, beta2, epsilon) {
+        this->weight_decay = weight_decay;
+    }
+};
+/**
+ * @brief Lazy Adam for row-sparse parameters such as embedding tables, the moments are in the state slots 0 and 1
+ *
+ * Of a row-sparse parameter only the touched rows are updated, the moments and weights of all other rows stay
+ * untouched instead of decaying. Every row keeps its own step counter, so the bias corrections of a row depend
+ * on how often it has been updated. All other parameters are updated as by Adam. Gradient clipping still reads
+ * the whole gradient region.
+ */
+class SparseAdam: public Optimizer {
+    public:
+        SparseAdam(std::vector<std::shared_ptr<Parameter>>, float learning_rate, float beta1=0.9, float beta2=0.999, float epsilon=1e-8);
+        size_t state_bytes() const override;
+    protected:
+        void prepare() override;
+        void update(size_t first, size_t last, float scale) override;
+    private:
+        float beta1;
+        float beta2;
+        float epsilon;
+        int t = 0;
+        float step_size = 0;
+        float inv_sqrt_correction2 = 0;
+        // The number of updates of every row of the row-sparse parameters, empty for dense parameters
+        std::vector<std::vector<uint32_t>> row_steps;
+};
 
-private:
-    float weight_decay; // Specific to AdamW
+/**
+ * @brief Adam (or AdamW with weight_decay > 0) with the moments stored block-wise in 8 bits
+ *
+ * The moments of every block of block_size values are stored as 8-bit codes relative to the largest
+ * magnitude of the block. The first moment uses a signed square-root code and the second moment a
+ * fourth-root code, so small values keep a useful relative precision. The fused step dequantizes a block,
+ * updates the moments and the weights, and requantizes it with the new block maximum, which needs about
+ * a quarter of the state memory of Adam. The blocks do not cross parameter boundaries, so every parameter
+ * can be updated on its own.
+ */
+class QuantizedAdam: public Optimizer {
+    public:
+        QuantizedAdam(std::vector<std::shared_ptr<Parameter>>, float learning_rate, float beta1, float beta2, float epsilon,
+                      float weight_decay=0, size_t block_size=256);
+        size_t state_bytes() const override;
+    protected:
+        void prepare() override;
+        void update(size_t first, size_t last, float scale) override;
+    private:
+        float beta1;
+        float beta2;
+        float epsilon;
+        float weight_decay;
+        size_t block_size;
+        int t = 0;
+        float step_size = 0;
+        float inv_sqrt_correction2 = 0;
+        // The blocks of the parameter p are [first_block[p], first_block[p + 1])
+        std::vector<size_t> first_block;
+        // The start of every block followed by the end of the last one
+        std::vector<size_t> block_offsets;
+        std::vector<int8_t> m;
+        std::vector<uint8_t> v;
+        std::vector<float> m_scales;
+        std::vector<float> v_scales;
 };
+
+/**
+ * @brief Base class of the optimizers with overshoot
+ *
+ * The gradients are computed at overshot weights that lie overshoot times the last update further along
+ * the update direction than the base weights. Parameter::data holds the overshot weights used by the layers,
+ * the base weights live in the state slot 0 of the arena. Evaluation should use the base weights,
+ * swap_base_weights() exchanges them with the overshot weights and back.
+ */
 class Overshoot: public Optimizer {
     public:
-        Overshoot(std::vector<std::shared_ptr<Parameter>>, float learning_rate, float beta1, float beta2, float epsilon);
-        void step() override;
+        Overshoot(std::vector<std::shared_ptr<Parameter>>, float learning_rate, float overshoot, size_t state_slots);
+        void swap_base_weights();
+    protected:
+        float overshoot;
+};
+
+/**
+ * @brief SGD with momentum and overshoot, the momentum buffer is in the state slot 1
+ */
+class SGDwithOvershoot: public Overshoot {
+    public:
+        SGDwithOvershoot(std::vector<std::shared_ptr<Parameter>>, float learning_rate, float momentum, float overshoot=5);
+    protected:
+        void update(size_t first, size_t last, float scale) override;
     private:
-        float learning_rate;
+        float momentum;
 };
 
-class SGDwithOvershoot: public Optimizer {
+/**
+ * @brief Adam with overshoot, the moments are in the state slots 1 and 2
+ */
+class AdamwithOvershoot: public Overshoot {
     public:
-        SGDwithOvershoot(std::vector<std::shared_ptr<Parameter>>, float learning_rate, float beta1, float beta2, float epsilon);
-        void step() override;
+        AdamwithOvershoot(std::vector<std::shared_ptr<Parameter>>, float learning_rate, float beta1, float beta2, float epsilon, float overshoot=3);
+    protected:
+        void prepare() override;
+        void update(size_t first, size_t last, float scale) override;
     private:
-        float learning_rate;
+        float beta1;
+        float beta2;
+        float epsilon;
+        int t = 0;
+        float step_size = 0;
+        float inv_sqrt_correction2 = 0;
+};
+
+/**
+ * @brief LAMB, Adam with a layer-wise trust ratio for large batches, the moments are in the state slots 0 and 1
+ *
+ * Per parameter tensor the Adam direction r = m_hat / (sqrt(v_hat) + epsilon) + weight_decay * w is scaled
+ * by the trust ratio ||w|| / ||r||. The first pass over a tensor updates the moments and reduces both norms,
+ * the second pass recomputes r and updates the weights.
+ */
+class LAMB: public Optimizer {
+    public:
+        LAMB(std::vector<std::shared_ptr<Parameter>>, float learning_rate, float beta1=0.9, float beta2=0.999, float epsilon=1e-6, float weight_decay=0.01);
+    protected:
+        void prepare() override;
+        void update(size_t first, size_t last, float scale) override;
+    private:
+        float beta1;
+        float beta2;
+        float epsilon;
+        float weight_decay;
+        int t = 0;
+        float bias_correction1 = 0;
+        float inv_sqrt_correction2 = 0;
+};
+
+/**
+ * @brief LARS, SGD with momentum and a layer-wise learning rate for large batches, the velocity is in the state slot 0
+ *
+ * Per parameter tensor the learning rate is scaled by trust_coefficient * ||w|| / (||g|| + weight_decay * ||w||),
+ * with both norms reduced in one pass before the update pass.
+ */
+class LARS: public Optimizer {
+    public:
+        LARS(std::vector<std::shared_ptr<Parameter>>, float learning_rate, float momentum=0.9, float weight_decay=0, float trust_coefficient=0.001, float epsilon=1e-9);
+    protected:
+        void update(size_t first, size_t last, float scale) override;
+    private:
+        float momentum;
+        float weight_decay;
+        float trust_coefficient;
+        float epsilon;
 };
 
-class AdamwithOvershoot: public Optimizer {
+/**
+ * @brief Learning rate schedule with a linear warmup from zero to the initial learning rate of the optimizer
+ * When total_steps is given, the learning rate then decays linearly back to zero at total_steps.
+ * Call step() once after every optimizer step.
+ */
+class LinearWarmupScheduler {
     public:
-        AdamwithOvershoot(std::vector<std::shared_ptr<Parameter>>, float learning_rate, float beta1, float beta2, float epsilon);
-        void step() override;
+        LinearWarmupScheduler(Optimizer& optimizer, size_t warmup_steps, size_t total_steps=0);
+        void step();
     private:
-        float learning_rate;
-};
\ No newline at end of file
+        Optimizer& optimizer;
+        float peak_learning_rate;
+        size_t warmup_steps;
+        size_t total_steps;
+        size_t steps = 0;
+
+        float learning_rate_at(size_t step) const;
+};
@@ -0,0 +1,366 @@
+#include "recurrent.hpp"
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+Matrix initialize_weights(size_t rows, size_t cols, float min, float max);
+void gemm_accumulate(const float* A, const float* B, float* C, size_t M, size_t K, size_t N);
+void gemm_transposed_accumulate(const float* A, const float* B, float* C, size_t M, size_t K, size_t N);
+
+inline float sigmoid(float x) {
+    return 1.0f / (1.0f + std::exp(-x));
+}
+
+/************************************************
+ *                  Recurrent                   *
+ ************************************************/
+
+RecurrentLayer::RecurrentLayer(size_t sequence_length, size_t input_size, size_t hidden_size, size_t gates, bool return_sequences)
+: sequence_length(sequence_length), input_size(input_size), hidden_size(hidden_size), gates(gates), return_sequences(return_sequences) {
+    if (sequence_length == 0 || hidden_size == 0) {
+        throw std::runtime_error("Recurrent layers need a positive sequence length and hidden size.");
+    }
+    float bound = 1.0f / std::sqrt(static_cast<float>(hidden_size));
+    input_weights = std::make_shared<Parameter>(Parameter(initialize_weights(input_size, gates * hidden_size, -bound, bound)));
+    hidden_weights = std::make_shared<Parameter>(Parameter(initialize_weights(hidden_size, gates * hidden_size, -bound, bound)));
+    biases = std::make_shared<Parameter>(Parameter(initialize_weights(1, gates * hidden_size, -bound, bound)));
+}
+
+std::vector<std::shared_ptr<Parameter>> RecurrentLayer::parameters() {
+    return {input_weights, hidden_weights, biases};
+}
+
+/**
+ * @brief Replace the parameters of a copied layer by copies of them
+ */
+void RecurrentLayer::copy_parameters() {
+    input_weights = std::make_shared<Parameter>(*input_weights);
+    hidden_weights = std::make_shared<Parameter>(*hidden_weights);
+    biases = std::make_shared<Parameter>(*biases);
+}
+
+/**
+ * @brief Store the input in time-major order and compute the input projection of all steps with one GEMM
+ *
+ * @return Matrix (sequence_length * batch) x (gates * hidden_size) pre-activations without the recurrent term
+ */
+Matrix RecurrentLayer::project_inputs(Matrix& input) {
+    if (input.cols() != sequence_length * input_size) {
+        throw std::runtime_error("Recurrent layer received input with " + std::to_string(input.cols()) +
+                                 " columns, expected " + std::to_string(sequence_length * input_size));
+    }
+    if (input.is_transposed()) {
+        input = input.contiguous();
+    }
+    size_t batch_size = input.rows();
+    this->inputs = Matrix(sequence_length * batch_size, input_size, 0);
+    const float* src = input.raw();
+    float* dst = inputs.raw();
+    #pragma omp parallel for collapse(2)
+    for (size_t t = 0; t < sequence_length; t++) {
+        for (size_t n = 0; n < batch_size; n++) {
+            std::copy(src + (n * sequence_length + t) * input_size, src + (n * sequence_length + t + 1) * input_size,
+                      dst + (t * batch_size + n) * input_size);
+        }
+    }
+    this->hidden = Matrix((sequence_length + 1) * batch_size, hidden_size, 0);
+    return Matrix::colwise_add(Matrix::matMul(inputs, input_weights->data), biases->data);
+}
+
+Matrix RecurrentLayer::collect_output(size_t batch_size) {
+    const float* src = hidden.raw();
+    if (!return_sequences) {
+        const float* last = src + sequence_length * batch_size * hidden_size;
+        return Matrix(batch_size, hidden_size, std::vector<float>(last, last + batch_size * hidden_size));
+    }
+    Matrix output(batch_size, sequence_length * hidden_size, 0);
+    float* dst = output.raw();
+    #pragma omp parallel for collapse(2)
+    for (size_t n = 0; n < batch_size; n++) {
+        for (size_t t = 0; t < sequence_length; t++) {
+            std::copy(src + ((t + 1) * batch_size + n) * hidden_size, src + ((t + 1) * batch_size + n + 1) * hidden_size,
+                      dst + (n * sequence_length + t) * hidden_size);
+        }
+    }
+    return output;
+}
+
+/**
+ * @brief Add the gradient of the layer output at the given step to the hidden state gradient
+ */
+void RecurrentLayer::add_output_gradient(Matrix& output_gradient, float* hidden_gradient, size_t step) {
+    size_t batch_size = output_gradient.rows();
+    if (!return_sequences && step + 1 != sequence_length) {
+        return;
+    }
+    size_t offset = return_sequences ? step * hidden_size : 0;
+    size_t row_size = output_gradient.cols();
+    const float* src = output_gradient.raw();
+    #pragma omp parallel for
+    for (size_t n = 0; n < batch_size; n++) {
+        for (size_t k = 0; k < hidden_size; k++) {
+            hidden_gradient[n * hidden_size + k] += src[n * row_size + offset + k];
+        }
+    }
+}
+
+/**
+ * @brief Accumulate the weight gradients of all steps with one GEMM each and return the input gradient
+ *
+ * @param input_gate_gradient gradient of the gate pre-activations w.r.t. the input projection
+ * @param hidden_gate_gradient gradient of the gate pre-activations w.r.t. the recurrent projection
+ */
+Matrix RecurrentLayer::finish_backward(Matrix& input_gate_gradient, Matrix& hidden_gate_gradient) {
+    size_t batch_size = input_gate_gradient.rows() / sequence_length;
+    Matrix::add_inplace(input_weights->grad, Matrix::matMul(inputs.transpose(), input_gate_gradient));
+    Matrix::add_inplace(biases->grad, Matrix::colwise_sum(input_gate_gradient));
+
+    // Hidden states 0 .. T-1 are the recurrent inputs of steps 1 .. T
+    const float* h = hidden.raw();
+    Matrix previous_hidden(sequence_length * batch_size, hidden_size, std::vector<float>(h, h + sequence_length * batch_size * hidden_size));
+    Matrix::add_inplace(hidden_weights->grad, Matrix::matMul(previous_hidden.transpose(), hidden_gate_gradient));
+
+    Matrix input_gradient = Matrix::matMul(input_gate_gradient, input_weights->data.transpose());
+    Matrix result(batch_size, sequence_length * input_size, 0);
+    const float* src = input_gradient.raw();
+    float* dst = result.raw();
+    #pragma omp parallel for collapse(2)
+    for (size_t t = 0; t < sequence_length; t++) {
+        for (size_t n = 0; n < batch_size; n++) {
+            std::copy(src + (t * batch_size + n) * input_size, src + (t * batch_size + n + 1) * input_size,
+                      dst + (n * sequence_length + t) * input_size);
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief C += A * B for row-major A (M x K), B (K x N) and C (M x N)
+ */
+void gemm_accumulate(const float* A, const float* B, float* C, size_t M, size_t K, size_t N) {
+    #pragma omp parallel for
+    for (size_t i = 0; i < M; i++) {
+        for (size_t k = 0; k < K; k++) {
+            float a = A[i * K + k];
+            for (size_t j = 0; j < N; j++) {
+                C[i * N + j] += a * B[k * N + j];
+            }
+        }
+    }
+}
+
+/**
+ * @brief C += A * B^T for row-major A (M x K), B (N x K) and C (M x N)
+ */
+void gemm_transposed_accumulate(const float* A, const float* B, float* C, size_t M, size_t K, size_t N) {
+    #pragma omp parallel for
+    for (size_t i = 0; i < M; i++) {
+        for (size_t j = 0; j < N; j++) {
+            float sum = 0;
+            for (size_t k = 0; k < K; k++) {
+                sum += A[i * K + k] * B[j * K + k];
+            }
+            C[i * N + j] += sum;
+        }
+    }
+}
+
+/************************************************
+ *                    LSTM                      *
+ ************************************************/
+
+LSTMLayer::LSTMLayer(size_t sequence_length, size_t input_size, size_t hidden_size, bool return_sequences)
+: RecurrentLayer(sequence_length, input_size, hidden_size, 4, return_sequences) {
+    // A positive forget gate bias keeps the cell state alive early in training
+    for (size_t k = 0; k < hidden_size; k++) {
+        biases->data[0, hidden_size + k] = 1.0f;
+    }
+}
+
+std::shared_ptr<Model> LSTMLayer::clone() {
+    auto copy = std::make_shared<LSTMLayer>(*this);
+    copy->copy_parameters();
+    return copy;
+}
+
+Matrix LSTMLayer::forward(Matrix input, bool training) {
+    size_t batch_size = input.rows();
+    size_t H = hidden_size, G = gates * hidden_size;
+    this->gate_values = project_inputs(input);
+    this->cell = Matrix((sequence_length + 1) * batch_size, H, 0);
+
+    for (size_t t = 0; t < sequence_length; t++) {
+        float* step_gates = gate_values.raw() + t * batch_size * G;
+        const float* h_prev = hidden.raw() + t * batch_size * H;
+        const float* c_prev = cell.raw() + t * batch_size * H;
+        float* h = hidden.raw() + (t + 1) * batch_size * H;
+        float* c = cell.raw() + (t + 1) * batch_size * H;
+        gemm_accumulate(h_prev, hidden_weights->data.raw(), step_gates, batch_size, H, G);
+
+        // Gate nonlinearities and the cell update in one sweep, activated gates overwrite the pre-activations
+        #pragma omp parallel for
+        for (size_t n = 0; n < batch_size; n++) {
+            float* row = step_gates + n * G;
+            for (size_t k = 0; k < H; k++) {
+                float i = sigmoid(row[k]);
+                float f = sigmoid(row[H + k]);
+                float g = std::tanh(row[2 * H + k]);
+                float o = sigmoid(row[3 * H + k]);
+                row[k] = i;
+                row[H + k] = f;
+                row[2 * H + k] = g;
+                row[3 * H + k] = o;
+                float c_new = f * c_prev[n * H + k] + i * g;
+                c[n * H + k] = c_new;
+                h[n * H + k] = o * std::tanh(c_new);
+            }
+        }
+    }
+    return collect_output(batch_size);
+}
+
+Matrix LSTMLayer::backward(Matrix loss_gradient) {
+    if (loss_gradient.is_transposed()) {
+        loss_gradient = loss_gradient.contiguous();
+    }
+    size_t batch_size = loss_gradient.rows();
+    size_t H = hidden_size, G = gates * hidden_size;
+    Matrix gate_gradient(sequence_length * batch_size, G, 0);
+    // Gradients flowing into the previous step, reused by every step
+    std::vector<float> hidden_gradient(batch_size * H, 0);
+    std::vector<float> cell_gradient(batch_size * H, 0);
+
+    size_t t = sequence_length;
+    while (t > 0) {
+        t--;
+        add_output_gradient(loss_gradient, hidden_gradient.data(), t);
+        const float* step_gates = gate_values.raw() + t * batch_size * G;
+        const float* c_prev = cell.raw() + t * batch_size * H;
+        const float* c = cell.raw() + (t + 1) * batch_size * H;
+        float* step_gradient = gate_gradient.raw() + t * batch_size * G;
+
+        #pragma omp parallel for
+        for (size_t n = 0; n < batch_size; n++) {
+            const float* row = step_gates + n * G;
+            float* d_row = step_gradient + n * G;
+            for (size_t k = 0; k < H; k++) {
+                float i = row[k], f = row[H + k], g = row[2 * H + k], o = row[3 * H + k];
+                float tanh_c = std::tanh(c[n * H + k]);
+                float d_h = hidden_gradient[n * H + k];
+                float d_c = cell_gradient[n * H + k] + d_h * o * (1 - tanh_c * tanh_c);
+                d_row[k] = d_c * g * i * (1 - i);
+                d_row[H + k] = d_c * c_prev[n * H + k] * f * (1 - f);
+                d_row[2 * H + k] = d_c * i * (1 - g * g);
+                d_row[3 * H + k] = d_h * tanh_c * o * (1 - o);
+                cell_gradient[n * H + k] = d_c * f;
+            }
+        }
+        std::fill(hidden_gradient.begin(), hidden_gradient.end(), 0.0f);
+        gemm_transposed_accumulate(step_gradient, hidden_weights->data.raw(), hidden_gradient.data(), batch_size, G, H);
+    }
+    return finish_backward(gate_gradient, gate_gradient);
+}
+
+/************************************************
+ *                     GRU                      *
+ ************************************************/
+
+GRULayer::GRULayer(size_t sequence_length, size_t input_size, size_t hidden_size, bool return_sequences)
+: RecurrentLayer(sequence_length, input_size, hidden_size, 3, return_sequences) {
+    float bound = 1.0f / std::sqrt(static_cast<float>(hidden_size));
+    hidden_biases = std::make_shared<Parameter>(Parameter(initialize_weights(1, gates * hidden_size, -bound, bound)));
+}
+
+std::vector<std::shared_ptr<Parameter>> GRULayer::parameters() {
+    return {input_weights, hidden_weights, biases, hidden_biases};
+}
+
+std::shared_ptr<Model> GRULayer::clone() {
+    auto copy = std::make_shared<GRULayer>(*this);
+    copy->copy_parameters();
+    copy->hidden_biases = std::make_shared<Parameter>(*hidden_biases);
+    return copy;
+}
+
+Matrix GRULayer::forward(Matrix input, bool training) {
+    size_t batch_size = input.rows();
+    size_t H = hidden_size, G = gates * hidden_size;
+    this->gate_values = project_inputs(input);
+    this->hidden_candidate = Matrix(sequence_length * batch_size, H, 0);
+    std::vector<float> hidden_projection(batch_size * G);
+
+    for (size_t t = 0; t < sequence_length; t++) {
+        float* step_gates = gate_values.raw() + t * batch_size * G;
+        const float* h_prev = hidden.raw() + t * batch_size * H;
+        float* h = hidden.raw() + (t + 1) * batch_size * H;
+        float* candidate = hidden_candidate.raw() + t * batch_size * H;
+        for (size_t n = 0; n < batch_size; n++) {
+            std::copy(hidden_biases->data.raw(), hidden_biases->data.raw() + G, hidden_projection.data() + n * G);
+        }
+        gemm_accumulate(h_prev, hidden_weights->data.raw(), hidden_projection.data(), batch_size, H, G);
+
+        #pragma omp parallel for
+        for (size_t n = 0; n < batch_size; n++) {
+            float* row = step_gates + n * G;
+            const float* hidden_row = hidden_projection.data() + n * G;
+            for (size_t k = 0; k < H; k++) {
+                float r = sigmoid(row[k] + hidden_row[k]);
+                float z = sigmoid(row[H + k] + hidden_row[H + k]);
+                float c = std::tanh(row[2 * H + k] + r * hidden_row[2 * H + k]);
+                row[k] = r;
+                row[H + k] = z;
+                row[2 * H + k] = c;
+                candidate[n * H + k] = hidden_row[2 * H + k];
+                h[n * H + k] = (1 - z) * c + z * h_prev[n * H + k];
+            }
+        }
+    }
+    return collect_output(batch_size);
+}
+
+Matrix GRULayer::backward(Matrix loss_gradient) {
+    if (loss_gradient.is_transposed()) {
+        loss_gradient = loss_gradient.contiguous();
+    }
+    size_t batch_size = loss_gradient.rows();
+    size_t H = hidden_size, G = gates * hidden_size;
+    Matrix input_gate_gradient(sequence_length * batch_size, G, 0);
+    Matrix hidden_gate_gradient(sequence_length * batch_size, G, 0);
+    std::vector<float> hidden_gradient(batch_size * H, 0);
+
+    size_t t = sequence_length;
+    while (t > 0) {
+        t--;
+        add_output_gradient(loss_gradient, hidden_gradient.data(), t);
+        const float* step_gates = gate_values.raw() + t * batch_size * G;
+        const float* h_prev = hidden.raw() + t * batch_size * H;
+        const float* candidate = hidden_candidate.raw() + t * batch_size * H;
+        float* step_input_gradient = input_gate_gradient.raw() + t * batch_size * G;
+        float* step_hidden_gradient = hidden_gate_gradient.raw() + t * batch_size * G;
+
+        #pragma omp parallel for
+        for (size_t n = 0; n < batch_size; n++) {
+            const float* row = step_gates + n * G;
+            float* d_input = step_input_gradient + n * G;
+            float* d_hidden = step_hidden_gradient + n * G;
+            for (size_t k = 0; k < H; k++) {
+                float r = row[k], z = row[H + k], c = row[2 * H + k];
+                float d_h = hidden_gradient[n * H + k];
+                float d_c = d_h * (1 - z) * (1 - c * c);
+                float d_z = d_h * (h_prev[n * H + k] - c) * z * (1 - z);
+                float d_r = d_c * candidate[n * H + k] * r * (1 - r);
+                d_input[k] = d_r;
+                d_input[H + k] = d_z;
+                d_input[2 * H + k] = d_c;
+                d_hidden[k] = d_r;
+                d_hidden[H + k] = d_z;
+                d_hidden[2 * H + k] = d_c * r;
+                // Direct path through h = (1 - z) * c + z * h_prev, the recurrent GEMM is added below
+                hidden_gradient[n * H + k] = d_h * z;
+            }
+        }
+        gemm_transposed_accumulate(step_hidden_gradient, hidden_weights->data.raw(), hidden_gradient.data(), batch_size, G, H);
+    }
+    Matrix::add_inplace(hidden_biases->grad, Matrix::colwise_sum(hidden_gate_gradient));
+    return finish_backward(input_gate_gradient, hidden_gate_gradient);
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include "matrix.hpp"
+#include "model.hpp"
+
+#include <memory>
+
+
+/**
+ * @brief Common base of the recurrent layers
+ *
+ * Every row of the input holds one sequence of sequence_length steps with input_size features each.
+ * The output is either the last hidden state (batch x hidden_size) or, with return_sequences,
+ * all hidden states (batch x sequence_length * hidden_size).
+ *
+ * The input projection of all gates is computed for the whole sequence with one GEMM up front,
+ * so each step only needs a single (batch x hidden) * (hidden x gates * hidden) GEMM.
+ */
+class RecurrentLayer : public Model {
+    public:
+        RecurrentLayer(size_t sequence_length, size_t input_size, size_t hidden_size, size_t gates, bool return_sequences);
+        std::vector<std::shared_ptr<Parameter>> parameters() override;
+    protected:
+        size_t sequence_length;
+        size_t input_size;
+        size_t hidden_size;
+        size_t gates;
+        bool return_sequences;
+        std::shared_ptr<Parameter> input_weights;
+        std::shared_ptr<Parameter> hidden_weights;
+        std::shared_ptr<Parameter> biases;
+        // Time-major copy of the input, row t * batch + n holds step t of sequence n
+        Matrix inputs;
+        // Hidden states of all steps including the initial zero state, time-major
+        Matrix hidden;
+
+        Matrix project_inputs(Matrix& input);
+        Matrix collect_output(size_t batch_size);
+        void add_output_gradient(Matrix& output_gradient, float* hidden_gradient, size_t step);
+        Matrix finish_backward(Matrix& input_gate_gradient, Matrix& hidden_gate_gradient);
+        void copy_parameters();
+};
+
+/**
+ * @brief A class to represent a long short-term memory layer
+ * The four gates are ordered input, forget, cell, output in the concatenated weight matrices
+ */
+class LSTMLayer : public RecurrentLayer {
+    public:
+        LSTMLayer(size_t sequence_length, size_t input_size, size_t hidden_size, bool return_sequences=false);
+        Matrix forward(Matrix input, bool training=true) override;
+        Matrix backward(Matrix output_gradient) override;
+        std::shared_ptr<Model> clone() override;
+    private:
+        // Activated gates of all steps
+        Matrix gate_values;
+        // Cell states of all steps including the initial zero state
+        Matrix cell;
+};
+
+/**
+ * @brief A class to represent a gated recurrent unit layer
+ * The three gates are ordered reset, update, candidate in the concatenated weight matrices
+ */
+class GRULayer : public RecurrentLayer {
+    public:
+        GRULayer(size_t sequence_length, size_t input_size, size_t hidden_size, bool return_sequences=false);
+        Matrix forward(Matrix input, bool training=true) override;
+        Matrix backward(Matrix output_gradient) override;
+        std::vector<std::shared_ptr<Parameter>> parameters() override;
+        std::shared_ptr<Model> clone() override;
+    private:
+        // The candidate gate applies the reset gate to the hidden projection only, so it needs its own bias
+        std::shared_ptr<Parameter> hidden_biases;
+        Matrix gate_values;
+        // Hidden projection of the candidate gate of all steps, needed for the reset gate gradient
+        Matrix hidden_candidate;
+};
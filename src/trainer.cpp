@@ -0,0 +1,717 @@
+#include "trainer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <omp.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <future>
+#include <exception>
+#include <pthread.h>
+#include <sched.h>
+
+float coasting_distance(float momentum, uint32_t batches);
+
+/**************************************
+                Trainer
+ **************************************/
+
+Trainer::Trainer(Model& model, Optimizer& optimizer, Loss& loss) : model(model), optimizer(optimizer), loss(loss) {}
+
+float Trainer::train_step(Matrix inputs, Matrix targets) {
+    optimizer.zero_grad();
+    Matrix output = model.forward(inputs);
+    float error = loss.compute_error(targets, output);
+    model.backward(loss.compute_error_derivative(targets, output));
+    optimizer.step();
+    return error;
+}
+
+/**************************************
+             Eager trainer
+ **************************************/
+
+EagerTrainer::EagerTrainer(Sequential& model, Optimizer& optimizer, Loss& loss, bool helper_thread)
+: Trainer(model, optimizer, loss), sequential(model), helper_thread(helper_thread) {
+    const std::vector<std::shared_ptr<Parameter>>& optimized = optimizer.arena().parameters();
+    size_t count = 0;
+    for (size_t i = 0; i < model.size(); i++) {
+        first_parameter.push_back(count);
+        for (auto& parameter : model.layer(i).parameters()) {
+            if (count >= optimized.size() || optimized[count] != parameter) {
+                throw std::runtime_error("EagerTrainer needs an optimizer over the parameters of the model in their order.");
+            }
+            count++;
+        }
+    }
+    first_parameter.push_back(count);
+    if (count != optimized.size()) {
+        throw std::runtime_error("EagerTrainer needs an optimizer over the parameters of the model in their order.");
+    }
+
+    if (helper_thread) {
+        helper = std::thread(&EagerTrainer::run_helper, this);
+    }
+    sequential.set_backward_hook([this](size_t layer) {
+        if (!this->helper_thread) {
+            update_layer(layer);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(layer);
+        }
+        work_ready.notify_one();
+    });
+}
+
+EagerTrainer::~EagerTrainer() {
+    sequential.set_backward_hook(nullptr);
+    if (helper.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        work_ready.notify_one();
+        helper.join();
+    }
+}
+
+float EagerTrainer::train_step(Matrix inputs, Matrix targets) {
+    optimizer.zero_grad();
+    Matrix output = model.forward(inputs);
+    float error = loss.compute_error(targets, output);
+    optimizer.begin_step();
+    model.backward(loss.compute_error_derivative(targets, output));
+    if (helper_thread) {
+        // The next forward pass must see all updated weights
+        std::unique_lock<std::mutex> lock(mutex);
+        work_done.wait(lock, [this] { return pending.empty() && !updating; });
+        if (helper_error) {
+            std::exception_ptr exception = helper_error;
+            helper_error = nullptr;
+            std::rethrow_exception(exception);
+        }
+    }
+    return error;
+}
+
+void EagerTrainer::update_layer(size_t layer) {
+    if (first_parameter[layer] < first_parameter[layer + 1]) {
+        optimizer.step_parameters(first_parameter[layer], first_parameter[layer + 1]);
+    }
+}
+
+void EagerTrainer::run_helper() {
+    // The updates are memory bound and run next to the parallel backward pass, so a single thread is enough
+    omp_set_num_threads(1);
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        work_ready.wait(lock, [this] { return stop || !pending.empty(); });
+        if (pending.empty()) {
+            return;
+        }
+        size_t layer = pending.front();
+        pending.pop_front();
+        updating = true;
+        lock.unlock();
+        try {
+            update_layer(layer);
+        } catch (...) {
+            lock.lock();
+            helper_error = std::current_exception();
+            lock.unlock();
+        }
+        lock.lock();
+        updating = false;
+        if (pending.empty()) {
+            work_done.notify_all();
+        }
+    }
+}
+
+/**************************************
+     Gradient accumulation trainer
+ **************************************/
+
+GradientAccumulationTrainer::GradientAccumulationTrainer(Model& model, Optimizer& optimizer, Loss& loss, size_t micro_batch_size, bool prefetch)
+: Trainer(model, optimizer, loss), micro_batch_size(micro_batch_size), prefetch(prefetch) {
+    if (micro_batch_size == 0) {
+        throw std::runtime_error("GradientAccumulationTrainer micro-batch size must be positive.");
+    }
+}
+
+float GradientAccumulationTrainer::train_step(Matrix inputs, Matrix targets) {
+    if (inputs.rows() != targets.rows()) {
+        throw std::runtime_error("Inputs and targets must have the same number of rows.");
+    }
+    size_t batch_size = inputs.rows();
+    size_t micro_batches = (batch_size + micro_batch_size - 1) / micro_batch_size;
+    return train_step([&](size_t k) {
+        size_t begin = k * micro_batch_size;
+        size_t end = std::min(batch_size, begin + micro_batch_size);
+        return std::make_pair(Matrix::slice_rows(inputs, begin, end), Matrix::slice_rows(targets, begin, end));
+    }, micro_batches);
+}
+
+float GradientAccumulationTrainer::train_step(MicroBatchSource source, size_t micro_batches) {
+    if (micro_batches == 0) {
+        throw std::runtime_error("A logical batch needs at least one micro-batch.");
+    }
+    optimizer.zero_grad();
+    float error = 0;
+    size_t rows = 0;
+    std::pair<Matrix, Matrix> batch = source(0);
+    for (size_t k = 0; k < micro_batches; k++) {
+        std::future<std::pair<Matrix, Matrix>> next;
+        if (prefetch && k + 1 < micro_batches) {
+            next = std::async(std::launch::async, source, k + 1);
+        }
+        auto& [micro_inputs, micro_targets] = batch;
+        if (micro_inputs.rows() != micro_targets.rows()) {
+            throw std::runtime_error("Inputs and targets must have the same number of rows.");
+        }
+        Matrix output = model.forward(micro_inputs);
+        error += loss.compute_error(micro_targets, output) * micro_inputs.rows();
+        rows += micro_inputs.rows();
+        model.backward(loss.compute_error_derivative(micro_targets, output));
+        if (k + 1 < micro_batches) {
+            batch = prefetch ? next.get() : source(k + 1);
+        }
+    }
+    optimizer.step();
+    return error / rows;
+}
+
+/**************************************
+          Data parallel trainer
+ **************************************/
+
+DataParallelTrainer::DataParallelTrainer(Model& model, Optimizer& optimizer, Loss& loss, size_t num_workers)
+: Trainer(model, optimizer, loss), num_workers(num_workers), parameters(model.parameters()) {
+    if (num_workers == 0) {
+        throw std::runtime_error("DataParallelTrainer needs at least one worker.");
+    }
+    for (size_t worker = 0; worker < num_workers; worker++) {
+        replicas.push_back(model.clone());
+        replica_parameters.push_back(replicas.back()->parameters());
+    }
+
+    // 4096 floats fill a 16 KiB chunk, small enough to stay in L1 while all replicas are added to it
+    const size_t chunk_size = 4096;
+    for (size_t i = 0; i < parameters.size(); i++) {
+        size_t size = parameters[i]->data.rows() * parameters[i]->data.cols();
+        for (size_t begin = 0; begin < size; begin += chunk_size) {
+            chunks.push_back({i, begin, std::min(size, begin + chunk_size)});
+        }
+    }
+}
+
+float DataParallelTrainer::train_step(Matrix inputs, Matrix targets) {
+    if (inputs.rows() != targets.rows()) {
+        throw std::runtime_error("Inputs and targets must have the same number of rows.");
+    }
+    size_t batch_size = inputs.rows();
+    std::vector<float> losses(num_workers, 0);
+    // An exception must not leave the parallel region, the first one is rethrown after it
+    std::exception_ptr failure;
+
+    #pragma omp parallel num_threads(num_workers)
+    {
+        // The model may have been modified since the last step, e.g. by the optimizer
+        #pragma omp for schedule(static)
+        for (size_t i = 0; i < chunks.size(); i++) {
+            broadcast_chunk(chunks[i]);
+        }
+
+        // With fewer threads than requested workers, a thread simply processes several shards
+        #pragma omp for schedule(static, 1)
+        for (size_t worker = 0; worker < num_workers; worker++) {
+            size_t begin = worker * batch_size / num_workers;
+            size_t end = (worker + 1) * batch_size / num_workers;
+            for (auto& parameter : replica_parameters[worker]) {
+                parameter->grad.set_all(0);
+                parameter->touched_rows.clear();
+            }
+            if (begin == end) {
+                continue;
+            }
+            Matrix shard_inputs = Matrix::slice_rows(inputs, begin, end);
+            Matrix shard_targets = Matrix::slice_rows(targets, begin, end);
+            Model& replica = *replicas[worker];
+            try {
+                Matrix output = replica.forward(shard_inputs);
+                losses[worker] = loss.compute_error(shard_targets, output) * (end - begin);
+                replica.backward(loss.compute_error_derivative(shard_targets, output));
+            } catch (...) {
+                #pragma omp critical
+                {
+                    if (!failure) {
+                        failure = std::current_exception();
+                    }
+                }
+            }
+        }
+
+        #pragma omp for schedule(static)
+        for (size_t i = 0; i < chunks.size(); i++) {
+            all_reduce_chunk(chunks[i]);
+        }
+    }
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+    for (size_t i = 0; i < parameters.size(); i++) {
+        if (parameters[i]->row_sparse) {
+            parameters[i]->touched_rows.clear();
+            for (auto& replica : replica_parameters) {
+                parameters[i]->touch_rows(replica[i]->touched_rows);
+            }
+        }
+    }
+
+    optimizer.step();
+
+    float total = 0;
+    for (float worker_loss : losses) {
+        total += worker_loss;
+    }
+    return total / batch_size;
+}
+
+/**
+ * @brief Overwrite a chunk of the model gradients with the sum of the replica gradients
+ * The loss derivatives are summed over rows, so the sum over shards equals the full batch gradient
+ */
+void DataParallelTrainer::all_reduce_chunk(const Chunk& chunk) {
+    float* destination = parameters[chunk.parameter]->grad.raw();
+    const float* first = replica_parameters[0][chunk.parameter]->grad.raw();
+    std::copy(first + chunk.begin, first + chunk.end, destination + chunk.begin);
+    for (size_t worker = 1; worker < num_workers; worker++) {
+        const float* source = replica_parameters[worker][chunk.parameter]->grad.raw();
+        #pragma omp simd
+        for (size_t i = chunk.begin; i < chunk.end; i++) {
+            destination[i] += source[i];
+        }
+    }
+}
+
+void DataParallelTrainer::broadcast_chunk(const Chunk& chunk) {
+    const float* source = parameters[chunk.parameter]->data.raw();
+    for (size_t worker = 0; worker < num_workers; worker++) {
+        float* destination = replica_parameters[worker][chunk.parameter]->data.raw();
+        std::copy(source + chunk.begin, source + chunk.end, destination + chunk.begin);
+    }
+}
+
+/**************************************
+            Hogwild trainer
+ **************************************/
+
+HogwildTrainer::HogwildTrainer(Model& model, Loss& loss, size_t num_workers, float learning_rate, float momentum)
+: model(model), loss(loss), num_workers(num_workers), learning_rate(learning_rate), momentum(momentum), parameters(model.parameters()),
+  worker_batches(num_workers, 0) {
+    if (num_workers == 0) {
+        throw std::runtime_error("HogwildTrainer needs at least one worker.");
+    }
+    for (size_t worker = 0; worker < num_workers; worker++) {
+        replicas.push_back(model.clone());
+        replica_parameters.push_back(replicas.back()->parameters());
+        velocities.push_back({});
+        velocity_batches.push_back({});
+        for (auto& parameter : parameters) {
+            velocities.back().push_back(Matrix(parameter->data.shape, 0));
+            velocity_batches.back().push_back(std::vector<uint32_t>(momentum != 0 ? parameter->data.rows() * parameter->data.cols() : 0, 0));
+        }
+    }
+}
+
+EpochStats HogwildTrainer::train_epoch(const std::vector<Matrix>& inputs, const std::vector<Matrix>& targets) {
+    if (inputs.size() != targets.size()) {
+        throw std::runtime_error("Every input batch needs a target batch.");
+    }
+    std::atomic<size_t> next_batch = 0;
+    std::vector<float> losses(num_workers, 0);
+    std::vector<size_t> samples(num_workers, 0);
+    std::exception_ptr failure;
+    auto begin = std::chrono::steady_clock::now();
+
+    #pragma omp parallel num_threads(num_workers)
+    {
+        size_t worker = omp_get_thread_num();
+        Model& replica = *replicas[worker];
+        std::vector<std::shared_ptr<Parameter>>& local = replica_parameters[worker];
+
+        for (size_t batch = next_batch++; batch < inputs.size(); batch = next_batch++) {
+            uint32_t worker_batch = ++worker_batches[worker];
+            // Take a snapshot of the shared weights, other workers may be writing to them meanwhile
+            for (size_t i = 0; i < parameters.size(); i++) {
+                float* shared = parameters[i]->data.raw();
+                float* snapshot = local[i]->data.raw();
+                size_t size = local[i]->data.rows() * local[i]->data.cols();
+                for (size_t j = 0; j < size; j++) {
+                    snapshot[j] = std::atomic_ref<float>(shared[j]).load(std::memory_order_relaxed);
+                }
+                local[i]->grad.set_all(0);
+                local[i]->touched_rows.clear();
+            }
+
+            try {
+                Matrix output = replica.forward(inputs[batch]);
+                losses[worker] += loss.compute_error(targets[batch], output) * inputs[batch].rows();
+                samples[worker] += inputs[batch].rows();
+                replica.backward(loss.compute_error_derivative(targets[batch], output));
+            } catch (...) {
+                // An exception must not leave the parallel region, the other workers stop taking batches
+                #pragma omp critical
+                {
+                    if (!failure) {
+                        failure = std::current_exception();
+                    }
+                }
+                next_batch = inputs.size();
+                break;
+            }
+
+            for (size_t i = 0; i < parameters.size(); i++) {
+                float* shared = parameters[i]->data.raw();
+                const float* grad = local[i]->grad.raw();
+                float* velocity = velocities[worker][i].raw();
+                uint32_t* velocity_batch = velocity_batches[worker][i].data();
+                size_t size = local[i]->data.rows() * local[i]->data.cols();
+                for (size_t j = 0; j < size; j++) {
+                    float step = grad[j];
+                    if (step == 0) {
+                        continue;
+                    }
+                    if (momentum != 0) {
+                        // Catch up on the batches of this worker without a gradient for the weight, in which
+                        // SGDWithMomentum would have kept moving it on its decaying velocity
+                        uint32_t skipped = worker_batch - velocity_batch[j] - 1;
+                        float coasted = coasting_distance(momentum, skipped) * velocity[j];
+                        velocity[j] = std::pow(momentum, static_cast<float>(skipped + 1)) * velocity[j] + step;
+                        velocity_batch[j] = worker_batch;
+                        step = coasted + velocity[j];
+                    }
+                    std::atomic_ref<float> weight(shared[j]);
+                    weight.store(weight.load(std::memory_order_relaxed) - learning_rate * step, std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+    if (momentum != 0) {
+        coast_velocities();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    EpochStats stats{0, 0, std::chrono::duration<double>(end - begin).count()};
+    for (size_t worker = 0; worker < num_workers; worker++) {
+        stats.loss += losses[worker];
+        stats.samples += samples[worker];
+    }
+    stats.loss /= std::max<size_t>(stats.samples, 1);
+    return stats;
+}
+
+/**
+ * @brief Apply the steps that the velocities would have taken over the batches since the last update of each weight
+ * Runs after the workers have finished, so the weights of the model match SGD with momentum at the end of every epoch
+ */
+void HogwildTrainer::coast_velocities() {
+    #pragma omp parallel for collapse(2)
+    for (size_t worker = 0; worker < num_workers; worker++) {
+        for (size_t i = 0; i < parameters.size(); i++) {
+            float* shared = parameters[i]->data.raw();
+            float* velocity = velocities[worker][i].raw();
+            uint32_t* velocity_batch = velocity_batches[worker][i].data();
+            size_t size = parameters[i]->data.rows() * parameters[i]->data.cols();
+            for (size_t j = 0; j < size; j++) {
+                uint32_t skipped = worker_batches[worker] - velocity_batch[j];
+                if (velocity[j] == 0 || skipped == 0) {
+                    continue;
+                }
+                std::atomic_ref<float> weight(shared[j]);
+                weight.fetch_sub(learning_rate * coasting_distance(momentum, skipped) * velocity[j], std::memory_order_relaxed);
+                velocity[j] *= std::pow(momentum, static_cast<float>(skipped));
+                velocity_batch[j] = worker_batches[worker];
+            }
+        }
+    }
+}
+
+/**************************************
+           Pipeline trainer
+ **************************************/
+
+PipelineTrainer::PipelineTrainer(Sequential& model, Optimizer& optimizer, Loss& loss, std::vector<size_t> stage_sizes,
+                                 size_t micro_batches, PipelineSchedule schedule)
+: Trainer(model, optimizer, loss), micro_batches(micro_batches) {
+    size_t num_layers = 0;
+    for (size_t size : stage_sizes) {
+        if (size == 0) {
+            throw std::runtime_error("Every pipeline stage needs at least one layer.");
+        }
+        num_layers += size;
+    }
+    if (num_layers != model.size()) {
+        throw std::runtime_error("The pipeline stages cover " + std::to_string(num_layers) + " layers, the model has " + std::to_string(model.size()));
+    }
+    if (micro_batches == 0) {
+        throw std::runtime_error("PipelineTrainer needs at least one micro-batch.");
+    }
+
+    // Split the cores this process may run on evenly, stages share cores only if there are fewer cores than stages
+    std::vector<int> cores;
+    cpu_set_t available;
+    CPU_ZERO(&available);
+    if (sched_getaffinity(0, sizeof(available), &available) == 0) {
+        for (int core = 0; core < CPU_SETSIZE; core++) {
+            if (CPU_ISSET(core, &available)) {
+                cores.push_back(core);
+            }
+        }
+    }
+
+    const size_t num_stages = stage_sizes.size();
+    size_t first_layer = 0;
+    for (size_t s = 0; s < num_stages; s++) {
+        Stage stage;
+        std::vector<std::reference_wrapper<Model>> layers;
+        for (size_t i = first_layer; i < first_layer + stage_sizes[s]; i++) {
+            layers.push_back(model.layer(i));
+        }
+        first_layer += stage_sizes[s];
+        Sequential stage_model(layers);
+        stage.parameters = stage_model.parameters();
+
+        size_t in_flight = schedule == PipelineSchedule::GPipe ? micro_batches : std::min(micro_batches, num_stages - s);
+        for (size_t slot = 0; slot < in_flight; slot++) {
+            stage.replicas.push_back(stage_model.clone());
+            stage.replica_parameters.push_back(stage.replicas.back()->parameters());
+        }
+
+        if (schedule == PipelineSchedule::GPipe) {
+            for (size_t k = 0; k < micro_batches; k++) {
+                stage.operations.push_back({true, k});
+            }
+            for (size_t k = 0; k < micro_batches; k++) {
+                stage.operations.push_back({false, k});
+            }
+        } else {
+            size_t warmup = in_flight - 1;
+            for (size_t k = 0; k < warmup; k++) {
+                stage.operations.push_back({true, k});
+            }
+            for (size_t k = warmup; k < micro_batches; k++) {
+                stage.operations.push_back({true, k});
+                stage.operations.push_back({false, k - warmup});
+            }
+            for (size_t k = micro_batches - warmup; k < micro_batches; k++) {
+                stage.operations.push_back({false, k});
+            }
+        }
+
+        if (cores.size() >= num_stages) {
+            stage.cores.assign(cores.begin() + s * cores.size() / num_stages, cores.begin() + (s + 1) * cores.size() / num_stages);
+        } else if (!cores.empty()) {
+            stage.cores.push_back(cores[s % cores.size()]);
+        }
+        stages.push_back(std::move(stage));
+    }
+    last_stats.stage_busy_seconds = std::vector<double>(num_stages, 0);
+    last_stats.seconds = 0;
+}
+
+float PipelineTrainer::train_step(Matrix inputs, Matrix targets) {
+    if (inputs.rows() != targets.rows()) {
+        throw std::runtime_error("Inputs and targets must have the same number of rows.");
+    }
+    size_t batch_size = inputs.rows();
+    if (batch_size < micro_batches) {
+        throw std::runtime_error("The batch has fewer rows than the number of micro-batches.");
+    }
+    std::vector<Matrix> input_batches, target_batches;
+    for (size_t k = 0; k < micro_batches; k++) {
+        size_t begin = k * batch_size / micro_batches;
+        size_t end = (k + 1) * batch_size / micro_batches;
+        input_batches.push_back(Matrix::slice_rows(inputs, begin, end));
+        target_batches.push_back(Matrix::slice_rows(targets, begin, end));
+    }
+
+    const size_t num_stages = stages.size();
+    // activations[s] carries the outputs of stage s to stage s + 1, gradients[s] carries gradients back from s + 1 to s
+    std::vector<std::unique_ptr<Channel>> activations, gradients;
+    for (size_t s = 0; s + 1 < num_stages; s++) {
+        activations.push_back(std::make_unique<Channel>());
+        gradients.push_back(std::make_unique<Channel>());
+    }
+
+    float error = 0;
+    std::exception_ptr failure;
+    std::mutex failure_mutex;
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t s = 0; s < num_stages; s++) {
+        threads.emplace_back([&, s]() {
+            try {
+                if (!stages[s].cores.empty()) {
+                    cpu_set_t set;
+                    CPU_ZERO(&set);
+                    for (int core : stages[s].cores) {
+                        CPU_SET(core, &set);
+                    }
+                    // Threads of the OpenMP team of this stage inherit the affinity
+                    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+                    omp_set_num_threads(stages[s].cores.size());
+                }
+                float stage_error = run_stage(s, input_batches, target_batches, activations, gradients);
+                if (s + 1 == num_stages) {
+                    error = stage_error;
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(failure_mutex);
+                if (!failure) {
+                    failure = std::current_exception();
+                }
+                // Wake up the other stages, they cannot finish without this one
+                for (size_t i = 0; i + 1 < num_stages; i++) {
+                    activations[i]->close();
+                    gradients[i]->close();
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    last_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+
+    optimizer.step();
+    return error / batch_size;
+}
+
+const PipelineStats& PipelineTrainer::stats() const {
+    return last_stats;
+}
+
+/**
+ * @brief Run all operations of one stage
+ * Only the time spent computing counts as busy, waiting for a neighbouring stage is part of the bubble
+ * @return float loss summed over the rows of all micro-batches, only computed by the last stage
+ */
+float PipelineTrainer::run_stage(size_t s, const std::vector<Matrix>& inputs, const std::vector<Matrix>& targets,
+                                 std::vector<std::unique_ptr<Channel>>& activations, std::vector<std::unique_ptr<Channel>>& gradients) {
+    Stage& stage = stages[s];
+    const bool first = s == 0;
+    const bool last = s + 1 == stages.size();
+    double busy = 0;
+    auto compute_begin = std::chrono::steady_clock::now();
+    auto stop_clock = [&]() {
+        busy += std::chrono::duration<double>(std::chrono::steady_clock::now() - compute_begin).count();
+    };
+
+    // The replicas start from the current weights with empty gradients
+    for (auto& replica : stage.replica_parameters) {
+        for (size_t i = 0; i < stage.parameters.size(); i++) {
+            replica[i]->data = stage.parameters[i]->data;
+            std::fill(replica[i]->grad.raw(), replica[i]->grad.raw() + replica[i]->grad.rows() * replica[i]->grad.cols(), 0.0f);
+            replica[i]->touched_rows.clear();
+        }
+    }
+
+    float error = 0;
+    std::vector<Matrix> loss_gradients(last ? micro_batches : 0);
+    for (const Operation& operation : stage.operations) {
+        Model& replica = *stage.replicas[operation.micro_batch % stage.replicas.size()];
+        if (operation.forward) {
+            stop_clock();
+            Matrix input = first ? inputs[operation.micro_batch] : activations[s - 1]->pop();
+            compute_begin = std::chrono::steady_clock::now();
+            Matrix output = replica.forward(input);
+            if (last) {
+                const Matrix& target = targets[operation.micro_batch];
+                error += loss.compute_error(target, output) * target.rows();
+                loss_gradients[operation.micro_batch] = loss.compute_error_derivative(target, output);
+            } else {
+                activations[s]->push(std::move(output));
+            }
+        } else {
+            stop_clock();
+            Matrix output_gradient = last ? std::move(loss_gradients[operation.micro_batch]) : gradients[s]->pop();
+            compute_begin = std::chrono::steady_clock::now();
+            Matrix input_gradient = replica.backward(output_gradient);
+            if (!first) {
+                gradients[s - 1]->push(std::move(input_gradient));
+            }
+        }
+    }
+
+    // The loss derivatives are summed over rows, so the sum over micro-batches equals the full batch gradient
+    for (size_t i = 0; i < stage.parameters.size(); i++) {
+        Matrix& grad = stage.parameters[i]->grad;
+        grad = stage.replica_parameters[0][i]->grad;
+        size_t size = grad.rows() * grad.cols();
+        float* destination = grad.raw();
+        for (size_t replica = 1; replica < stage.replica_parameters.size(); replica++) {
+            const float* source = stage.replica_parameters[replica][i]->grad.raw();
+            for (size_t j = 0; j < size; j++) {
+                destination[j] += source[j];
+            }
+        }
+        if (stage.parameters[i]->row_sparse) {
+            stage.parameters[i]->touched_rows.clear();
+            for (auto& replica : stage.replica_parameters) {
+                stage.parameters[i]->touch_rows(replica[i]->touched_rows);
+            }
+        }
+    }
+    stop_clock();
+    last_stats.stage_busy_seconds[s] = busy;
+    return error;
+}
+
+void PipelineTrainer::Channel::push(Matrix matrix) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(matrix));
+    }
+    ready.notify_one();
+}
+
+Matrix PipelineTrainer::Channel::pop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [&]() { return closed || !queue.empty(); });
+    if (queue.empty()) {
+        throw std::runtime_error("A neighbouring pipeline stage failed.");
+    }
+    Matrix matrix = std::move(queue.front());
+    queue.pop_front();
+    return matrix;
+}
+
+void PipelineTrainer::Channel::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+    }
+    ready.notify_all();
+}
+
+/**
+ * @brief Distance in units of the velocity that momentum SGD moves a weight over batches without a gradient,
+ * momentum + momentum^2 + ... + momentum^batches
+ */
+float coasting_distance(float momentum, uint32_t batches) {
+    if (momentum == 1) {
+        return batches;
+    }
+    return momentum * (1 - std::pow(momentum, static_cast<float>(batches))) / (1 - momentum);
+}
@@ -0,0 +1,300 @@
+#pragma once
+#include "matrix.hpp"
+#include "model.hpp"
+#include "optimizers.hpp"
+#include "loss.hpp"
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <utility>
+#include <thread>
+#include <exception>
+#include <cstdint>
+
+
+/**
+ * @brief A class to run the training steps of a model
+ * One step is a forward pass, the loss, a backward pass and one optimizer step
+ */
+class Trainer {
+    public:
+        Trainer(Model& model, Optimizer& optimizer, Loss& loss);
+
+        /**
+         * @brief Run one training step on the given batch
+         *
+         * @param inputs 
+         * @param targets 
+         * @return float loss of the batch
+         */
+        virtual float train_step(Matrix inputs, Matrix targets);
+    protected:
+        Model& model;
+        Optimizer& optimizer;
+        Loss& loss;
+};
+
+/**
+ * @brief A trainer that updates the parameters of every layer as soon as the layer has finished its backward pass
+ *
+ * A backward hook of the model runs the optimizer on the parameters of a layer right after the layer has computed
+ * its gradients, while its weights and gradients are still in cache, instead of sweeping over all parameters after
+ * the whole backward pass. With a helper thread the updates of a layer overlap with the backward passes of the
+ * earlier layers, which only read their own weights, so the result is the same as with the sequential updates.
+ * The optimizer must own exactly the parameters of the model in the order of model.parameters() and must not clip
+ * the gradients, which would need the norm of all of them before the first update.
+ */
+class EagerTrainer : public Trainer {
+    public:
+        EagerTrainer(Sequential& model, Optimizer& optimizer, Loss& loss, bool helper_thread=false);
+        ~EagerTrainer();
+        EagerTrainer(const EagerTrainer&) = delete;
+        EagerTrainer& operator=(const EagerTrainer&) = delete;
+        float train_step(Matrix inputs, Matrix targets) override;
+    private:
+        Sequential& sequential;
+        // The parameters of the layer i are [first_parameter[i], first_parameter[i + 1]) of the optimizer
+        std::vector<size_t> first_parameter;
+        bool helper_thread;
+        std::thread helper;
+        std::mutex mutex;
+        std::condition_variable work_ready;
+        std::condition_variable work_done;
+        // Layers whose gradients are final and that wait for their update
+        std::deque<size_t> pending;
+        bool updating = false;
+        bool stop = false;
+        std::exception_ptr helper_error;
+
+        void update_layer(size_t layer);
+        void run_helper();
+};
+
+/**
+ * @brief A trainer that splits every logical batch into micro-batches and runs one optimizer step per logical batch
+ *
+ * The layers accumulate gradients in place, so forward and backward run on one micro-batch at a time and
+ * only the activations of a single micro-batch are kept alive, which allows large effective batch sizes.
+ * The losses sum their derivatives over rows, so the accumulated gradient equals the gradient of the whole
+ * logical batch without rescaling, and the reported loss is the mean weighted by the micro-batch sizes.
+ * With prefetching enabled the next micro-batch is fetched on a helper thread while the current one is trained on.
+ */
+class GradientAccumulationTrainer : public Trainer {
+    public:
+        /**
+         * @brief Fetches the inputs and targets of the micro-batch with the given index
+         */
+        using MicroBatchSource = std::function<std::pair<Matrix, Matrix>(size_t)>;
+
+        GradientAccumulationTrainer(Model& model, Optimizer& optimizer, Loss& loss, size_t micro_batch_size, bool prefetch=true);
+
+        /**
+         * @brief Run one training step on the logical batch, split into micro-batches of micro_batch_size rows
+         *
+         * @param inputs 
+         * @param targets 
+         * @return float loss of the logical batch
+         */
+        float train_step(Matrix inputs, Matrix targets) override;
+
+        /**
+         * @brief Run one training step on a logical batch made of the given number of fetched micro-batches
+         *
+         * @param source 
+         * @param micro_batches 
+         * @return float loss of the logical batch
+         */
+        float train_step(MicroBatchSource source, size_t micro_batches);
+    private:
+        size_t micro_batch_size;
+        bool prefetch;
+};
+
+/**
+ * @brief A trainer that splits every batch across worker threads, each with its own model replica
+ *
+ * Every worker runs forward and backward on its shard of the batch with intra-op parallelism disabled,
+ * so even small layers keep all cores busy. The replica gradients are then summed into the gradients
+ * of the model in a reduce-scatter over fixed size chunks: every worker owns a contiguous range of chunks
+ * and streams the replicas through it while the destination chunk stays in cache. After the single
+ * optimizer step the updated weights are copied back to the replicas chunk by chunk in the same way.
+ */
+class DataParallelTrainer : public Trainer {
+    public:
+        DataParallelTrainer(Model& model, Optimizer& optimizer, Loss& loss, size_t num_workers);
+        float train_step(Matrix inputs, Matrix targets) override;
+    private:
+        /**
+         * @brief A contiguous range of one parameter, the unit of work of the reduction and the broadcast
+         */
+        struct Chunk {
+            size_t parameter;
+            size_t begin;
+            size_t end;
+        };
+
+        size_t num_workers;
+        std::vector<std::shared_ptr<Model>> replicas;
+        std::vector<std::shared_ptr<Parameter>> parameters;
+        std::vector<std::vector<std::shared_ptr<Parameter>>> replica_parameters;
+        std::vector<Chunk> chunks;
+
+        void all_reduce_chunk(const Chunk& chunk);
+        void broadcast_chunk(const Chunk& chunk);
+};
+
+/**
+ * @brief Throughput and loss of one pass over a dataset
+ */
+struct EpochStats {
+    float loss;
+    size_t samples;
+    double seconds;
+
+    double samples_per_second() const { return samples / seconds; }
+};
+
+/**
+ * @brief A trainer that runs lock-free asynchronous SGD (Hogwild!) on the shared model weights
+ *
+ * Worker threads take disjoint batches, run forward and backward on their own replica and apply the
+ * SGD (or SGD with momentum, with a velocity per worker) update straight to the Parameter::data of the
+ * model without any locking. Weights are read and written with relaxed atomics, so concurrent updates
+ * of the same weight may overwrite each other, which Hogwild! tolerates for sparse and small models.
+ * Zero gradient entries are skipped, so sparse gradients only write the weights they affect. With momentum
+ * the velocity keeps moving a weight without a gradient like SGDWithMomentum does, but lazily: the steps of
+ * the batches since its last update are applied in closed form at its next non-zero gradient, and for all
+ * weights at the end of the epoch.
+ *
+ * Every batch still costs O(parameters) per worker besides the sparse writes: the replica copies all shared
+ * weights before its forward pass, since the rows a model will read are not known in advance, and the
+ * gradients are cleared and scanned for non-zero entries. With momentum, every epoch ends with one
+ * O(parameters) sweep per worker over the velocities.
+ */
+class HogwildTrainer {
+    public:
+        HogwildTrainer(Model& model, Loss& loss, size_t num_workers, float learning_rate, float momentum=0);
+
+        /**
+         * @brief Run one epoch over the given batches, every batch is processed by exactly one worker
+         *
+         * @param inputs 
+         * @param targets 
+         * @return EpochStats 
+         */
+        EpochStats train_epoch(const std::vector<Matrix>& inputs, const std::vector<Matrix>& targets);
+    private:
+        Model& model;
+        Loss& loss;
+        size_t num_workers;
+        float learning_rate;
+        float momentum;
+        std::vector<std::shared_ptr<Parameter>> parameters;
+        std::vector<std::shared_ptr<Model>> replicas;
+        std::vector<std::vector<std::shared_ptr<Parameter>>> replica_parameters;
+        std::vector<std::vector<Matrix>> velocities;
+        // The batch of the worker that last updated each velocity, and the number of batches of every worker
+        std::vector<std::vector<std::vector<uint32_t>>> velocity_batches;
+        std::vector<uint32_t> worker_batches;
+
+        void coast_velocities();
+};
+
+/**
+ * @brief Order in which every pipeline stage runs the forward and backward passes of the micro-batches
+ *  - GPipe runs all forward passes and then all backward passes
+ *  - OneFOneB starts with (stages - stage - 1) forward passes and then alternates one forward and one backward,
+ *    so stage s never holds the activations of more than (stages - s) micro-batches
+ */
+enum class PipelineSchedule {GPipe, OneFOneB};
+
+/**
+ * @brief Busy time of every pipeline stage during the last training step
+ */
+struct PipelineStats {
+    std::vector<double> stage_busy_seconds;
+    double seconds;
+
+    double utilization(size_t stage) const { return stage_busy_seconds[stage] / seconds; }
+    double bubble_fraction() const {
+        double busy = 0;
+        for (double stage : stage_busy_seconds) {
+            busy += stage;
+        }
+        return 1 - busy / (seconds * stage_busy_seconds.size());
+    }
+};
+
+/**
+ * @brief A trainer that splits the layers of a Sequential model into pipeline stages
+ *
+ * Every stage runs on its own thread pinned to a disjoint set of cores, which also runs the OpenMP
+ * kernels of its layers. A batch is split into micro-batches that stream through the stages, activations
+ * are passed forward and gradients backward through queues, so different stages work on different
+ * micro-batches at the same time. Layers keep their activations for the backward pass, so every stage
+ * holds one replica of its layers per micro-batch in flight. Replica gradients are summed into the model
+ * gradients before the single optimizer step, which matches training on the whole batch.
+ */
+class PipelineTrainer : public Trainer {
+    public:
+        /**
+         * @param model 
+         * @param optimizer 
+         * @param loss 
+         * @param stage_sizes number of consecutive layers of the model in every stage
+         * @param micro_batches number of micro-batches every batch is split into
+         * @param schedule 
+         */
+        PipelineTrainer(Sequential& model, Optimizer& optimizer, Loss& loss, std::vector<size_t> stage_sizes,
+                        size_t micro_batches, PipelineSchedule schedule=PipelineSchedule::OneFOneB);
+        float train_step(Matrix inputs, Matrix targets) override;
+
+        /**
+         * @brief Per-stage utilization and bubble fraction of the last training step
+         *
+         * @return const PipelineStats& 
+         */
+        const PipelineStats& stats() const;
+    private:
+        /**
+         * @brief A blocking queue between two neighbouring stages, closed when any stage fails
+         */
+        struct Channel {
+            std::deque<Matrix> queue;
+            std::mutex mutex;
+            std::condition_variable ready;
+            bool closed = false;
+
+            void push(Matrix matrix);
+            Matrix pop();
+            void close();
+        };
+
+        /**
+         * @brief One forward or backward pass of a micro-batch
+         */
+        struct Operation {
+            bool forward;
+            size_t micro_batch;
+        };
+
+        struct Stage {
+            std::vector<std::shared_ptr<Parameter>> parameters;
+            // One replica of the layers of the stage per micro-batch in flight
+            std::vector<std::shared_ptr<Model>> replicas;
+            std::vector<std::vector<std::shared_ptr<Parameter>>> replica_parameters;
+            std::vector<Operation> operations;
+            std::vector<int> cores;
+        };
+
+        size_t micro_batches;
+        std::vector<Stage> stages;
+        PipelineStats last_stats;
+
+        float run_stage(size_t stage, const std::vector<Matrix>& inputs, const std::vector<Matrix>& targets,
+                        std::vector<std::unique_ptr<Channel>>& activations, std::vector<std::unique_ptr<Channel>>& gradients);
+};
@@ -1,14 +1,107 @@
-//#define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_MAIN
 
 #include "catch.hpp"
 
 #include <vector>
+#include <random>
+#include <cmath>
+#include <string>
+#include <filesystem>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <numeric>
 
 #include "model.hpp"
 #include "matrix.hpp"
 #include "utils.hpp"
 #include "loss.hpp"
+#include "conv.hpp"
+#include "attention.hpp"
+#include "recurrent.hpp"
+#include "embedding.hpp"
+#include "trainer.hpp"
+#include "distributed.hpp"
+#include "optimizers.hpp"
+#include "arena.hpp"
+#include "data_loader.hpp"
+#include "dataset.hpp"
 
+/**
+ * @brief Compare the analytic gradients of a layer against central finite differences
+ * The loss is a fixed random projection of the layer output, so backward receives that projection
+ * @return float maximum absolute difference over the input and all parameter gradients
+ */
+float gradient_check(Model& layer, Matrix input) {
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> dist(-1, 1);
+    Matrix output = layer.forward(input);
+    Matrix projection(output.shape, 0);
+    for (size_t i = 0; i < projection.rows(); i++) {
+        for (size_t j = 0; j < projection.cols(); j++) {
+            projection[i, j] = dist(gen);
+        }
+    }
+    auto loss = [&](Matrix x) {
+        return Matrix::sum(Matrix::mul(layer.forward(x), projection));
+    };
+    for (auto& parameter : layer.parameters()) {
+        parameter->grad.set_all(0);
+    }
+    layer.forward(input);
+    Matrix input_grad = layer.backward(projection);
+
+    const float h = 1e-2;
+    float max_error = 0;
+    for (size_t i = 0; i < input.rows(); i++) {
+        for (size_t j = 0; j < input.cols(); j++) {
+            float original = input[i, j];
+            input[i, j] = original + h;
+            float plus = loss(input);
+            input[i, j] = original - h;
+            float minus = loss(input);
+            input[i, j] = original;
+            max_error = std::max(max_error, std::abs((plus - minus) / (2 * h) - input_grad[i, j]));
+        }
+    }
+    for (auto& parameter : layer.parameters()) {
+        for (size_t i = 0; i < parameter->data.rows(); i++) {
+            for (size_t j = 0; j < parameter->data.cols(); j++) {
+                float original = parameter->data[i, j];
+                parameter->data[i, j] = original + h;
+                float plus = loss(input);
+                parameter->data[i, j] = original - h;
+                float minus = loss(input);
+                parameter->data[i, j] = original;
+                max_error = std::max(max_error, std::abs((plus - minus) / (2 * h) - parameter->grad[i, j]));
+            }
+        }
+    }
+    return max_error;
+}
+
+float max_abs_diff(Matrix A, Matrix B) {
+    REQUIRE(A.shape == B.shape);
+    float max_diff = 0;
+    for (size_t i = 0; i < A.rows(); i++) {
+        for (size_t j = 0; j < A.cols(); j++) {
+            max_diff = std::max(max_diff, std::abs(A[i, j] - B[i, j]));
+        }
+    }
+    return max_diff;
+}
+
+Matrix test_input(size_t rows, size_t cols, float frequency = 0.37f) {
+    Matrix input(rows, cols, 0);
+    for (size_t i = 0; i < rows; i++) {
+        for (size_t j = 0; j < cols; j++) {
+            input[i, j] = std::sin(frequency * (i * cols + j + 1));
+        }
+    }
+    return input;
+}
 
 TEST_CASE("Test forward and backward on simple 1 layer network", "[model]") {
     
@@ -46,4 +139,1199 @@ TEST_CASE("Test forward and backward on simple 2 layer network", "[model]") {
     REQUIRE(model.parameters()[1]->grad == Matrix(1, 2, {280, 0}));
     REQUIRE(model.parameters()[2]->grad == Matrix(2, 1, {1050, 0}));
     REQUIRE(model.parameters()[3]->grad == Matrix(1, 1, {70}));
-}
\ No newline at end of file
+}
+
+TEST_CASE("Test conv2d forward matches direct convolution in both layouts", "[conv]") {
+    Linear lin;
+    for (TensorLayout layout : {TensorLayout::NCHW, TensorLayout::NHWC}) {
+        ImageShape shape{2, 5, 4, layout};
+        Conv2DLayer conv(shape, 3, 3, 2, 1, lin);
+        Matrix input = test_input(2, shape.size());
+        Matrix weights = conv.parameters()[0]->data;
+        Matrix biases = conv.parameters()[1]->data;
+        Matrix output = conv.forward(input);
+        ImageShape out = conv.output_shape();
+        REQUIRE(out.height == 3);
+        REQUIRE(out.width == 2);
+        for (size_t n = 0; n < 2; n++) {
+            for (size_t oc = 0; oc < out.channels; oc++) {
+                for (size_t oh = 0; oh < out.height; oh++) {
+                    for (size_t ow = 0; ow < out.width; ow++) {
+                        float expected = biases[0, oc];
+                        for (size_t c = 0; c < shape.channels; c++) {
+                            for (size_t kh = 0; kh < 3; kh++) {
+                                for (size_t kw = 0; kw < 3; kw++) {
+                                    long ih = oh * 2 + kh - 1, iw = ow * 2 + kw - 1;
+                                    if (ih >= 0 && iw >= 0 && ih < 5 && iw < 4) {
+                                        expected += input[n, shape.offset(c, ih, iw)] * weights[(c * 3 + kh) * 3 + kw, oc];
+                                    }
+                                }
+                            }
+                        }
+                        REQUIRE(output[n, out.offset(oc, oh, ow)] == Approx(expected).margin(1e-5));
+                    }
+                }
+            }
+        }
+        REQUIRE(gradient_check(conv, input) < 1e-2);
+    }
+}
+
+TEST_CASE("Test pooling forward and backward", "[conv]") {
+    ImageShape shape{1, 2, 4, TensorLayout::NCHW};
+    MaxPool2D max_pool(shape, 2, 2);
+    AvgPool2D avg_pool(shape, 2, 2);
+    Matrix input(1, 8, {1, 5, 2, 0, 3, 4, 8, 6});
+    REQUIRE(max_pool.forward(input) == Matrix(1, 2, {5, 8}));
+    REQUIRE(max_pool.backward(Matrix(1, 2, {1, 2})) == Matrix(1, 8, {0, 1, 0, 0, 0, 0, 2, 0}));
+    REQUIRE(avg_pool.forward(input) == Matrix(1, 2, {3.25, 4}));
+    REQUIRE(avg_pool.backward(Matrix(1, 2, {4, 8})) == Matrix(1, 8, {1, 1, 2, 2, 1, 1, 2, 2}));
+}
+
+TEST_CASE("Test winograd convolution matches im2col convolution", "[conv]") {
+    Sigmoid sig;
+    for (TensorLayout layout : {TensorLayout::NCHW, TensorLayout::NHWC}) {
+        for (size_t padding : {0, 1}) {
+            ImageShape shape{3, 7, 6, layout};
+            Conv2DLayer reference(shape, 4, 3, 1, padding, sig, ConvAlgorithm::Im2Col);
+            Conv2DLayer winograd(shape, 4, 3, 1, padding, sig);
+            REQUIRE(winograd.uses_winograd());
+            REQUIRE_FALSE(reference.uses_winograd());
+            winograd.parameters()[0]->data = reference.parameters()[0]->data;
+            winograd.parameters()[1]->data = reference.parameters()[1]->data;
+
+            Matrix input = test_input(3, shape.size());
+            Matrix expected = reference.forward(input);
+            Matrix output = winograd.forward(input);
+            REQUIRE(output.shape == expected.shape);
+            REQUIRE(max_abs_diff(output, expected) < 1e-5);
+            Matrix gradient = test_input(3, output.cols(), 0.11f);
+            REQUIRE(max_abs_diff(winograd.backward(gradient), reference.backward(gradient)) < 1e-5);
+            // The weight gradients sum over all pixels and can reach magnitudes of 100, so the rounding errors of the
+            // two forward passes are compared relative to their size
+            Matrix& weight_gradient = reference.parameters()[0]->grad;
+            float magnitude = std::max(1.0f, max_abs_diff(weight_gradient, Matrix(weight_gradient.shape, 0)));
+            REQUIRE(max_abs_diff(winograd.parameters()[0]->grad, weight_gradient) < 1e-5 * magnitude);
+        }
+    }
+}
+
+TEST_CASE("Test blocked multi-head attention matches full softmax attention", "[attention]") {
+    const size_t length = 5, dim = 4, heads = 2, head_dim = 2;
+    for (bool causal : {false, true}) {
+        MultiHeadAttention mha(length, dim, heads, causal, 2);
+        Matrix input = test_input(2, length * dim);
+        Matrix output = mha.forward(input);
+
+        auto params = mha.parameters();
+        Matrix qkv = Matrix::colwise_add(Matrix::matMul(input.reshape(2 * length, dim), params[0]->data), params[1]->data);
+        Matrix attention(2 * length, dim, 0);
+        for (size_t n = 0; n < 2; n++) {
+            for (size_t h = 0; h < heads; h++) {
+                Matrix scores(length, length, 0);
+                for (size_t t = 0; t < length; t++) {
+                    for (size_t j = 0; j < length; j++) {
+                        float score = 0;
+                        for (size_t d = 0; d < head_dim; d++) {
+                            score += qkv[n * length + t, h * head_dim + d] * qkv[n * length + j, dim + h * head_dim + d];
+                        }
+                        scores[t, j] = (causal && j > t) ? -1e30f : score / std::sqrt(float(head_dim));
+                    }
+                }
+                Matrix probabilities = Matrix::softmax(scores);
+                for (size_t t = 0; t < length; t++) {
+                    for (size_t d = 0; d < head_dim; d++) {
+                        for (size_t j = 0; j < length; j++) {
+                            attention[n * length + t, h * head_dim + d] += probabilities[t, j] * qkv[n * length + j, 2 * dim + h * head_dim + d];
+                        }
+                    }
+                }
+            }
+        }
+        Matrix expected = Matrix::colwise_add(Matrix::matMul(attention, params[2]->data), params[3]->data);
+        REQUIRE(max_abs_diff(output, expected.reshape(2, length * dim)) < 1e-5);
+        REQUIRE(gradient_check(mha, input) < 1e-2);
+    }
+}
+
+TEST_CASE("Test LSTM and GRU gradients and sequence outputs", "[recurrent]") {
+    const size_t length = 4, input_size = 3, hidden_size = 2;
+    Matrix input = test_input(3, length * input_size);
+
+    LSTMLayer lstm(length, input_size, hidden_size);
+    LSTMLayer lstm_sequences(length, input_size, hidden_size, true);
+    GRULayer gru(length, input_size, hidden_size);
+    GRULayer gru_sequences(length, input_size, hidden_size, true);
+    REQUIRE(gradient_check(lstm, input) < 1e-2);
+    REQUIRE(gradient_check(lstm_sequences, input) < 1e-2);
+    REQUIRE(gradient_check(gru, input) < 1e-2);
+    REQUIRE(gradient_check(gru_sequences, input) < 1e-2);
+
+    // The last step of the full sequence output is the final hidden state
+    for (auto [last, sequences] : {std::pair<Model*, Model*>{&lstm, &lstm_sequences}, {&gru, &gru_sequences}}) {
+        for (size_t i = 0; i < last->parameters().size(); i++) {
+            sequences->parameters()[i]->data = last->parameters()[i]->data;
+        }
+        Matrix final_state = last->forward(input);
+        Matrix all_states = sequences->forward(input);
+        REQUIRE(all_states.cols() == length * hidden_size);
+        for (size_t n = 0; n < input.rows(); n++) {
+            for (size_t k = 0; k < hidden_size; k++) {
+                REQUIRE(all_states[n, (length - 1) * hidden_size + k] == final_state[n, k]);
+            }
+        }
+    }
+}
+
+TEST_CASE("Test LayerNorm and RMSNorm forward and gradients", "[normalization]") {
+    LayerNorm layer_norm(6, 1e-5);
+    RMSNorm rms_norm(6, 1e-5);
+    Matrix input = Matrix::add(Matrix::mul(test_input(3, 6), 4), 100);
+
+    Matrix normalized = layer_norm.forward(input);
+    for (size_t row = 0; row < normalized.rows(); row++) {
+        float mean = 0, variance = 0;
+        for (size_t col = 0; col < 6; col++) {
+            mean += normalized[row, col] / 6;
+        }
+        for (size_t col = 0; col < 6; col++) {
+            variance += (normalized[row, col] - mean) * (normalized[row, col] - mean) / 6;
+        }
+        REQUIRE(mean == Approx(0).margin(1e-4));
+        REQUIRE(variance == Approx(1).margin(1e-3));
+    }
+    Matrix scaled = rms_norm.forward(input);
+    for (size_t row = 0; row < scaled.rows(); row++) {
+        float mean_square = 0;
+        for (size_t col = 0; col < 6; col++) {
+            mean_square += scaled[row, col] * scaled[row, col] / 6;
+        }
+        REQUIRE(mean_square == Approx(1).margin(1e-4));
+    }
+
+    layer_norm.parameters()[0]->data = test_input(1, 6, 0.9f);
+    layer_norm.parameters()[1]->data = test_input(1, 6, 0.4f);
+    rms_norm.parameters()[0]->data = test_input(1, 6, 0.9f);
+    Matrix small_input = test_input(3, 6);
+    REQUIRE(gradient_check(layer_norm, small_input) < 1e-2);
+    REQUIRE(gradient_check(rms_norm, small_input) < 1e-2);
+}
+
+TEST_CASE("Test parameter arena binds parameters to aligned contiguous storage", "[optimizer]") {
+    LeakyReLU leaky;
+    FullyConnectedLayer layer1(3, 5, leaky);
+    FullyConnectedLayer layer2(5, 2, leaky);
+    Sequential model({layer1, layer2});
+    Matrix weights = model.parameters()[0]->data;
+    SGDWithMomentum optimizer(model.parameters(), 0.1, 0.9);
+    ParameterArena& arena = optimizer.arena();
+
+    auto parameters = model.parameters();
+    REQUIRE(arena.state_slots() == 1);
+    REQUIRE(arena.size() == 16 + 16 + 16 + 16);
+    for (size_t i = 0; i < parameters.size(); i++) {
+        REQUIRE(parameters[i]->data.is_view());
+        REQUIRE(parameters[i]->data.raw() == arena.data() + arena.offset(i));
+        REQUIRE(parameters[i]->grad.raw() == arena.grad() + arena.offset(i));
+        REQUIRE(reinterpret_cast<std::uintptr_t>(parameters[i]->grad.raw()) % ParameterArena::alignment == 0);
+    }
+    // Binding keeps the values, copies own their storage and assignments write into the arena
+    REQUIRE(max_abs_diff(parameters[0]->data, weights) == 0);
+    Matrix copy = parameters[0]->data;
+    REQUIRE_FALSE(copy.is_view());
+    parameters[0]->data = Matrix::mul(copy, 2);
+    REQUIRE(arena.data()[0] == copy[0, 0] * 2);
+    REQUIRE_THROWS(parameters[0]->data = Matrix(2, 2, 0));
+
+    model.backward(model.forward(test_input(4, 3)));
+    optimizer.step();
+    optimizer.zero_grad();
+    for (size_t i = 0; i < arena.size(); i++) {
+        REQUIRE(arena.grad()[i] == 0);
+    }
+
+    // A second optimizer would silently take the parameters away from the first one
+    REQUIRE_THROWS(SGD(model.parameters(), 0.1));
+    FullyConnectedLayer layer3(2, 2, leaky);
+    Matrix trained;
+    {
+        SGD first(layer3.parameters(), 0.1);
+        layer3.parameters()[0]->data = Matrix::mul(layer3.parameters()[0]->data, 2);
+        trained = layer3.parameters()[0]->data;
+    }
+    // Once the first optimizer is gone the next one starts from the weights it left behind
+    SGD second(layer3.parameters(), 0.1);
+    REQUIRE(max_abs_diff(layer3.parameters()[0]->data, trained) == 0);
+}
+
+TEST_CASE("Test fused optimizer steps match the reference update rules", "[optimizer]") {
+    const float learning_rate = 0.01, beta1 = 0.9, beta2 = 0.999, epsilon = 1e-8, weight_decay = 0.01;
+    auto parameter = std::make_shared<Parameter>(Parameter(Matrix(2, 3, {0.5, -1, 2, 0.1, 0, -0.3})));
+    auto decayed = std::make_shared<Parameter>(*parameter);
+    auto adagrad_parameter = std::make_shared<Parameter>(*parameter);
+    auto rmsprop_parameter = std::make_shared<Parameter>(*parameter);
+    Adam adam({parameter}, learning_rate, beta1, beta2, epsilon);
+    AdamW adamw({decayed}, learning_rate, beta1, beta2, epsilon, weight_decay);
+    AdaGrad adagrad({adagrad_parameter}, learning_rate, epsilon);
+    RMSprop rmsprop({rmsprop_parameter}, learning_rate, 0.9, epsilon);
+
+    std::vector<double> w(6), w_decayed(6), w_adagrad(6), w_rmsprop(6), m(6, 0), v(6, 0), squared(6, 0), mean_squared(6, 0);
+    for (size_t i = 0; i < 6; i++) {
+        w[i] = w_decayed[i] = w_adagrad[i] = w_rmsprop[i] = parameter->data[i / 3, i % 3];
+    }
+    std::vector<double> m_decayed = m, v_decayed = v;
+    for (int t = 1; t <= 3; t++) {
+        for (auto& p : {parameter, decayed, adagrad_parameter, rmsprop_parameter}) {
+            for (size_t i = 0; i < 6; i++) {
+                p->grad[i / 3, i % 3] = std::sin(t + i * 0.7f);
+            }
+        }
+        adam.step();
+        adamw.step();
+        adagrad.step();
+        rmsprop.step();
+        for (size_t i = 0; i < 6; i++) {
+            double g = std::sin(t + i * 0.7f);
+            m[i] = beta1 * m[i] + (1 - beta1) * g;
+            v[i] = beta2 * v[i] + (1 - beta2) * g * g;
+            double m_hat = m[i] / (1 - std::pow(beta1, t)), v_hat = v[i] / (1 - std::pow(beta2, t));
+            w[i] -= learning_rate * m_hat / (std::sqrt(v_hat) + epsilon);
+            w_decayed[i] = w_decayed[i] * (1 - weight_decay) - learning_rate * m_hat / (std::sqrt(v_hat) + epsilon);
+            squared[i] += g * g;
+            w_adagrad[i] -= learning_rate * g / (std::sqrt(squared[i]) + epsilon);
+            mean_squared[i] = 0.9 * mean_squared[i] + 0.1 * g * g;
+            w_rmsprop[i] -= learning_rate * g / (std::sqrt(mean_squared[i]) + epsilon);
+        }
+    }
+    for (size_t i = 0; i < 6; i++) {
+        REQUIRE(parameter->data[i / 3, i % 3] == Approx(w[i]).margin(1e-6));
+        REQUIRE(decayed->data[i / 3, i % 3] == Approx(w_decayed[i]).margin(1e-6));
+        REQUIRE(adagrad_parameter->data[i / 3, i % 3] == Approx(w_adagrad[i]).margin(1e-6));
+        REQUIRE(rmsprop_parameter->data[i / 3, i % 3] == Approx(w_rmsprop[i]).margin(1e-6));
+    }
+}
+
+TEST_CASE("Test overshoot optimizers evaluate gradients at overshot weights", "[optimizer]") {
+    Matrix initial(2, 2, {1, -2, 0.5, 3});
+    Matrix gradient(2, 2, {0.5, 1, -1, 0.25});
+    auto parameter = std::make_shared<Parameter>(Parameter(initial));
+    SGDwithOvershoot sgdo({parameter}, 0.1, 0.9, 5);
+    parameter->grad = gradient;
+    sgdo.step();
+    // The base weights take a plain momentum step, the model weights lie 5 such steps further
+    for (size_t i = 0; i < 4; i++) {
+        REQUIRE(parameter->data[i / 2, i % 2] == Approx(initial[i / 2, i % 2] - 0.6f * gradient[i / 2, i % 2]));
+    }
+    sgdo.swap_base_weights();
+    for (size_t i = 0; i < 4; i++) {
+        REQUIRE(parameter->data[i / 2, i % 2] == Approx(initial[i / 2, i % 2] - 0.1f * gradient[i / 2, i % 2]));
+    }
+    sgdo.swap_base_weights();
+
+    // Without overshoot the optimizers reduce to SGD with momentum and Adam
+    auto overshoot_parameter = std::make_shared<Parameter>(Parameter(initial));
+    auto momentum_parameter = std::make_shared<Parameter>(Parameter(initial));
+    auto adamo_parameter = std::make_shared<Parameter>(Parameter(initial));
+    auto adam_parameter = std::make_shared<Parameter>(Parameter(initial));
+    SGDwithOvershoot no_overshoot({overshoot_parameter}, 0.1, 0.9, 0);
+    SGDWithMomentum momentum({momentum_parameter}, 0.1, 0.9);
+    AdamwithOvershoot adamo({adamo_parameter}, 0.01, 0.9, 0.999, 1e-8, 0);
+    Adam adam({adam_parameter}, 0.01, 0.9, 0.999, 1e-8);
+    for (int step = 0; step < 3; step++) {
+        for (auto& p : {overshoot_parameter, momentum_parameter, adamo_parameter, adam_parameter}) {
+            p->grad = Matrix::mul(gradient, step + 1.0f);
+        }
+        no_overshoot.step();
+        momentum.step();
+        adamo.step();
+        adam.step();
+    }
+    REQUIRE(max_abs_diff(overshoot_parameter->data, momentum_parameter->data) < 1e-6);
+    REQUIRE(max_abs_diff(adamo_parameter->data, adam_parameter->data) < 1e-6);
+}
+
+TEST_CASE("Test LAMB and LARS trust ratios and the warmup schedule", "[optimizer]") {
+    Matrix initial(2, 3, {0.5, -1, 2, 0.1, 0, -0.3});
+    auto lamb_weights = std::make_shared<Parameter>(Parameter(initial));
+    auto lamb_biases = std::make_shared<Parameter>(Parameter(Matrix(1, 3, 0)));
+    auto lars_weights = std::make_shared<Parameter>(Parameter(initial));
+    LAMB lamb({lamb_weights, lamb_biases}, 0.01, 0.9, 0.999, 1e-6, 0.01);
+    LARS lars({lars_weights}, 0.1, 0.9, 0.0005, 0.001);
+
+    std::vector<double> w(6), m(6, 0), v(6, 0), b(3, 0), m_b(3, 0), v_b(3, 0), w_lars(6), velocity(6, 0);
+    for (size_t i = 0; i < 6; i++) {
+        w[i] = w_lars[i] = initial[i / 3, i % 3];
+    }
+    // One LAMB step of a tensor in double precision
+    auto lamb_reference = [](std::vector<double>& w, std::vector<double>& m, std::vector<double>& v, std::vector<double> g, int t) {
+        std::vector<double> r(w.size());
+        double w_norm = 0, r_norm = 0;
+        for (size_t i = 0; i < w.size(); i++) {
+            m[i] = 0.9 * m[i] + 0.1 * g[i];
+            v[i] = 0.999 * v[i] + 0.001 * g[i] * g[i];
+            r[i] = m[i] / (1 - std::pow(0.9, t)) / (std::sqrt(v[i] / (1 - std::pow(0.999, t))) + 1e-6) + 0.01 * w[i];
+            w_norm += w[i] * w[i];
+            r_norm += r[i] * r[i];
+        }
+        double trust = w_norm > 0 && r_norm > 0 ? std::sqrt(w_norm) / std::sqrt(r_norm) : 1;
+        for (size_t i = 0; i < w.size(); i++) {
+            w[i] -= 0.01 * trust * r[i];
+        }
+    };
+    for (int t = 1; t <= 3; t++) {
+        std::vector<double> g(6), g_b(3);
+        for (size_t i = 0; i < 6; i++) {
+            g[i] = std::sin(t + i * 0.7f);
+            lamb_weights->grad[i / 3, i % 3] = lars_weights->grad[i / 3, i % 3] = g[i];
+        }
+        for (size_t i = 0; i < 3; i++) {
+            g_b[i] = std::cos(t + i * 0.3f);
+            lamb_biases->grad[0, i] = g_b[i];
+        }
+        lamb.step();
+        lars.step();
+        lamb_reference(w, m, v, g, t);
+        lamb_reference(b, m_b, v_b, g_b, t);
+
+        double w_norm = 0, g_norm = 0;
+        for (size_t i = 0; i < 6; i++) {
+            w_norm += w_lars[i] * w_lars[i];
+            g_norm += g[i] * g[i];
+        }
+        double local_lr = 0.1 * 0.001 * std::sqrt(w_norm) / (std::sqrt(g_norm) + 0.0005 * std::sqrt(w_norm));
+        for (size_t i = 0; i < 6; i++) {
+            velocity[i] = 0.9 * velocity[i] + local_lr * (g[i] + 0.0005 * w_lars[i]);
+            w_lars[i] -= velocity[i];
+        }
+    }
+    for (size_t i = 0; i < 6; i++) {
+        REQUIRE(lamb_weights->data[i / 3, i % 3] == Approx(w[i]).margin(1e-6));
+        REQUIRE(lars_weights->data[i / 3, i % 3] == Approx(w_lars[i]).margin(1e-6));
+    }
+    for (size_t i = 0; i < 3; i++) {
+        REQUIRE(lamb_biases->data[0, i] == Approx(b[i]).margin(1e-6));
+    }
+
+    LinearWarmupScheduler scheduler(lamb, 4, 8);
+    std::vector<float> expected = {0.0025, 0.005, 0.0075, 0.01, 0.01, 0.0075, 0.005, 0.0025, 0, 0};
+    for (float learning_rate : expected) {
+        REQUIRE(lamb.get_learning_rate() == Approx(learning_rate));
+        scheduler.step();
+    }
+}
+
+TEST_CASE("Test 8-bit quantized Adam tracks full precision Adam", "[optimizer]") {
+    Linear lin;
+    FullyConnectedLayer layer(4, 1, lin);
+    Sequential model({layer});
+    std::shared_ptr<Model> reference = model.clone();
+    MeanSquaredError loss;
+    QuantizedAdam optimizer(model.parameters(), 0.05, 0.9, 0.999, 1e-8);
+    Adam reference_optimizer(reference->parameters(), 0.05, 0.9, 0.999, 1e-8);
+    Trainer trainer(model, optimizer, loss);
+    Trainer reference_trainer(*reference, reference_optimizer, loss);
+
+    Matrix x = test_input(32, 4);
+    Matrix y = Matrix::add(Matrix::matMul(x, Matrix(4, 1, {1, -2, 0.5, 3})), 0.25);
+    float error = 0, reference_error = 0;
+    for (int step = 0; step < 300; step++) {
+        error = trainer.train_step(x, y);
+        reference_error = reference_trainer.train_step(x, y);
+    }
+    REQUIRE(reference_error < 1e-3);
+    REQUIRE(error < 1e-3);
+    REQUIRE(max_abs_diff(model.forward(x), reference->forward(x)) < 0.05);
+
+    // Two 8-bit codes per value and two scales per block instead of two floats per value
+    FullyConnectedLayer wide(64, 64, lin);
+    size_t quantized_bytes = QuantizedAdam(wide.parameters(), 0.01, 0.9, 0.999, 1e-8).state_bytes();
+    Adam full(wide.parameters(), 0.01, 0.9, 0.999, 1e-8);
+    REQUIRE(full.state_bytes() > 3.9 * quantized_bytes);
+}
+
+TEST_CASE("Test embedding row-sparse gradients and lazy sparse Adam", "[optimizer]") {
+    const float learning_rate = 0.01, beta1 = 0.9, beta2 = 0.999, epsilon = 1e-8;
+    EmbeddingLayer embedding(10, 2, 3);
+    std::shared_ptr<Parameter> table = embedding.parameters()[0];
+    Matrix initial = table->data;
+    REQUIRE(table->row_sparse);
+
+    Matrix output = embedding.forward(Matrix(2, 3, {1, 3, 1, 0, 9, 3}));
+    REQUIRE(output.cols() == 6);
+    REQUIRE(output[1, 2] == initial[9, 0]);
+    REQUIRE(output[1, 3] == initial[9, 1]);
+    REQUIRE_THROWS(embedding.forward(Matrix(1, 3, {1, 10, 2})));
+    REQUIRE_THROWS(embedding.forward(Matrix(1, 3, {1, 0.5, 2})));
+
+    SparseAdam optimizer({table}, learning_rate, beta1, beta2, epsilon);
+    std::vector<double> w(20), m(20, 0), v(20, 0);
+    std::vector<int> row_t(10, 0);
+    for (size_t i = 0; i < 20; i++) {
+        w[i] = initial[i / 2, i % 2];
+    }
+    // Row 3 is updated in both steps, the rows 0, 1 and 9 only in one, all other rows never
+    std::vector<Matrix> batches = {Matrix(2, 3, {1, 3, 1, 0, 9, 3}), Matrix(1, 3, {3, 7, 7})};
+    for (Matrix& batch : batches) {
+        optimizer.zero_grad();
+        Matrix batch_output = embedding.forward(batch);
+        // The gradient arrives transposed, as it would from a layer that returns a transposed view
+        Matrix stored(batch_output.cols(), batch_output.rows(), 0);
+        for (size_t i = 0; i < batch_output.rows(); i++) {
+            for (size_t j = 0; j < batch_output.cols(); j++) {
+                stored[j, i] = std::sin(i + 0.3f * j);
+            }
+        }
+        Matrix gradient = stored.transpose();
+        REQUIRE(gradient.is_transposed());
+        embedding.backward(gradient);
+
+        std::vector<double> g(20, 0);
+        std::vector<bool> touched(10, false);
+        for (size_t i = 0; i < batch.rows(); i++) {
+            for (size_t t = 0; t < 3; t++) {
+                size_t row = batch[i, t];
+                touched[row] = true;
+                for (size_t d = 0; d < 2; d++) {
+                    g[row * 2 + d] += std::sin(i + 0.3f * (t * 2 + d));
+                }
+            }
+        }
+        std::vector<size_t> expected_rows;
+        for (size_t row = 0; row < 10; row++) {
+            if (touched[row]) {
+                expected_rows.push_back(row);
+            }
+        }
+        REQUIRE(table->touched_rows == expected_rows);
+        optimizer.step();
+
+        for (size_t row : expected_rows) {
+            row_t[row]++;
+            for (size_t i = row * 2; i < row * 2 + 2; i++) {
+                m[i] = beta1 * m[i] + (1 - beta1) * g[i];
+                v[i] = beta2 * v[i] + (1 - beta2) * g[i] * g[i];
+                double m_hat = m[i] / (1 - std::pow(beta1, row_t[row])), v_hat = v[i] / (1 - std::pow(beta2, row_t[row]));
+                w[i] -= learning_rate * m_hat / (std::sqrt(v_hat) + epsilon);
+            }
+        }
+    }
+    for (size_t i = 0; i < 20; i++) {
+        REQUIRE(table->data[i / 2, i % 2] == Approx(w[i]).margin(1e-6));
+    }
+    REQUIRE(table->data[5, 0] == initial[5, 0]);
+
+    // zero_grad only clears the touched rows, which are the only non-zero ones
+    optimizer.zero_grad();
+    REQUIRE(table->touched_rows.empty());
+    REQUIRE(Matrix::sum(Matrix::mul(table->grad, table->grad)) == 0);
+}
+
+TEST_CASE("Test moving average of the weights and swapping it in", "[optimizer]") {
+    const float decay = 0.5;
+    auto weights = std::make_shared<Parameter>(Parameter(Matrix(2, 3, {0.5, -1, 2, 0.1, 0, -0.3})));
+    auto biases = std::make_shared<Parameter>(Parameter(Matrix(1, 3, {1, 2, 3})));
+    SGDWithMomentum optimizer({weights, biases}, 0.1, 0.9);
+    REQUIRE_THROWS(optimizer.swap_ema_weights());
+    optimizer.enable_ema(decay, 2);
+    REQUIRE(optimizer.arena().state_slots() == 2);
+
+    std::vector<double> w(9), velocity(9, 0), ema(9);
+    for (size_t i = 0; i < 9; i++) {
+        w[i] = ema[i] = i < 6 ? weights->data[i / 3, i % 3] : biases->data[0, i - 6];
+    }
+    for (int t = 1; t <= 5; t++) {
+        for (size_t i = 0; i < 9; i++) {
+            Matrix& grad = i < 6 ? weights->grad : biases->grad;
+            grad[i < 6 ? i / 3 : 0, i < 6 ? i % 3 : i - 6] = std::sin(t + i * 0.7f);
+            velocity[i] = 0.9 * velocity[i] - 0.1 * std::sin(t + i * 0.7f);
+            w[i] += velocity[i];
+            if (t % 2 == 0) {
+                ema[i] = decay * ema[i] + (1 - decay) * w[i];
+            }
+        }
+        optimizer.step();
+    }
+
+    Matrix trained = weights->data;
+    optimizer.swap_ema_weights();
+    REQUIRE_THROWS(optimizer.step());
+    for (size_t i = 0; i < 9; i++) {
+        float value = i < 6 ? weights->data[i / 3, i % 3] : biases->data[0, i - 6];
+        REQUIRE(value == Approx(ema[i]).margin(1e-6));
+    }
+    optimizer.swap_ema_weights();
+    REQUIRE(max_abs_diff(weights->data, trained) == 0);
+    for (size_t i = 0; i < 6; i++) {
+        REQUIRE(weights->data[i / 3, i % 3] == Approx(w[i]).margin(1e-6));
+    }
+}
+
+TEST_CASE("Test global gradient norm clipping inside the optimizer step", "[optimizer]") {
+    auto weights = std::make_shared<Parameter>(Parameter(Matrix(1, 2, {1, 1})));
+    auto biases = std::make_shared<Parameter>(Parameter(Matrix(1, 1, 0)));
+    SGD optimizer({weights, biases}, 0.1);
+    optimizer.set_max_grad_norm(1);
+
+    // Global norm 5 is scaled down to 1, the stored gradients stay untouched
+    weights->grad = Matrix(1, 2, {3, 0});
+    biases->grad = Matrix(1, 1, {4});
+    optimizer.step();
+    REQUIRE(optimizer.get_grad_norm() == Approx(5));
+    REQUIRE(weights->data[0, 0] == Approx(1 - 0.1 * 0.6));
+    REQUIRE(weights->data[0, 1] == Approx(1));
+    REQUIRE(biases->data[0, 0] == Approx(-0.1 * 0.8));
+    REQUIRE(biases->grad[0, 0] == 4);
+
+    // Gradients within the limit are not scaled
+    weights->grad = Matrix(1, 2, {0.3, 0});
+    biases->grad = Matrix(1, 1, {0.4});
+    optimizer.step();
+    REQUIRE(optimizer.get_grad_norm() == Approx(0.5));
+    REQUIRE(biases->data[0, 0] == Approx(-0.08 - 0.04));
+}
+
+TEST_CASE("Test gradient accumulation matches a full batch step", "[trainer]") {
+    for (bool prefetch : {false, true}) {
+        LeakyReLU leaky;
+        Linear lin;
+        FullyConnectedLayer layer1(6, 5, leaky);
+        FullyConnectedLayer layer2(5, 3, lin);
+        Sequential model({layer1, layer2});
+        std::shared_ptr<Model> reference = model.clone();
+
+        Matrix inputs = test_input(10, 6);
+        Matrix targets = Matrix::one_hot_encoding(Matrix(10, 1, {0, 1, 2, 0, 1, 2, 0, 1, 2, 0}), 3);
+        CategoricalCrossEntropy loss;
+        SGD optimizer(model.parameters(), 0.1);
+        SGD reference_optimizer(reference->parameters(), 0.1);
+        // The last micro-batch only has one row
+        GradientAccumulationTrainer trainer(model, optimizer, loss, 3, prefetch);
+        Trainer reference_trainer(*reference, reference_optimizer, loss);
+
+        for (int step = 0; step < 3; step++) {
+            float error = trainer.train_step(inputs, targets);
+            float reference_error = reference_trainer.train_step(inputs, targets);
+            REQUIRE(error == Approx(reference_error).epsilon(1e-4));
+        }
+        for (size_t i = 0; i < model.parameters().size(); i++) {
+            REQUIRE(max_abs_diff(model.parameters()[i]->data, reference->parameters()[i]->data) < 1e-5);
+        }
+    }
+}
+
+TEST_CASE("Test eager per-layer updates match a step after the backward pass", "[trainer]") {
+    using Factory = std::function<std::shared_ptr<Optimizer>(std::vector<std::shared_ptr<Parameter>>)>;
+    std::vector<Factory> factories = {
+        [](auto parameters) { return std::make_shared<AdamW>(parameters, 0.01, 0.9, 0.999, 1e-8, 0.01); },
+        [](auto parameters) { return std::make_shared<LAMB>(parameters, 0.01); },
+        [](auto parameters) { return std::make_shared<QuantizedAdam>(parameters, 0.01, 0.9, 0.999, 1e-8, 0, 8); },
+    };
+    for (auto& factory : factories) {
+        for (bool helper_thread : {false, true}) {
+            LeakyReLU leaky;
+            Linear lin;
+            FullyConnectedLayer layer1(6, 5, leaky);
+            DropoutLayer dropout(0);
+            FullyConnectedLayer layer2(5, 3, lin);
+            Sequential model({layer1, dropout, layer2});
+            std::shared_ptr<Model> reference = model.clone();
+
+            Matrix inputs = test_input(10, 6);
+            Matrix targets = Matrix::one_hot_encoding(Matrix(10, 1, {0, 1, 2, 0, 1, 2, 0, 1, 2, 0}), 3);
+            CategoricalCrossEntropy loss;
+            std::shared_ptr<Optimizer> optimizer = factory(model.parameters());
+            std::shared_ptr<Optimizer> reference_optimizer = factory(reference->parameters());
+            EagerTrainer trainer(model, *optimizer, loss, helper_thread);
+            Trainer reference_trainer(*reference, *reference_optimizer, loss);
+
+            for (int step = 0; step < 3; step++) {
+                float error = trainer.train_step(inputs, targets);
+                float reference_error = reference_trainer.train_step(inputs, targets);
+                REQUIRE(error == Approx(reference_error).epsilon(1e-4));
+            }
+            for (size_t i = 0; i < model.parameters().size(); i++) {
+                REQUIRE(max_abs_diff(model.parameters()[i]->data, reference->parameters()[i]->data) < 1e-5);
+            }
+        }
+    }
+
+    // Clipping needs all gradients before the first update
+    Linear lin;
+    FullyConnectedLayer layer(2, 1, lin);
+    MeanSquaredError loss;
+    {
+        Sequential model({layer});
+        SGD optimizer(model.parameters(), 0.1);
+        optimizer.set_max_grad_norm(1);
+        EagerTrainer trainer(model, optimizer, loss);
+        REQUIRE_THROWS(trainer.train_step(test_input(2, 2), Matrix(2, 1, 0)));
+    }
+
+    SGD other_optimizer(layer.parameters(), 0.1);
+    FullyConnectedLayer other_layer(2, 1, lin);
+    Sequential other_model({layer, other_layer});
+    REQUIRE_THROWS(EagerTrainer(other_model, other_optimizer, loss));
+}
+
+TEST_CASE("Test data-parallel training step matches single-threaded step", "[trainer]") {
+    LeakyReLU leaky;
+    Linear lin;
+    FullyConnectedLayer layer1(6, 5, leaky);
+    FullyConnectedLayer layer2(5, 3, lin);
+    Sequential model({layer1, layer2});
+    std::shared_ptr<Model> reference = model.clone();
+
+    Matrix inputs = test_input(10, 6);
+    Matrix targets = Matrix::one_hot_encoding(Matrix(10, 1, {0, 1, 2, 0, 1, 2, 0, 1, 2, 0}), 3);
+    CategoricalCrossEntropy loss;
+    SGD optimizer(model.parameters(), 0.1);
+    SGD reference_optimizer(reference->parameters(), 0.1);
+    DataParallelTrainer trainer(model, optimizer, loss, 3);
+    Trainer reference_trainer(*reference, reference_optimizer, loss);
+
+    for (int step = 0; step < 3; step++) {
+        float error = trainer.train_step(inputs, targets);
+        float reference_error = reference_trainer.train_step(inputs, targets);
+        REQUIRE(error == Approx(reference_error).epsilon(1e-4));
+    }
+    for (size_t i = 0; i < model.parameters().size(); i++) {
+        REQUIRE(max_abs_diff(model.parameters()[i]->data, reference->parameters()[i]->data) < 1e-5);
+    }
+    // Errors of the replicas reach the caller instead of terminating inside the parallel region
+    REQUIRE_THROWS(trainer.train_step(test_input(10, 4), targets));
+}
+
+TEST_CASE("Test pipeline training matches single-threaded training for both schedules", "[trainer]") {
+    for (PipelineSchedule schedule : {PipelineSchedule::GPipe, PipelineSchedule::OneFOneB}) {
+        LeakyReLU leaky;
+        Linear lin;
+        FullyConnectedLayer layer1(6, 8, leaky);
+        FullyConnectedLayer layer2(8, 5, leaky);
+        FullyConnectedLayer layer3(5, 3, lin);
+        Sequential model({layer1, layer2, layer3});
+        std::shared_ptr<Model> reference = model.clone();
+
+        Matrix inputs = test_input(10, 6);
+        Matrix targets = Matrix::one_hot_encoding(Matrix(10, 1, {0, 1, 2, 0, 1, 2, 0, 1, 2, 0}), 3);
+        CategoricalCrossEntropy loss;
+        SGD optimizer(model.parameters(), 0.1);
+        SGD reference_optimizer(reference->parameters(), 0.1);
+        PipelineTrainer trainer(model, optimizer, loss, {1, 1, 1}, 4, schedule);
+        Trainer reference_trainer(*reference, reference_optimizer, loss);
+
+        for (int step = 0; step < 3; step++) {
+            float error = trainer.train_step(inputs, targets);
+            float reference_error = reference_trainer.train_step(inputs, targets);
+            REQUIRE(error == Approx(reference_error).epsilon(1e-4));
+        }
+        for (size_t i = 0; i < model.parameters().size(); i++) {
+            REQUIRE(max_abs_diff(model.parameters()[i]->data, reference->parameters()[i]->data) < 1e-5);
+        }
+        const PipelineStats& stats = trainer.stats();
+        REQUIRE(stats.stage_busy_seconds.size() == 3);
+        for (size_t stage = 0; stage < 3; stage++) {
+            REQUIRE(stats.utilization(stage) > 0);
+            REQUIRE(stats.utilization(stage) <= 1);
+        }
+        REQUIRE(stats.bubble_fraction() >= 0);
+        REQUIRE(stats.bubble_fraction() < 1);
+    }
+}
+
+TEST_CASE("Test hogwild training converges on a linear problem", "[trainer]") {
+    Linear lin;
+    FullyConnectedLayer layer(4, 1, lin);
+    Sequential model({layer});
+    MeanSquaredError loss;
+    std::vector<Matrix> inputs, targets;
+    for (size_t batch = 0; batch < 16; batch++) {
+        Matrix x = test_input(8, 4, 0.37f + batch * 0.1f);
+        inputs.push_back(x);
+        targets.push_back(Matrix::add(Matrix::matMul(x, Matrix(4, 1, {1, -2, 0.5, 3})), 0.25));
+    }
+
+    HogwildTrainer trainer(model, loss, 4, 0.01, 0.5);
+    EpochStats first = trainer.train_epoch(inputs, targets);
+    EpochStats last = first;
+    for (int epoch = 0; epoch < 30; epoch++) {
+        last = trainer.train_epoch(inputs, targets);
+    }
+    REQUIRE(first.samples == 16 * 8);
+    REQUIRE(last.samples_per_second() > 0);
+    REQUIRE(last.loss < first.loss * 0.01);
+    REQUIRE(model.parameters()[0]->data[1, 0] == Approx(-2).margin(0.05));
+    REQUIRE_THROWS(trainer.train_epoch({test_input(8, 3)}, {targets[0]}));
+}
+
+TEST_CASE("Test hogwild momentum keeps moving weights without gradients like SGD with momentum", "[trainer]") {
+    Linear lin;
+    FullyConnectedLayer layer(3, 1, lin);
+    Sequential model({layer});
+    std::shared_ptr<Model> reference = model.clone();
+    MeanSquaredError loss;
+    Matrix dense = test_input(4, 3, 0.5f);
+    Matrix sparse = dense;
+    for (size_t row = 0; row < 4; row++) {
+        sparse[row, 2] = 0;
+    }
+    // The third input is zero after the first batch, so only the velocity of the first batch moves its weight
+    std::vector<Matrix> inputs = {dense, sparse, sparse, sparse}, targets(4, Matrix(4, 1, 1));
+
+    HogwildTrainer trainer(model, loss, 1, 0.05, 0.9);
+    trainer.train_epoch({inputs[0], inputs[1]}, {targets[0], targets[1]});
+    trainer.train_epoch({inputs[2], inputs[3]}, {targets[2], targets[3]});
+    SGDWithMomentum optimizer(reference->parameters(), 0.05, 0.9);
+    Trainer reference_trainer(*reference, optimizer, loss);
+    float after_first = 0;
+    for (size_t batch = 0; batch < inputs.size(); batch++) {
+        reference_trainer.train_step(inputs[batch], targets[batch]);
+        if (batch == 0) {
+            after_first = reference->parameters()[0]->data[2, 0];
+        }
+    }
+    REQUIRE(reference->parameters()[0]->data[2, 0] != after_first);
+    for (size_t i = 0; i < model.parameters().size(); i++) {
+        REQUIRE(max_abs_diff(model.parameters()[i]->data, reference->parameters()[i]->data) < 1e-6);
+    }
+}
+
+TEST_CASE("Test parallel memory-mapped CSV loading", "[data]") {
+    auto directory = std::filesystem::temp_directory_path() / ("csv_test_" + std::to_string(std::random_device{}()));
+    std::filesystem::create_directories(directory);
+    DataLoader loader;
+
+    // Large enough to be split into several chunks when running with several threads
+    Matrix values = test_input(3000, 40);
+    std::string path = (directory / "values.csv").string();
+    loader.write_to_csv(values, path);
+    Matrix loaded = loader.load_from_csv(path);
+    REQUIRE(loaded.rows() == 3000);
+    REQUIRE(loaded.cols() == 40);
+    REQUIRE(max_abs_diff(loaded, values) < 1e-5);
+    REQUIRE(loader.last_stats().bytes == std::filesystem::file_size(path));
+
+    auto write = [&](std::string name, std::string content) {
+        std::ofstream file(directory / name, std::ios::binary);
+        file << content;
+        return (directory / name).string();
+    };
+    // Windows line endings, blank lines, spaces, signs and no final newline
+    Matrix small = loader.load_from_csv(write("small.csv", "1, 2.5,-3\r\n\r\n+4,5e-1 ,6\n\n7,8,9"));
+    REQUIRE(max_abs_diff(small, Matrix(3, 3, {1, 2.5, -3, 4, 0.5, 6, 7, 8, 9})) == 0);
+
+    REQUIRE_THROWS(loader.load_from_csv(write("ragged.csv", "1,2,3\n4,5\n")));
+    REQUIRE_THROWS(loader.load_from_csv(write("long.csv", "1,2\n3,4,5\n")));
+    REQUIRE_THROWS(loader.load_from_csv(write("invalid.csv", "1,2\n3,x\n")));
+    REQUIRE_THROWS(loader.load_from_csv((directory / "missing.csv").string()));
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Test binary tensor files and the binary CSV cache", "[data]") {
+    auto directory = std::filesystem::temp_directory_path() / ("binary_test_" + std::to_string(std::random_device{}()));
+    std::filesystem::create_directories(directory);
+    DataLoader loader;
+
+    Matrix values = test_input(50, 7);
+    std::string path = (directory / "values.bin").string();
+    loader.write_binary(values, path);
+    REQUIRE(std::filesystem::file_size(path) == 64 + 50 * 7 * sizeof(float));
+    {
+        Matrix mapped = loader.load_binary(path);
+        REQUIRE(mapped.is_view());
+        REQUIRE(reinterpret_cast<uintptr_t>(mapped.raw()) % 64 == 0);
+        REQUIRE(max_abs_diff(mapped, values) == 0);
+        // The mapping is private, writes do not reach the file
+        mapped[0, 0] = 100;
+    }
+    REQUIRE(max_abs_diff(loader.load_binary(path), values) == 0);
+
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(64 + 5);
+        file.put('x');
+    }
+    REQUIRE_THROWS(loader.load_binary(path));
+    REQUIRE_NOTHROW(loader.load_binary(path, false));
+    std::filesystem::resize_file(path, 100);
+    REQUIRE_THROWS(loader.load_binary(path));
+
+    // The first load writes the cache, the second one reads it, a newer CSV file is parsed again
+    DataLoader caching_loader(true);
+    std::string csv_path = (directory / "cached.csv").string();
+    loader.write_to_csv(values, csv_path);
+    Matrix parsed = caching_loader.load_from_csv(csv_path);
+    REQUIRE(!parsed.is_view());
+    REQUIRE(std::filesystem::exists(directory / "cached.bin"));
+    Matrix cached = caching_loader.load_from_csv(csv_path);
+    REQUIRE(max_abs_diff(cached, parsed) == 0);
+    // Loads from the cache return owning matrices as well, so they accept assignments of another shape
+    REQUIRE(!cached.is_view());
+    cached = Matrix(1, 1, 0);
+    loader.write_binary(Matrix(2, 2, 7), (directory / "cached.bin").string());
+    REQUIRE(max_abs_diff(caching_loader.load_from_csv(csv_path), Matrix(2, 2, 7)) == 0);
+    loader.write_to_csv(Matrix(1, 2, {1, 2}), csv_path);
+    std::filesystem::last_write_time(csv_path, std::filesystem::last_write_time(directory / "cached.bin") + std::chrono::seconds(10));
+    Matrix reparsed = caching_loader.load_from_csv(csv_path);
+    REQUIRE(!reparsed.is_view());
+    REQUIRE(reparsed.cols() == 2);
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Test IDX, npy and npz readers and writers", "[data]") {
+    auto directory = std::filesystem::temp_directory_path() / ("formats_test_" + std::to_string(std::random_device{}()));
+    std::filesystem::create_directories(directory);
+    DataLoader loader;
+    auto write = [&](std::string name, std::string content) {
+        std::ofstream file(directory / name, std::ios::binary);
+        file << content;
+        return (directory / name).string();
+    };
+    auto npy = [](std::string header, std::string payload) {
+        header.append(63 - (10 + header.size()) % 64, ' ');
+        header += '\n';
+        return std::string("\x93NUMPY\x01\x00", 8) + static_cast<char>(header.size() & 0xFF) + static_cast<char>(header.size() >> 8) + header + payload;
+    };
+
+    // Two 2 x 2 unsigned byte images and big-endian 16-bit labels
+    Matrix images = loader.load_idx(write("images.idx", std::string("\0\0\x08\x03\0\0\0\x02\0\0\0\x02\0\0\0\x02", 16) + "\x01\x02\x03\x04\x05\x06\x07\xff"));
+    REQUIRE(max_abs_diff(images, Matrix(2, 4, {1, 2, 3, 4, 5, 6, 7, 255})) == 0);
+    Matrix labels = loader.load_idx(write("labels.idx", std::string("\0\0\x0b\x01\0\0\0\x02\x01\x00\xff\xfe", 12)));
+    REQUIRE(max_abs_diff(labels, Matrix(2, 1, {256, -2})) == 0);
+    REQUIRE_THROWS(loader.load_idx(write("short.idx", std::string("\0\0\x08\x01\0\0\0\x05\x01", 9))));
+
+    loader.write_idx(images, (directory / "images_out.idx").string(), IdxType::UnsignedByte);
+    REQUIRE(std::filesystem::file_size(directory / "images_out.idx") == 4 + 8 + 8);
+    REQUIRE(max_abs_diff(loader.load_idx((directory / "images_out.idx").string()), images) == 0);
+    Matrix values = test_input(5, 3);
+    loader.write_idx(values, (directory / "values.idx").string());
+    REQUIRE(max_abs_diff(loader.load_idx((directory / "values.idx").string()), values) == 0);
+    REQUIRE_THROWS(loader.write_idx(values, (directory / "bad.idx").string(), IdxType::UnsignedByte));
+
+    // Little-endian int16, big-endian float64 and a Fortran order float32 array
+    Matrix shorts = loader.load_npy(write("shorts.npy", npy("{'descr': '<i2', 'fortran_order': False, 'shape': (3,), }", std::string("\x01\x00\xff\xff\x00\x01", 6))));
+    REQUIRE(max_abs_diff(shorts, Matrix(3, 1, {1, -1, 256})) == 0);
+    Matrix doubles = loader.load_npy(write("doubles.npy", npy("{'descr': '>f8', 'fortran_order': False, 'shape': (1, 2), }",
+                                                               std::string("\x3f\xf0\0\0\0\0\0\0\xc0\x00\0\0\0\0\0\0", 16))));
+    REQUIRE(max_abs_diff(doubles, Matrix(1, 2, {1, -2})) == 0);
+    std::string column_major;
+    for (float value : {1.0f, 4.0f, 2.0f, 5.0f, 3.0f, 6.0f}) {
+        column_major.append(reinterpret_cast<const char*>(&value), sizeof(float));
+    }
+    Matrix fortran = loader.load_npy(write("fortran.npy", npy("{'descr': '<f4', 'fortran_order': True, 'shape': (2, 3), }", column_major)));
+    REQUIRE(max_abs_diff(fortran, Matrix(2, 3, {1, 2, 3, 4, 5, 6})) == 0);
+    // A version 2 file cut off inside its 4-byte header length and an unknown version
+    REQUIRE_THROWS(loader.load_npy(write("truncated.npy", std::string("\x93NUMPY\x02\x00\x10\x00", 10))));
+    REQUIRE_THROWS(loader.load_npy(write("version.npy", std::string("\x93NUMPY\x04\x00\x10\x00\x00\x00", 12))));
+
+    loader.write_npy(values, (directory / "values.npy").string());
+    Matrix mapped = loader.load_npy((directory / "values.npy").string());
+    REQUIRE(mapped.is_view());
+    REQUIRE(max_abs_diff(mapped, values) == 0);
+
+    // Bytes and 16-bit integers are loaded in narrow storage, wider types as floats
+    CompactMatrix compact_images = loader.load_compact((directory / "images.idx").string());
+    REQUIRE(compact_images.type() == StorageType::UInt8);
+    REQUIRE(compact_images.bytes() == 8);
+    REQUIRE(max_abs_diff(compact_images.matrix(), images) == 0);
+    CompactMatrix compact_labels = loader.load_compact((directory / "labels.idx").string());
+    REQUIRE(compact_labels.type() == StorageType::Int16);
+    REQUIRE(max_abs_diff(compact_labels.matrix(), labels) == 0);
+    CompactMatrix compact_bytes = loader.load_compact(write("bytes.npy", npy("{'descr': '|u1', 'fortran_order': True, 'shape': (2, 3), }",
+                                                                             std::string("\x01\x04\x02\x05\x03\xff", 6))));
+    REQUIRE(compact_bytes.type() == StorageType::UInt8);
+    REQUIRE(max_abs_diff(compact_bytes.matrix(), Matrix(2, 3, {1, 2, 3, 4, 5, 255})) == 0);
+    CompactMatrix compact_shorts = loader.load_compact((directory / "shorts.npy").string());
+    REQUIRE(compact_shorts.type() == StorageType::Int16);
+    REQUIRE(max_abs_diff(compact_shorts.matrix(), shorts) == 0);
+    CompactMatrix compact_values = loader.load_compact((directory / "values.npy").string());
+    REQUIRE(compact_values.type() == StorageType::Float32);
+    REQUIRE(max_abs_diff(compact_values.matrix(), values) == 0);
+    REQUIRE(max_abs_diff(loader.load_compact((directory / "values.idx").string()).matrix(), values) == 0);
+    REQUIRE_THROWS(loader.load_compact((directory / "short.idx").string()));
+
+    MatrixDataset image_rows(loader.load_compact((directory / "images.idx").string()));
+    REQUIRE(max_abs_diff(image_rows.read(1), Matrix(1, 4, {1, 2, 3, 4})) == 0);
+    REQUIRE(max_abs_diff(image_rows.read(5), Matrix(1, 4, {5, 6, 7, 255})) == 0);
+    REQUIRE(image_rows.read(5).rows() == 0);
+
+    loader.write_npz({{"x", values}, {"y", labels}}, (directory / "arrays.npz").string());
+    std::map<std::string, Matrix> arrays = loader.load_npz((directory / "arrays.npz").string());
+    REQUIRE(arrays.size() == 2);
+    REQUIRE(max_abs_diff(arrays.at("x"), values) == 0);
+    REQUIRE(max_abs_diff(arrays.at("y"), labels) == 0);
+    REQUIRE_THROWS(loader.load_npz((directory / "values.npy").string()));
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Test streaming datasets with a prefetching iterator", "[data]") {
+    auto directory = std::filesystem::temp_directory_path() / ("dataset_test_" + std::to_string(std::random_device{}()));
+    std::filesystem::create_directories(directory);
+    DataLoader loader;
+    Matrix values = test_input(103, 7);
+    Matrix labels(103, 1, 0);
+    for (size_t row = 0; row < 103; row++) {
+        labels[row, 0] = row % 3;
+    }
+    loader.write_to_csv(values, (directory / "values.csv").string());
+    loader.write_binary(labels, (directory / "labels.bin").string());
+
+    std::shared_ptr<Dataset> inputs = open_dataset((directory / "values.csv").string());
+    std::shared_ptr<Dataset> targets = open_dataset((directory / "labels.bin").string());
+    DataIterator iterator(*inputs, *targets, 10, 3, [](Matrix& x, Matrix& y) {
+        y = Matrix::one_hot_encoding(y, 3);
+    });
+    // Two passes, the second one starts from the first rows again
+    for (size_t pass = 0; pass < 2; pass++) {
+        Matrix x, y;
+        size_t row = 0;
+        while (iterator.next(x, y)) {
+            REQUIRE(x.rows() == (row == 100 ? 3 : 10));
+            REQUIRE(y.cols() == 3);
+            REQUIRE(max_abs_diff(x, Matrix::slice_rows(values, row, row + x.rows())) < 1e-5);
+            REQUIRE(y[0, row % 3] == 1);
+            row += x.rows();
+        }
+        REQUIRE(row == 103);
+        REQUIRE(iterator.stats().batches == 11);
+        REQUIRE(iterator.stats().rows == 103);
+    }
+
+    // Errors of the background thread reach the caller
+    MatrixDataset short_targets(Matrix(50, 1, 0));
+    DataIterator mismatched(*inputs, short_targets, 20);
+    Matrix x, y;
+    auto drain = [&]() {
+        while (mismatched.next(x, y)) {}
+    };
+    REQUIRE_THROWS(drain());
+    std::ofstream(directory / "invalid.csv") << "1,2\n3,x\n";
+    CsvDataset invalid((directory / "invalid.csv").string());
+    REQUIRE_THROWS(invalid.read(2));
+    REQUIRE_THROWS(open_dataset((directory / "values.txt").string()));
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Test per-epoch shuffled, stratified and weighted batch sampling", "[data]") {
+    // Row i holds i in every column, so a batch tells which rows were sampled
+    const size_t rows = 90;
+    Matrix inputs(rows, 5, 0), labels(rows, 1, 0);
+    for (size_t row = 0; row < rows; row++) {
+        for (size_t col = 0; col < 5; col++) {
+            inputs[row, col] = row;
+        }
+        labels[row, 0] = row % 3;
+    }
+    BatchSampler sampler(inputs, Matrix::one_hot_encoding(labels, 3), 16, false, 42);
+    REQUIRE(sampler.num_batches() == 6);
+
+    std::vector<std::vector<size_t>> epochs;
+    std::set<const float*> buffers;
+    size_t first_epoch_buffers = 0;
+    for (size_t epoch = 0; epoch < 2; epoch++) {
+        std::vector<size_t> order;
+        while (sampler.next()) {
+            Matrix x = sampler.inputs();
+            Matrix y = sampler.targets();
+            REQUIRE(x.rows() == (order.size() == 80 ? 10 : 16));
+            buffers.insert(sampler.inputs().raw());
+            for (size_t i = 0; i < x.rows(); i++) {
+                size_t row = x[i, 0];
+                REQUIRE(x[i, 4] == row);
+                REQUIRE(y[i, row % 3] == 1);
+                order.push_back(row);
+            }
+        }
+        epochs.push_back(order);
+        if (epoch == 0) {
+            first_epoch_buffers = buffers.size();
+        }
+        std::sort(order.begin(), order.end());
+        for (size_t row = 0; row < rows; row++) {
+            REQUIRE(order[row] == row);
+        }
+    }
+    REQUIRE(epochs[0] != epochs[1]);
+    // The batch buffers of the first epoch are reused in the second one
+    REQUIRE(buffers.size() == first_epoch_buffers);
+    REQUIRE(buffers.size() <= 4);
+
+    BatchSampler dropping(inputs, labels, 16, true, 42);
+    size_t batches = 0;
+    while (dropping.next()) {
+        REQUIRE(dropping.inputs().rows() == 16);
+        batches++;
+    }
+    REQUIRE(batches == 5);
+    REQUIRE(dropping.num_batches() == 5);
+
+    // With equal classes every batch of 3 consecutive rows holds each class once
+    BatchSampler stratified(inputs, labels, 3, false, 7);
+    stratified.stratify(labels);
+    while (stratified.next()) {
+        std::set<float> classes;
+        for (size_t i = 0; i < 3; i++) {
+            classes.insert(stratified.targets().raw()[i]);
+        }
+        REQUIRE(classes.size() == 3);
+    }
+
+    // Rows of weight 0 are never drawn
+    std::vector<float> weights(rows, 0);
+    weights[5] = 1;
+    weights[50] = 3;
+    BatchSampler weighted(inputs, labels, 32, false, 3);
+    weighted.weight(weights, 400);
+    REQUIRE(weighted.num_batches() == 13);
+    size_t row_50 = 0;
+    while (weighted.next()) {
+        for (size_t i = 0; i < weighted.inputs().rows(); i++) {
+            float row = weighted.inputs().raw()[i * 5];
+            REQUIRE((row == 5 || row == 50));
+            row_50 += row == 50;
+        }
+    }
+    REQUIRE(row_50 > 250);
+    REQUIRE(row_50 < 350);
+
+    REQUIRE_THROWS(BatchSampler(inputs, Matrix(rows - 1, 1, 0), 16));
+    REQUIRE_THROWS(weighted.weight(std::vector<float>(rows, 0)));
+    REQUIRE_THROWS(stratified.stratify(Matrix(rows, 1, -1)));
+}
+
+TEST_CASE("Test compact narrow storage normalized while gathering", "[data]") {
+    Matrix pixels(40, 6, 0);
+    for (size_t row = 0; row < 40; row++) {
+        for (size_t col = 0; col < 6; col++) {
+            pixels[row, col] = (row * 7 + col * 31) % 256;
+        }
+    }
+    CompactMatrix compact(pixels, StorageType::UInt8);
+    REQUIRE(compact.bytes() == 40 * 6);
+    REQUIRE(max_abs_diff(compact.matrix(), pixels) == 0);
+    compact.normalize(1 / 255.0f);
+    REQUIRE(max_abs_diff(compact.matrix(), Matrix::div(pixels, 255.0)) < 1e-6);
+
+    // Per-column scale and offset
+    compact.normalize({1, 2, 3, 4, 5, 6}, {0, -1, 0, 0, 0, 10});
+    std::vector<size_t> indices = {39, 0, 17};
+    Matrix gathered(3, 6, 0);
+    compact.gather(indices.data(), 3, gathered.raw());
+    for (size_t i = 0; i < 3; i++) {
+        REQUIRE(gathered[i, 1] == pixels[indices[i], 1] * 2 - 1);
+        REQUIRE(gathered[i, 5] == pixels[indices[i], 5] * 6 + 10);
+    }
+    indices = {40};
+    REQUIRE_THROWS(compact.gather(indices.data(), 1, gathered.raw()));
+
+    Matrix signed_values(2, 2, {-32768, 32767, -5, 0});
+    CompactMatrix int16(signed_values, StorageType::Int16);
+    REQUIRE(int16.bytes() == 8);
+    REQUIRE(max_abs_diff(int16.matrix(), signed_values) == 0);
+    REQUIRE_THROWS(CompactMatrix(Matrix(1, 1, 256), StorageType::UInt8));
+    REQUIRE_THROWS(CompactMatrix(Matrix(1, 1, 0.5), StorageType::UInt8));
+    REQUIRE_THROWS(CompactMatrix(Matrix(1, 1, 40000), StorageType::Int16));
+
+    // Exact halves survive, others round to the nearest half, large values overflow to infinity
+    float smallest = std::ldexp(1.0f, -24);
+    Matrix floats(1, 8, {1.5f, -65504, smallest, 3 * smallest, 0.1f, 1e6f, -2.5f, 2049});
+    CompactMatrix halves(floats, StorageType::Float16);
+    REQUIRE(halves.bytes() == 16);
+    Matrix converted = halves.matrix();
+    REQUIRE(converted[0, 0] == 1.5f);
+    REQUIRE(converted[0, 1] == -65504);
+    REQUIRE(converted[0, 2] == smallest);
+    REQUIRE(converted[0, 3] == 3 * smallest);
+    REQUIRE(std::abs(converted[0, 4] - 0.1f) < 1e-4);
+    REQUIRE(std::isinf(converted[0, 5]));
+    REQUIRE(converted[0, 6] == -2.5f);
+    REQUIRE(converted[0, 7] == 2048);
+    REQUIRE(std::isnan(CompactMatrix(Matrix(1, 1, NAN), StorageType::Float16).matrix()[0, 0]));
+
+    // Float32 keeps a bound matrix on its storage instead of copying it, a transposed one is made row-major
+    std::shared_ptr<float> storage(new float[12], std::default_delete<float[]>());
+    std::iota(storage.get(), storage.get() + 12, 0.0f);
+    CompactMatrix bound(Matrix::view_of(3, 4, storage.get(), storage), StorageType::Float32);
+    REQUIRE(bound.bytes() == 48);
+    storage.get()[5] = 42;
+    REQUIRE(bound.matrix()[1, 1] == 42);
+    Matrix small(2, 3, {1, 2, 3, 4, 5, 6});
+    bound = CompactMatrix(small.transpose(), StorageType::Float32);
+    REQUIRE(storage.get()[0] == 0);
+    REQUIRE(max_abs_diff(bound.matrix(), Matrix(3, 2, {1, 4, 2, 5, 3, 6})) == 0);
+
+    // A sampler over compact inputs gives the normalized batches of a sampler over the float inputs
+    Matrix labels(40, 1, 0);
+    CompactMatrix compact_pixels(pixels, StorageType::UInt8);
+    compact_pixels.normalize(1 / 255.0f);
+    BatchSampler float_sampler(Matrix::div(pixels, 255.0), labels, 16, false, 11);
+    BatchSampler compact_sampler(compact_pixels, labels, 16, false, 11);
+    size_t batches = 0;
+    while (float_sampler.next()) {
+        REQUIRE(compact_sampler.next());
+        REQUIRE(max_abs_diff(compact_sampler.inputs(), float_sampler.inputs()) < 1e-6);
+        batches++;
+    }
+    REQUIRE(batches == 3);
+}
+
+TEST_CASE("Test ring all-reduce and distributed training across local processes", "[distributed]") {
+    auto directory = std::filesystem::temp_directory_path() / ("ring_test_" + std::to_string(std::random_device{}()));
+    std::filesystem::create_directories(directory);
+    std::string address = "unix:" + directory.string();
+    // Spans several chunks per segment and does not divide evenly into the segments
+    size_t size = 100003;
+    size_t failed = run_local_processes(3, address, [&](ProcessGroup& group) {
+        std::vector<float> data(size);
+        for (size_t i = 0; i < size; i++) {
+            data[i] = (group.rank() + 1) * static_cast<float>(i % 97);
+        }
+        group.all_reduce(data.data(), size);
+        for (size_t i = 0; i < size; i++) {
+            if (data[i] != 6 * static_cast<float>(i % 97)) {
+                throw std::runtime_error("Wrong all-reduce result at " + std::to_string(i));
+            }
+        }
+        std::vector<float> weights(size, static_cast<float>(group.rank()));
+        group.broadcast(weights.data(), size, 1);
+        if (weights.front() != 1 || weights.back() != 1) {
+            throw std::runtime_error("Wrong broadcast result");
+        }
+        group.barrier();
+    });
+    REQUIRE(failed == 0);
+
+    LeakyReLU leaky;
+    Linear lin;
+    FullyConnectedLayer layer1(6, 5, leaky);
+    FullyConnectedLayer layer2(5, 3, lin);
+    Sequential model({layer1, layer2});
+    std::shared_ptr<Model> reference = model.clone();
+    Matrix inputs = test_input(10, 6);
+    Matrix targets = Matrix::one_hot_encoding(Matrix(10, 1, {0, 1, 2, 0, 1, 2, 0, 1, 2, 0}), 3);
+
+    failed = run_local_processes(2, address, [&](ProcessGroup& group) {
+        CategoricalCrossEntropy loss;
+        SGD optimizer(model.parameters(), 0.1);
+        SGD reference_optimizer(reference->parameters(), 0.1);
+        // Small buckets, so the gradients are reduced in several buckets during the backward pass
+        DistributedTrainer trainer(model, optimizer, loss, group, 16);
+        Trainer reference_trainer(*reference, reference_optimizer, loss);
+        // Every rank trains on its half of the batch
+        Matrix local_inputs = Matrix::slice_rows(inputs, group.rank() * 5, group.rank() * 5 + 5);
+        Matrix local_targets = Matrix::slice_rows(targets, group.rank() * 5, group.rank() * 5 + 5);
+        for (int step = 0; step < 3; step++) {
+            float error = trainer.train_step(local_inputs, local_targets);
+            float reference_error = reference_trainer.train_step(inputs, targets);
+            if (std::abs(error - reference_error) > 1e-4 * std::abs(reference_error)) {
+                throw std::runtime_error("Distributed loss differs from the full batch loss");
+            }
+        }
+        for (size_t i = 0; i < model.parameters().size(); i++) {
+            if (max_abs_diff(model.parameters()[i]->data, reference->parameters()[i]->data) > 1e-5) {
+                throw std::runtime_error("Distributed weights differ from the full batch weights");
+            }
+        }
+    });
+    std::filesystem::remove_all(directory);
+    REQUIRE(failed == 0);
+}